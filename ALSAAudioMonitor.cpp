@@ -0,0 +1,322 @@
+#include <alsa/asoundlib.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "AudioMonitor.h"
+#include "Util.h"
+
+namespace {
+
+class ALSAAudioMonitor : public AudioMonitor {
+  AudioMonitorHandler *handler;
+  bool is_configured;
+
+  std::string device_name;
+  snd_pcm_uframes_t period_frames;
+  unsigned sample_rate;
+  unsigned channels;
+  snd_pcm_format_t format;
+  snd_pcm_t *pcm;
+
+  pthread_t capture_thread;
+  std::atomic<bool> running;
+
+  /// The deinterleaved float conversion buffers handed to the handler.
+  std::vector<float> left_buffer, right_buffer;
+
+  /// The number of frames captured since the stream started, which serves as
+  /// the sample clock, and the elapsed time (see get_elapsed_time_in_seconds())
+  /// it started at, or -1.
+  uint64_t captured_frames;
+  double start_time;
+
+public:
+  ALSAAudioMonitor(AudioMonitorHandler *handler_, const char *device_name_,
+                   unsigned period_frames_)
+    : handler(handler_), is_configured(false), device_name(device_name_),
+      period_frames(period_frames_), sample_rate(44100), channels(2),
+      format(SND_PCM_FORMAT_FLOAT), pcm(0), running(false),
+      captured_frames(0), start_time(-1) {}
+  virtual ~ALSAAudioMonitor() {
+    Stop();
+    if (pcm)
+      snd_pcm_close(pcm);
+    delete handler;
+  }
+
+  virtual void Start();
+  virtual void Stop();
+
+private:
+  int Configure();
+  int SetParameters();
+
+  static void *capture_thread_main(void *arg) {
+    ((ALSAAudioMonitor*) arg)->CaptureLoop();
+    return 0;
+  }
+  void CaptureLoop();
+  bool Recover(int err);
+  void ResyncClock();
+  void ConvertAreas(const snd_pcm_channel_area_t *areas,
+                    snd_pcm_uframes_t offset, snd_pcm_uframes_t frames);
+};
+
+}
+
+AudioMonitor *CreateALSAAudioMonitor(AudioMonitorHandler *handler,
+                                     const char *device_name,
+                                     unsigned period_frames) {
+  return new ALSAAudioMonitor(handler, device_name, period_frames);
+}
+
+int ALSAAudioMonitor::Configure() {
+  int err = snd_pcm_open(&pcm, device_name.c_str(), SND_PCM_STREAM_CAPTURE, 0);
+  if (err < 0) {
+    fprintf(stderr, "failed to open ALSA device '%s': %s\n",
+            device_name.c_str(), snd_strerror(err));
+    pcm = 0;
+    return err;
+  }
+
+  // Don't keep a device we failed to configure open.
+  err = SetParameters();
+  if (err < 0) {
+    snd_pcm_close(pcm);
+    pcm = 0;
+  }
+  return err;
+}
+
+int ALSAAudioMonitor::SetParameters() {
+  snd_pcm_hw_params_t *hw_params;
+  snd_pcm_hw_params_alloca(&hw_params);
+  snd_pcm_hw_params_any(pcm, hw_params);
+
+  // We only support memory mapped capture, which lets us convert straight out
+  // of the device buffer without an extra copy through snd_pcm_readi().
+  int err = snd_pcm_hw_params_set_access(pcm, hw_params,
+                                         SND_PCM_ACCESS_MMAP_INTERLEAVED);
+  if (err < 0)
+    err = snd_pcm_hw_params_set_access(pcm, hw_params,
+                                       SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+  if (err < 0) {
+    fprintf(stderr, "ALSA device does not support mmap access: %s\n",
+            snd_strerror(err));
+    return err;
+  }
+
+  // Prefer float samples, but accept 16-bit integers.
+  format = SND_PCM_FORMAT_FLOAT;
+  if (snd_pcm_hw_params_test_format(pcm, hw_params, format) < 0)
+    format = SND_PCM_FORMAT_S16;
+  err = snd_pcm_hw_params_set_format(pcm, hw_params, format);
+  if (err < 0) {
+    fprintf(stderr, "failed to set ALSA sample format: %s\n",
+            snd_strerror(err));
+    return err;
+  }
+
+  channels = 2;
+  err = snd_pcm_hw_params_set_channels_near(pcm, hw_params, &channels);
+  if (err < 0) {
+    fprintf(stderr, "failed to set ALSA channel count: %s\n",
+            snd_strerror(err));
+    return err;
+  }
+
+  err = snd_pcm_hw_params_set_rate_near(pcm, hw_params, &sample_rate, 0);
+  if (err < 0) {
+    fprintf(stderr, "failed to set ALSA sample rate: %s\n", snd_strerror(err));
+    return err;
+  }
+
+  // The period size is our input latency, so let the user tune it. Keep a
+  // few periods of buffering to absorb scheduling hiccups.
+  int dir = 0;
+  err = snd_pcm_hw_params_set_period_size_near(pcm, hw_params, &period_frames,
+                                               &dir);
+  if (err < 0) {
+    fprintf(stderr, "failed to set ALSA period size: %s\n", snd_strerror(err));
+    return err;
+  }
+  snd_pcm_uframes_t buffer_frames = period_frames * 4;
+  snd_pcm_hw_params_set_buffer_size_near(pcm, hw_params, &buffer_frames);
+
+  err = snd_pcm_hw_params(pcm, hw_params);
+  if (err < 0) {
+    fprintf(stderr, "failed to configure ALSA device: %s\n",
+            snd_strerror(err));
+    return err;
+  }
+  snd_pcm_hw_params_get_period_size(hw_params, &period_frames, &dir);
+  snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_frames);
+
+  // Wake up once per period.
+  snd_pcm_sw_params_t *sw_params;
+  snd_pcm_sw_params_alloca(&sw_params);
+  snd_pcm_sw_params_current(pcm, sw_params);
+  snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_frames);
+  err = snd_pcm_sw_params(pcm, sw_params);
+  if (err < 0) {
+    fprintf(stderr, "failed to set ALSA software parameters: %s\n",
+            snd_strerror(err));
+    return err;
+  }
+
+  fprintf(stderr, "ALSA capture: %s, %u Hz, %u channels, %s, "
+          "%lu frame periods\n", device_name.c_str(), sample_rate, channels,
+          snd_pcm_format_name(format), (unsigned long) period_frames);
+
+  left_buffer.resize(buffer_frames);
+  right_buffer.resize(buffer_frames);
+
+  handler->SetSampleRate(sample_rate);
+
+  return 0;
+}
+
+void ALSAAudioMonitor::ConvertAreas(const snd_pcm_channel_area_t *areas,
+                                    snd_pcm_uframes_t offset,
+                                    snd_pcm_uframes_t frames) {
+  // Mono inputs feed the same channel to both sides.
+  const snd_pcm_channel_area_t *sides[2] = {
+    &areas[0], &areas[channels > 1 ? 1 : 0] };
+  float *outputs[2] = { &left_buffer[0], &right_buffer[0] };
+
+  for (unsigned c = 0; c != 2; ++c) {
+    const snd_pcm_channel_area_t *area = sides[c];
+    const char *base = (const char*) area->addr + area->first / 8;
+    unsigned step = area->step / 8;
+    const char *src = base + offset * step;
+    float *dst = outputs[c];
+
+    if (format == SND_PCM_FORMAT_FLOAT) {
+      for (snd_pcm_uframes_t i = 0; i != frames; ++i, src += step)
+        dst[i] = *(const float*) src;
+    } else {
+      for (snd_pcm_uframes_t i = 0; i != frames; ++i, src += step)
+        dst[i] = *(const int16_t*) src * (1.0f / 32768.0f);
+    }
+  }
+}
+
+bool ALSAAudioMonitor::Recover(int err) {
+  fprintf(stderr, "ALSA capture error: %s\n", snd_strerror(err));
+
+  // Recovering leaves a capture stream prepared but stopped.
+  if (snd_pcm_recover(pcm, err, 1) < 0 || snd_pcm_start(pcm) < 0) {
+    fprintf(stderr, "unable to recover ALSA capture\n");
+    return false;
+  }
+  ResyncClock();
+  return true;
+}
+
+/// Advance the sample clock past the frames lost while the stream was stopped
+/// (by an overrun, or Stop()), so it keeps up with the elapsed time.
+void ALSAAudioMonitor::ResyncClock() {
+  double now = get_elapsed_time_in_seconds();
+  if (start_time < 0) {
+    start_time = now;
+    return;
+  }
+  uint64_t frames = (uint64_t) ((now - start_time) * sample_rate);
+  if (frames > captured_frames)
+    captured_frames = frames;
+}
+
+void ALSAAudioMonitor::CaptureLoop() {
+  // Try to run at real-time priority, but carry on if we aren't allowed to.
+  struct sched_param param;
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+  pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+  int err = snd_pcm_start(pcm);
+  if (err < 0) {
+    fprintf(stderr, "failed to start ALSA capture: %s\n", snd_strerror(err));
+    return;
+  }
+  ResyncClock();
+
+  while (running.load(std::memory_order_relaxed)) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+    if (avail < 0) {
+      if (!Recover(avail))
+        return;
+      continue;
+    }
+
+    if ((snd_pcm_uframes_t) avail < period_frames) {
+      // Wait for the next period, with a timeout so Stop() is noticed.
+      err = snd_pcm_wait(pcm, 100);
+      if (err < 0 && !Recover(err))
+        return;
+      continue;
+    }
+
+    // Consume everything available, which may wrap around the end of the
+    // device buffer and take more than one mmap_begin.
+    snd_pcm_uframes_t remaining = avail;
+    while (remaining) {
+      const snd_pcm_channel_area_t *areas;
+      snd_pcm_uframes_t offset, frames = remaining;
+      err = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+      if (err < 0) {
+        if (!Recover(err))
+          return;
+        break;
+      }
+
+      ConvertAreas(areas, offset, frames);
+
+      snd_pcm_sframes_t committed = snd_pcm_mmap_commit(pcm, offset, frames);
+      if (committed < 0 || (snd_pcm_uframes_t) committed != frames) {
+        if (!Recover(committed >= 0 ? -EPIPE : committed))
+          return;
+        break;
+      }
+
+      double time = (double) captured_frames / sample_rate;
+      handler->HandleBlock(&left_buffer[0], &right_buffer[0], frames, time);
+      captured_frames += frames;
+      remaining -= frames;
+    }
+  }
+}
+
+void ALSAAudioMonitor::Start() {
+  if (!is_configured) {
+    if (Configure() < 0)
+      return;
+    is_configured = true;
+  }
+
+  if (running.load())
+    return;
+
+  running.store(true);
+  if (pthread_create(&capture_thread, 0, capture_thread_main, this) != 0) {
+    fprintf(stderr, "failed to create ALSA capture thread\n");
+    running.store(false);
+  }
+}
+
+void ALSAAudioMonitor::Stop() {
+  if (!running.load())
+    return;
+
+  running.store(false);
+  pthread_join(capture_thread, 0);
+  snd_pcm_drop(pcm);
+  snd_pcm_prepare(pcm);
+}
@@ -0,0 +1,74 @@
+#include "AliasTable.h"
+
+#include "Random.h"
+
+#include <cassert>
+
+void AliasTable::Reserve(unsigned Count) {
+  if (Probabilities.size() >= Count)
+    return;
+  Probabilities.resize(Count);
+  Aliases.resize(Count);
+  Small.resize(Count);
+  Large.resize(Count);
+}
+
+bool AliasTable::Build(const double *Weights, unsigned Count) {
+  Reserve(Count);
+  Size = 0;
+
+  double Total = 0;
+  for (unsigned i = 0; i != Count; ++i) {
+    assert(Weights[i] >= 0 && "Invalid weight!");
+    Total += Weights[i];
+  }
+  if (!(Total > 0))
+    return false;
+
+  // Scale the weights so the average is one, and split them into the columns
+  // which are under and over full.
+  unsigned NumSmall = 0, NumLarge = 0;
+  double Scale = Count / Total;
+  for (unsigned i = 0; i != Count; ++i) {
+    Probabilities[i] = Weights[i] * Scale;
+    if (Probabilities[i] < 1)
+      Small[NumSmall++] = i;
+    else
+      Large[NumLarge++] = i;
+  }
+
+  // Fill each under full column from an over full one.
+  while (NumSmall && NumLarge) {
+    uint32_t Less = Small[--NumSmall];
+    uint32_t More = Large[NumLarge - 1];
+    Aliases[Less] = More;
+    Probabilities[More] -= 1 - Probabilities[Less];
+    if (Probabilities[More] < 1) {
+      --NumLarge;
+      Small[NumSmall++] = More;
+    }
+  }
+
+  // Whatever is left is full, up to rounding.
+  while (NumLarge) {
+    uint32_t i = Large[--NumLarge];
+    Probabilities[i] = 1;
+    Aliases[i] = i;
+  }
+  while (NumSmall) {
+    uint32_t i = Small[--NumSmall];
+    Probabilities[i] = 1;
+    Aliases[i] = i;
+  }
+
+  Size = Count;
+  return true;
+}
+
+unsigned AliasTable::Sample(Random &Generator) const {
+  assert(Size && "Sampling an empty table!");
+  unsigned Column = Generator.GetIndex(Size);
+  if (Generator.GetDouble() < Probabilities[Column])
+    return Column;
+  return Aliases[Column];
+}
@@ -0,0 +1,44 @@
+// -*- C++ -*-
+
+#ifndef ALIASTABLE_H
+#define ALIASTABLE_H
+
+#include <stdint.h>
+
+#include <vector>
+
+class Random;
+
+/// \brief Sample indices with given weights in constant time, using Vose's
+/// alias method.
+///
+/// Building the table is linear in the number of weights. Once the table has
+/// been reserved for as many weights as it will hold, neither building nor
+/// sampling allocates.
+class AliasTable {
+  /// The chance of keeping each column's own index, and the index to use
+  /// otherwise.
+  std::vector<double> Probabilities;
+  std::vector<uint32_t> Aliases;
+  /// The work lists used while building.
+  std::vector<uint32_t> Small, Large;
+  unsigned Size;
+
+public:
+  AliasTable() : Size(0) {}
+
+  /// \brief Make room for \arg Count weights.
+  void Reserve(unsigned Count);
+
+  /// \brief Build the table for the \arg Count non-negative \arg Weights.
+  /// Returns false (leaving the table empty) if all the weights are zero.
+  bool Build(const double *Weights, unsigned Count);
+
+  bool empty() const { return Size == 0; }
+
+  /// \brief Return an index with a chance proportional to its weight. The
+  /// table must not be empty.
+  unsigned Sample(Random &Generator) const;
+};
+
+#endif // ALIASTABLE_H
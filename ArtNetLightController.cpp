@@ -0,0 +1,277 @@
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Clock.h"
+#include "LightController.h"
+
+namespace {
+
+/// \brief A controller driving DMX512 universes over Art-Net.
+///
+/// Lights are patched to consecutive blocks of channels, running on from one
+/// universe into the next, and every channel of a block carries the light's
+/// level. ApplyFrame() only updates the channel levels; a
+/// sender thread transmits the universes which changed at the DMX refresh
+/// rate, and resends the others about once a second as Art-Net requires.
+class ArtNetLightController : public LightController {
+  enum {
+    kUniverseSize = 512,
+    kHeaderSize = 18,
+    kPacketSize = kHeaderSize + kUniverseSize,
+    /// The maximum refresh rate of a full DMX universe.
+    kRefreshRate = 44
+  };
+
+  static const int64_t kKeepAliveInterval = 1000000000;
+
+  int fd;
+  struct sockaddr_storage address;
+  socklen_t address_length;
+
+  unsigned first_universe, num_universes;
+  unsigned channels_per_light;
+
+  pthread_t sender_thread;
+  std::atomic<bool> running;
+
+  // The current levels, and which universes changed since they were last
+  // sent. Protected by lock.
+  pthread_mutex_t lock;
+  std::vector<unsigned char> levels;
+  std::vector<bool> dirty;
+
+  // Sender thread state.
+  std::vector<unsigned char> packets;
+  std::vector<int64_t> last_sent;
+  std::vector<unsigned> pending;
+  unsigned char sequence;
+  uint64_t num_packets, num_errors;
+
+  static void *sender_thread_main(void *arg) {
+    ((ArtNetLightController*) arg)->SenderLoop();
+    return 0;
+  }
+
+  void SenderLoop();
+  void Send(const std::vector<unsigned> &universes);
+
+public:
+  ArtNetLightController(int fd_, const struct sockaddr *address_,
+                        socklen_t address_length_, unsigned first_universe_,
+                        unsigned num_universes_, unsigned channels_per_light_)
+    : fd(fd_), address_length(address_length_),
+      first_universe(first_universe_), num_universes(num_universes_),
+      channels_per_light(channels_per_light_), running(true),
+      levels(num_universes * kUniverseSize), dirty(num_universes, true),
+      packets(num_universes * kPacketSize), last_sent(num_universes),
+      sequence(0), num_packets(0), num_errors(0)
+  {
+    memcpy(&address, address_, address_length);
+
+    // Fill in the ArtDmx headers once, only the sequence changes later.
+    for (unsigned i = 0; i != num_universes; ++i) {
+      unsigned char *p = &packets[i * kPacketSize];
+      unsigned port = first_universe + i;
+      memcpy(p, "Art-Net", 8);
+      p[8] = 0x00;                       // OpDmx, little endian.
+      p[9] = 0x50;
+      p[10] = 0;                         // Protocol version 14, big endian.
+      p[11] = 14;
+      p[12] = 0;                         // Sequence.
+      p[13] = 0;                         // Physical port.
+      p[14] = port & 0xFF;               // Sub-Net and Universe.
+      p[15] = (port >> 8) & 0x7F;        // Net.
+      p[16] = kUniverseSize >> 8;        // Length, big endian.
+      p[17] = kUniverseSize & 0xFF;
+    }
+
+    pthread_mutex_init(&lock, 0);
+    pthread_create(&sender_thread, 0, sender_thread_main, this);
+  }
+
+  ~ArtNetLightController() {
+    running.store(false);
+    pthread_join(sender_thread, 0);
+    pthread_mutex_destroy(&lock);
+    close(fd);
+
+    fprintf(stderr, "art-net: %llu packets sent, %llu errors\n",
+            (unsigned long long) num_packets, (unsigned long long) num_errors);
+  }
+
+  virtual void BeatNotification(unsigned Index, double Time) {
+  }
+
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    // This only touches memory, the beat never waits on the network.
+    pthread_mutex_lock(&lock);
+    for (unsigned w = 0; w != LightFrame::kNumWords; ++w) {
+      for (uint64_t bits = Frame.Mask[w]; bits; bits &= bits - 1) {
+        unsigned i = w * 64 + __builtin_ctzll(bits);
+        unsigned first = i * channels_per_light;
+        if (first + channels_per_light > levels.size())
+          break;
+
+        // DMX channels are 8-bit, so drop the fine part of the level.
+        unsigned char level = Frame.GetLevel(i) >> 8;
+        for (unsigned c = first; c != first + channels_per_light; ++c) {
+          if (levels[c] != level) {
+            levels[c] = level;
+            dirty[c / kUniverseSize] = true;
+          }
+        }
+      }
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  virtual double GetOutputLatency() const {
+    // On average we wait half a refresh for the next send.
+    return .5 / kRefreshRate;
+  }
+};
+
+void ArtNetLightController::SenderLoop() {
+  const int64_t period = 1000000000 / kRefreshRate;
+  int64_t next = get_time_in_ns();
+
+  while (running.load(std::memory_order_relaxed)) {
+    int64_t now = get_time_in_ns();
+
+    // Pick up the universes to send, changed ones and those due a keep alive.
+    pending.clear();
+    pthread_mutex_lock(&lock);
+    for (unsigned i = 0; i != num_universes; ++i) {
+      if (!dirty[i] && now - last_sent[i] < kKeepAliveInterval)
+        continue;
+
+      memcpy(&packets[i * kPacketSize + kHeaderSize],
+             &levels[i * kUniverseSize], kUniverseSize);
+      dirty[i] = false;
+      last_sent[i] = now;
+      pending.push_back(i);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!pending.empty())
+      Send(pending);
+
+    // Run at a fixed rate, but don't try to catch up if we fell behind.
+    next += period;
+    if (next < now)
+      next = now + period;
+    int64_t delay = next - get_time_in_ns();
+    if (delay > 0)
+      usleep(delay / 1000);
+  }
+}
+
+void ArtNetLightController::Send(const std::vector<unsigned> &universes) {
+  // Sequence numbers run 1..255, 0 would disable reordering checks.
+  if (++sequence == 0)
+    sequence = 1;
+  for (unsigned i = 0, e = universes.size(); i != e; ++i)
+    packets[universes[i] * kPacketSize + 12] = sequence;
+
+  unsigned sent = 0;
+#ifdef __linux__
+  // Hand the whole frame to the kernel in as few system calls as possible.
+  const unsigned kMaxBatch = 64;
+  struct mmsghdr messages[kMaxBatch];
+  struct iovec iovecs[kMaxBatch];
+  while (sent != universes.size()) {
+    unsigned count = std::min(kMaxBatch, (unsigned) universes.size() - sent);
+    for (unsigned i = 0; i != count; ++i) {
+      iovecs[i].iov_base = &packets[universes[sent + i] * kPacketSize];
+      iovecs[i].iov_len = kPacketSize;
+      memset(&messages[i], 0, sizeof(messages[i]));
+      messages[i].msg_hdr.msg_name = &address;
+      messages[i].msg_hdr.msg_namelen = address_length;
+      messages[i].msg_hdr.msg_iov = &iovecs[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int result = sendmmsg(fd, messages, count, 0);
+    if (result <= 0) {
+      // Skip the failing packet, it will be resent as a keep alive.
+      if (num_errors++ == 0)
+        perror("art-net: sendmmsg");
+      ++sent;
+      continue;
+    }
+    sent += result;
+    num_packets += result;
+  }
+#else
+  for (; sent != universes.size(); ++sent) {
+    if (sendto(fd, &packets[universes[sent] * kPacketSize], kPacketSize, 0,
+               (const struct sockaddr*) &address, address_length) < 0) {
+      if (num_errors++ == 0)
+        perror("art-net: sendto");
+      continue;
+    }
+    ++num_packets;
+  }
+#endif
+}
+
+}
+
+LightController *CreateArtNetLightController(const char *Address,
+                                             unsigned FirstUniverse,
+                                             unsigned NumUniverses,
+                                             unsigned ChannelsPerLight) {
+  // Port-Address is 15 bits. Check without the sum, which could wrap.
+  if (NumUniverses == 0 || ChannelsPerLight == 0 ||
+      NumUniverses > (1 << 15) || FirstUniverse > (1 << 15) - NumUniverses) {
+    fprintf(stderr, "art-net: invalid universe configuration\n");
+    return 0;
+  }
+
+  // Split off the port, if given.
+  std::string host = Address, port = "6454";
+  std::string::size_type colon = host.rfind(':');
+  if (colon != std::string::npos) {
+    port = host.substr(colon + 1);
+    host = host.substr(0, colon);
+  }
+
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int result = getaddrinfo(host.c_str(), port.c_str(), &hints, &info);
+  if (result != 0) {
+    fprintf(stderr, "art-net: unable to resolve %s: %s\n", Address,
+            gai_strerror(result));
+    return 0;
+  }
+
+  int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+  if (fd == -1) {
+    perror("art-net: socket");
+    freeaddrinfo(info);
+    return 0;
+  }
+
+  // Art-Net nodes are commonly addressed by broadcast.
+  int enable = 1;
+  setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+  LightController *Result =
+    new ArtNetLightController(fd, info->ai_addr, info->ai_addrlen,
+                              FirstUniverse, NumUniverses, ChannelsPerLight);
+  freeaddrinfo(info);
+  return Result;
+}
@@ -0,0 +1,169 @@
+#include "AsyncLightController.h"
+
+#include "Clock.h"
+#include "Latency.h"
+
+#include <pthread.h>
+
+AsyncLightController::AsyncLightController() {}
+AsyncLightController::~AsyncLightController() {}
+
+namespace {
+
+class AsyncLightControllerImpl : public AsyncLightController {
+  LightController *Target;
+
+  pthread_t OutputThread;
+  mutable pthread_mutex_t Lock;
+  pthread_cond_t Wakeup;
+
+  // Shared state, protected by Lock.
+  bool Running;
+  /// The queued frames, merged into one.
+  LightFrame Queued;
+  unsigned QueueDepth;
+  /// When the oldest queued frame was applied, see get_time_in_ns().
+  int64_t QueuedTime;
+  /// The latency origin of the newest queued frame, see Latency.h.
+  int64_t QueuedOrigin;
+  OutputStats Stats;
+  /// The total latency of the frames the output thread has finished, and
+  /// their number.
+  double TotalWriteLatency;
+  uint64_t NumWrittenFrames;
+
+  static void *output_thread_main(void *arg) {
+    ((AsyncLightControllerImpl*) arg)->OutputLoop();
+    return 0;
+  }
+
+  void OutputLoop() {
+    // The levels of the lights as last written. Nothing is known to start
+    // with, so the first write of each light is never redundant.
+    uint16_t Written[LightFrame::kMaxLights];
+    uint64_t Known[LightFrame::kNumWords] = {};
+
+    pthread_mutex_lock(&Lock);
+    for (;;) {
+      while (Running && !QueueDepth)
+        pthread_cond_wait(&Wakeup, &Lock);
+      if (!QueueDepth)
+        break;
+
+      LightFrame F = Queued;
+      int64_t Time = QueuedTime, Origin = QueuedOrigin;
+      Stats.NumCoalescedFrames += QueueDepth - 1;
+      Queued.clear();
+      QueueDepth = 0;
+      pthread_mutex_unlock(&Lock);
+
+      // Write only the lights which changed, without holding the lock, so the
+      // device is never waited on by anyone but us.
+      LightFrame Changes;
+      for (unsigned w = 0; w != LightFrame::kNumWords; ++w) {
+        for (uint64_t Bits = F.Mask[w]; Bits; Bits &= Bits - 1) {
+          unsigned i = w * 64 + __builtin_ctzll(Bits);
+          if ((Known[w] & LightFrame::GetBit(i)) && Written[i] == F.Levels[i])
+            continue;
+          Changes.SetLevel(i, F.Levels[i]);
+          Written[i] = F.Levels[i];
+        }
+        Known[w] |= F.Mask[w];
+      }
+      if (!Changes.empty()) {
+        Target->ApplyFrame(Changes);
+        latency_set_origin(Origin);
+        latency_record(kLatencyStage_Output);
+      }
+
+      unsigned NumWrites = Changes.size();
+      double WriteLatency = (get_time_in_ns() - Time) * 1e-9;
+
+      pthread_mutex_lock(&Lock);
+      Stats.NumWrites += NumWrites;
+      Stats.NumRedundantWrites += F.size() - NumWrites;
+      TotalWriteLatency += WriteLatency;
+      ++NumWrittenFrames;
+      if (WriteLatency > Stats.MaxWriteLatency)
+        Stats.MaxWriteLatency = WriteLatency;
+    }
+    pthread_mutex_unlock(&Lock);
+  }
+
+public:
+  AsyncLightControllerImpl(LightController *Target_)
+    : Target(Target_), Running(true), QueueDepth(0), QueuedTime(0),
+      QueuedOrigin(0), TotalWriteLatency(0), NumWrittenFrames(0)
+  {
+    Stats.NumFrames = Stats.NumCoalescedFrames = 0;
+    Stats.NumWrites = Stats.NumRedundantWrites = 0;
+    Stats.MaxQueueDepth = 0;
+    Stats.MeanWriteLatency = Stats.MaxWriteLatency = 0;
+
+    pthread_mutex_init(&Lock, 0);
+    pthread_cond_init(&Wakeup, 0);
+    pthread_create(&OutputThread, 0, output_thread_main, this);
+  }
+
+  virtual ~AsyncLightControllerImpl() {
+    // The output thread writes anything still queued before exiting.
+    pthread_mutex_lock(&Lock);
+    Running = false;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+    pthread_join(OutputThread, 0);
+
+    pthread_cond_destroy(&Wakeup);
+    pthread_mutex_destroy(&Lock);
+    delete Target;
+  }
+
+  virtual void BeatNotification(unsigned Index, double Time) {
+    Target->BeatNotification(Index, Time);
+  }
+
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    int64_t Now = get_time_in_ns();
+    int64_t Origin = latency_get_origin();
+
+    // Frames the output thread hasn't got to yet are merged, later changes
+    // winning.
+    pthread_mutex_lock(&Lock);
+    if (!QueueDepth)
+      QueuedTime = Now;
+    Queued.Update(Frame);
+    QueuedOrigin = Origin;
+    ++QueueDepth;
+    ++Stats.NumFrames;
+    if (QueueDepth > Stats.MaxQueueDepth)
+      Stats.MaxQueueDepth = QueueDepth;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  virtual double GetOutputLatency() const {
+    return Target->GetOutputLatency();
+  }
+
+  virtual unsigned GetQueueDepth() const {
+    pthread_mutex_lock(&Lock);
+    unsigned Result = QueueDepth;
+    pthread_mutex_unlock(&Lock);
+    return Result;
+  }
+
+  virtual OutputStats GetOutputStats() const {
+    pthread_mutex_lock(&Lock);
+    OutputStats Result = Stats;
+    Result.MeanWriteLatency =
+      NumWrittenFrames ? TotalWriteLatency / NumWrittenFrames : 0;
+    pthread_mutex_unlock(&Lock);
+    return Result;
+  }
+};
+
+}
+
+AsyncLightController *CreateAsyncLightController(LightController *Target) {
+  return new AsyncLightControllerImpl(Target);
+}
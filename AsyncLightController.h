@@ -0,0 +1,45 @@
+// -*- C++ -*-
+
+#ifndef ASYNCLIGHTCONTROLLER_H
+#define ASYNCLIGHTCONTROLLER_H
+
+#include "LightController.h"
+
+#include <stdint.h>
+
+/// \brief A light controller which does the actual output on its own thread.
+///
+/// ApplyFrame() only queues the frame for the output thread, which writes just
+/// the lights whose state differs from what it last wrote. If the output thread
+/// falls behind, the frames queued in the meantime are coalesced into one, so
+/// callers never wait on the output device.
+class AsyncLightController : public LightController {
+protected:
+  AsyncLightController();
+
+public:
+  virtual ~AsyncLightController();
+
+  struct OutputStats {
+    /// The number of frames applied, and of those, how many were merged into
+    /// a later frame before the output thread got to them.
+    uint64_t NumFrames, NumCoalescedFrames;
+    /// The number of light writes done, and skipped as redundant.
+    uint64_t NumWrites, NumRedundantWrites;
+    /// The most frames ever waiting for the output thread.
+    unsigned MaxQueueDepth;
+    /// The time from ApplyFrame() to the frame being written, in seconds.
+    double MeanWriteLatency, MaxWriteLatency;
+  };
+
+  /// \brief The number of applied frames waiting for the output thread.
+  virtual unsigned GetQueueDepth() const = 0;
+
+  virtual OutputStats GetOutputStats() const = 0;
+};
+
+/// \brief Create an asynchronous controller writing to \arg Target (which it
+/// takes ownership of).
+AsyncLightController *CreateAsyncLightController(LightController *Target);
+
+#endif // ASYNCLIGHTCONTROLLER_H
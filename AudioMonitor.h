@@ -11,7 +11,21 @@ protected:
 public:
   virtual ~AudioMonitorHandler();
 
-  virtual void HandleSample(double time, double left, double right) = 0;
+  /// \brief Called by the audio monitor once the input format is known,
+  /// before any samples are delivered.
+  virtual void SetSampleRate(double sample_rate) {}
+
+  /// \brief Deliver a block of \arg frames non-interleaved samples, the first
+  /// of which was captured at \arg start_time.
+  virtual void HandleBlock(const float *left, const float *right,
+                           unsigned frames, double start_time) = 0;
+
+  /// \brief Deliver a single sample. This is an adapter for HandleBlock(), and
+  /// should not be used on any performance sensitive path.
+  void HandleSample(double time, double left, double right) {
+    float left_sample = left, right_sample = right;
+    HandleBlock(&left_sample, &right_sample, 1, time);
+  }
 };
 
 class AudioMonitor {
@@ -23,8 +37,27 @@ public:
 
   virtual void Start() = 0;
   virtual void Stop() = 0;
+
+  /// \brief Block until the monitor runs out of input. Live monitors never
+  /// do, so this only returns for recorded input.
+  virtual void Wait();
 };
 
 AudioMonitor *CreateOSXAudioMonitor(AudioMonitorHandler *handler);
 
+/// \brief Create a monitor which replays the WAV file at \arg path, or raw
+/// 16-bit stereo PCM at \arg raw_sample_rate if \arg path is "-" (stdin).
+/// Samples are timestamped by their position in the stream. If \arg realtime
+/// is false, the input is replayed as fast as the handler can consume it.
+AudioMonitor *CreateFileAudioMonitor(AudioMonitorHandler *handler,
+                                     const char *path, bool realtime,
+                                     double raw_sample_rate = 44100);
+
+/// \brief Create an ALSA capture monitor for \arg device_name (for example,
+/// "default", "hw:1,0" or "hw:Loopback,1,0"), capturing in periods of roughly
+/// \arg period_frames frames.
+AudioMonitor *CreateALSAAudioMonitor(AudioMonitorHandler *handler,
+                                     const char *device_name,
+                                     unsigned period_frames);
+
 #endif // AUDIOMONITOR_H
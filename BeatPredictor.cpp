@@ -0,0 +1,348 @@
+#include "BeatPredictor.h"
+
+#include "Latency.h"
+#include "SPSCQueue.h"
+#include "Util.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+
+BeatPredictor::BeatPredictor() {}
+BeatPredictor::~BeatPredictor() {}
+
+namespace {
+
+class BeatPredictorImpl : public BeatPredictor {
+  enum {
+    kMaxPendingEvents = 64,
+    kNumIntervals = 16,
+    /// The number of consecutive matched beats needed to lock.
+    kLockBeats = 4,
+    /// The number of beat periods without a match after which we unlock.
+    kUnlockBeats = 4
+  };
+
+  /// The beat period range we track, about 60 to 200 BPM. Onset intervals
+  /// outside it are folded in by doubling or halving.
+  static const double kMinPeriod, kMaxPeriod;
+  /// Detected beats within this fraction of a period of a prediction match it.
+  static const double kMatchWindow;
+  /// The loop gains for the phase and the period.
+  static const double kPhaseGain, kPeriodGain;
+
+  struct Event {
+    BeatKind Kind;
+    double Time;
+    double Arrival;
+    /// The latency origin of the detected beat, see Latency.h.
+    int64_t Origin;
+  };
+
+  MusicMonitorHandler *Target;
+  double OutputLatency, DetectionLatency;
+
+  SPSCQueue<Event> Events;
+  std::atomic<unsigned> DroppedEvents;
+
+  pthread_t SchedulerThread;
+  mutable pthread_mutex_t Lock;
+  pthread_cond_t Wakeup;
+  bool Running;
+
+  // Tracker state, only used by the scheduler thread. All times are wall clock
+  // times, except StreamOffset which maps them back to stream times.
+  double Period;
+  double NextBeat;
+  double LastMatch;
+  double StreamOffset;
+  bool Locked;
+  unsigned MatchedRun;
+  double LastOnset;
+  double Intervals[kNumIntervals];
+  unsigned NumIntervals;
+
+  // Phase error statistics, protected by Lock.
+  unsigned ErrorCount;
+  double ErrorSum, ErrorSumSq;
+  double ReportedPeriod;
+  bool ReportedLocked;
+
+  static void *scheduler_thread_main(void *arg) {
+    ((BeatPredictorImpl*) arg)->SchedulerLoop();
+    return 0;
+  }
+
+  void SchedulerLoop();
+  void HandleDetectedBeat(const Event &E);
+  bool EstimatePeriod();
+  void SetLocked(bool Value);
+  void RecordPhaseError(double Error);
+
+  void Deliver(BeatKind Kind, double Time) {
+    Target->HandleBeat(Kind, Time);
+  }
+
+public:
+  BeatPredictorImpl(MusicMonitorHandler *Target_, double OutputLatency_,
+                    double DetectionLatency_)
+    : Target(Target_), OutputLatency(OutputLatency_),
+      DetectionLatency(DetectionLatency_), Events(kMaxPendingEvents),
+      DroppedEvents(0), Running(true), Period(0), NextBeat(0), LastMatch(0),
+      StreamOffset(0), Locked(false), MatchedRun(0), LastOnset(0),
+      NumIntervals(0), ErrorCount(0), ErrorSum(0), ErrorSumSq(0),
+      ReportedPeriod(0), ReportedLocked(false)
+  {
+    pthread_mutex_init(&Lock, 0);
+    pthread_cond_init(&Wakeup, 0);
+    pthread_create(&SchedulerThread, 0, scheduler_thread_main, this);
+  }
+
+  virtual ~BeatPredictorImpl() {
+    pthread_mutex_lock(&Lock);
+    Running = false;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+    pthread_join(SchedulerThread, 0);
+
+    pthread_cond_destroy(&Wakeup);
+    pthread_mutex_destroy(&Lock);
+    delete Target;
+  }
+
+  virtual void HandleBeat(BeatKind Kind, double Time) {
+    // Beats arrive on the analysis thread, which must not be held up by the
+    // lights, so just queue them for the scheduler.
+    Event *E = Events.BeginWrite();
+    if (!E) {
+      DroppedEvents.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    E->Kind = Kind;
+    E->Time = Time;
+    E->Arrival = get_time_in_seconds();
+    E->Origin = latency_get_origin();
+    Events.CommitWrite();
+
+    pthread_mutex_lock(&Lock);
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  virtual PhaseErrorStats GetPhaseErrorStats() const {
+    PhaseErrorStats Result;
+    pthread_mutex_lock(&Lock);
+    Result.Count = ErrorCount;
+    Result.Mean = ErrorCount ? ErrorSum / ErrorCount : 0;
+    Result.RMS = ErrorCount ? sqrt(ErrorSumSq / ErrorCount) : 0;
+    Result.Period = ReportedPeriod;
+    Result.Locked = ReportedLocked;
+    pthread_mutex_unlock(&Lock);
+    return Result;
+  }
+};
+
+const double BeatPredictorImpl::kMinPeriod = 60. / 200;
+const double BeatPredictorImpl::kMaxPeriod = 60. / 60;
+const double BeatPredictorImpl::kMatchWindow = .15;
+const double BeatPredictorImpl::kPhaseGain = .2;
+const double BeatPredictorImpl::kPeriodGain = .05;
+
+void BeatPredictorImpl::SchedulerLoop() {
+  pthread_mutex_lock(&Lock);
+  while (Running) {
+    pthread_mutex_unlock(&Lock);
+
+    // Handle everything the analysis thread has detected.
+    while (Event *E = Events.BeginRead()) {
+      Event Detected = *E;
+      Events.CommitRead();
+      latency_set_origin(Detected.Origin);
+      HandleDetectedBeat(Detected);
+    }
+
+    // Deliver (or, when unlocked, just step past) any predicted beats which
+    // are due, and give up on the tempo if the music has stopped matching.
+    // Predicted beats don't come from any particular audio.
+    latency_set_origin(0);
+    double Now = get_time_in_seconds();
+    if (Period != 0 && Locked && Now - LastMatch > kUnlockBeats * Period)
+      SetLocked(false);
+    // Losing the lock forgets the period, and stepping by zero would never
+    // catch up, so check it on every step.
+    while (Period > 0 && NextBeat - OutputLatency <= Now) {
+      // Don't deliver a burst of stale beats if we were held up.
+      if (Locked && Now - (NextBeat - OutputLatency) < .5 * Period)
+        Deliver(kBeatLow, NextBeat + StreamOffset);
+      NextBeat += Period;
+    }
+
+    pthread_mutex_lock(&Lock);
+    if (!Running || Events.GetSize())
+      continue;
+
+    if (Period == 0) {
+      pthread_cond_wait(&Wakeup, &Lock);
+    } else {
+      // Sleep until the next delivery, or a detected beat. The condition
+      // variable waits for an absolute real time, not a monotonic one, so
+      // convert the delay.
+      int64_t Delay = (int64_t) ((NextBeat - OutputLatency -
+                                  get_time_in_seconds()) * 1e9);
+      struct timeval Now;
+      gettimeofday(&Now, 0);
+      int64_t Deadline = (int64_t) Now.tv_sec * 1000000000 +
+        Now.tv_usec * 1000 + std::max(Delay, (int64_t) 0);
+      struct timespec TS;
+      TS.tv_sec = Deadline / 1000000000;
+      TS.tv_nsec = Deadline % 1000000000;
+      pthread_cond_timedwait(&Wakeup, &Lock, &TS);
+    }
+  }
+  pthread_mutex_unlock(&Lock);
+
+  if (unsigned Dropped = DroppedEvents.load())
+    fprintf(stderr, "beat predictor: %u beats dropped\n", Dropped);
+}
+
+void BeatPredictorImpl::HandleDetectedBeat(const Event &E) {
+  // Only the low beats carry the tempo, everything else goes straight through.
+  if (E.Kind != kBeatLow) {
+    Deliver(E.Kind, E.Time);
+    return;
+  }
+
+  double Onset = E.Arrival - DetectionLatency;
+  StreamOffset = E.Time - Onset;
+
+  if (LastOnset != 0) {
+    Intervals[NumIntervals % kNumIntervals] = Onset - LastOnset;
+    ++NumIntervals;
+  }
+  LastOnset = Onset;
+
+  // Without a tempo, all we can do is pass the beat on and try to find one.
+  if (Period == 0) {
+    Deliver(E.Kind, E.Time);
+    if (EstimatePeriod()) {
+      NextBeat = Onset + Period;
+      LastMatch = Onset;
+      MatchedRun = 0;
+    }
+    return;
+  }
+
+  // Find the nearest prediction. It is usually the beat we just delivered
+  // (K == -1), unless the prediction hasn't been delivered yet (K >= 0).
+  int K = (int) floor((Onset - NextBeat) / Period + .5);
+  double Predicted = NextBeat + K * Period;
+  double Error = Onset - Predicted;
+
+  if (fabs(Error) > kMatchWindow * Period) {
+    // An off beat onset. Pass it on, and re-estimate the tempo if we have been
+    // missing for too long.
+    Deliver(E.Kind, E.Time);
+    if (Onset - LastMatch > kUnlockBeats * Period) {
+      SetLocked(false);
+      if (EstimatePeriod()) {
+        NextBeat = Onset + Period;
+        LastMatch = Onset;
+      }
+    }
+    return;
+  }
+
+  if (Locked)
+    RecordPhaseError(Error);
+
+  // If this beat was already delivered by prediction it is done with,
+  // otherwise deliver it now and skip its (late) prediction.
+  if (!Locked || K >= 0)
+    Deliver(E.Kind, E.Time);
+  if (K >= 0)
+    NextBeat += (K + 1) * Period;
+
+  // Pull the phase and the period towards the detected beat.
+  NextBeat += kPhaseGain * Error;
+  Period = std::max(kMinPeriod, std::min(kMaxPeriod,
+                                         Period + kPeriodGain * Error));
+  LastMatch = Onset;
+  if (++MatchedRun >= kLockBeats && !Locked)
+    SetLocked(true);
+
+  pthread_mutex_lock(&Lock);
+  ReportedPeriod = Period;
+  pthread_mutex_unlock(&Lock);
+}
+
+bool BeatPredictorImpl::EstimatePeriod() {
+  if (NumIntervals < kNumIntervals / 2)
+    return false;
+
+  // Fold the recent intervals into the tracked range, and take the median so
+  // stray onsets don't matter.
+  unsigned N = std::min((unsigned) NumIntervals, (unsigned) kNumIntervals);
+  double Folded[kNumIntervals];
+  unsigned NumFolded = 0;
+  for (unsigned i = 0; i != N; ++i) {
+    double Interval = Intervals[i];
+    if (Interval <= 0 || Interval > 4 * kMaxPeriod)
+      continue;
+    while (Interval < kMinPeriod)
+      Interval *= 2;
+    while (Interval > kMaxPeriod)
+      Interval /= 2;
+    Folded[NumFolded++] = Interval;
+  }
+  if (NumFolded < kNumIntervals / 4)
+    return false;
+
+  std::nth_element(Folded, Folded + NumFolded / 2, Folded + NumFolded);
+  Period = Folded[NumFolded / 2];
+
+  pthread_mutex_lock(&Lock);
+  ReportedPeriod = Period;
+  pthread_mutex_unlock(&Lock);
+  return true;
+}
+
+void BeatPredictorImpl::SetLocked(bool Value) {
+  if (Locked == Value)
+    return;
+
+  Locked = Value;
+  MatchedRun = 0;
+  if (Locked) {
+    fprintf(stderr, "beat predictor: locked at %.1f BPM\n", 60 / Period);
+  } else {
+    fprintf(stderr, "beat predictor: lost lock\n");
+    Period = 0;
+  }
+
+  pthread_mutex_lock(&Lock);
+  ReportedLocked = Locked;
+  ReportedPeriod = Period;
+  pthread_mutex_unlock(&Lock);
+}
+
+void BeatPredictorImpl::RecordPhaseError(double Error) {
+  pthread_mutex_lock(&Lock);
+  ++ErrorCount;
+  ErrorSum += Error;
+  ErrorSumSq += Error * Error;
+  pthread_mutex_unlock(&Lock);
+}
+
+}
+
+BeatPredictor *CreateBeatPredictor(MusicMonitorHandler *Target,
+                                   double OutputLatency,
+                                   double DetectionLatency) {
+  return new BeatPredictorImpl(Target, OutputLatency, DetectionLatency);
+}
@@ -0,0 +1,45 @@
+// -*- C++ -*-
+
+#ifndef BEATPREDICTOR_H
+#define BEATPREDICTOR_H
+
+#include "MusicMonitor.h"
+
+/// \brief A music monitor handler which tracks the tempo and phase of the low
+/// beats and delivers predicted beats ahead of time.
+///
+/// Detected onsets arrive late: after the detector's own delay, and the lights
+/// add their switching delay on top. Once the tracker (a phase-locked loop on
+/// the beat period) is locked, beats are forwarded from a scheduler thread at
+/// the predicted beat time minus the output latency, and detected onsets which
+/// match a prediction are swallowed. Unmatched onsets, other beat kinds, and
+/// everything while unlocked, are forwarded as soon as they arrive.
+class BeatPredictor : public MusicMonitorHandler {
+protected:
+  BeatPredictor();
+
+public:
+  virtual ~BeatPredictor();
+
+  struct PhaseErrorStats {
+    /// The number of detected beats which matched a prediction.
+    unsigned Count;
+    /// The mean and RMS of (detected - predicted) beat time, in seconds.
+    double Mean, RMS;
+    /// The current beat period estimate, in seconds (0 if unknown).
+    double Period;
+    bool Locked;
+  };
+
+  virtual PhaseErrorStats GetPhaseErrorStats() const = 0;
+};
+
+/// \brief Create a predictor forwarding to \arg Target (which it takes
+/// ownership of). Beats are delivered \arg OutputLatency seconds before they
+/// are predicted to occur, and detected beats are assumed to arrive
+/// \arg DetectionLatency seconds after they occurred.
+BeatPredictor *CreateBeatPredictor(MusicMonitorHandler *Target,
+                                   double OutputLatency,
+                                   double DetectionLatency);
+
+#endif // BEATPREDICTOR_H
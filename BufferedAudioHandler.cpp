@@ -0,0 +1,149 @@
+#include "BufferedAudioHandler.h"
+
+#include "Clock.h"
+#include "Latency.h"
+#include "SPSCQueue.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+BufferedAudioHandler::BufferedAudioHandler() {}
+BufferedAudioHandler::~BufferedAudioHandler() {}
+
+namespace {
+
+class BufferedAudioHandlerImpl : public BufferedAudioHandler {
+  enum { kChunkFrames = 256 };
+
+  /// A ring slot, holding a contiguous run of at most kChunkFrames frames.
+  struct Chunk {
+    double start_time;
+    /// When the audio callback received the samples, see get_time_in_ns().
+    int64_t capture_time;
+    unsigned frames;
+    float left[kChunkFrames];
+    float right[kChunkFrames];
+  };
+
+  AudioMonitorHandler *handler;
+  SPSCQueue<Chunk> ring;
+
+  pthread_t analysis_thread;
+  std::atomic<bool> running;
+
+  // Producer side statistics.
+  std::atomic<uint64_t> overrun_count, overrun_frames;
+  double sample_period;
+
+  // Consumer side statistics.
+  std::atomic<unsigned> max_fill_chunks;
+
+  static void *analysis_thread_main(void *arg) {
+    ((BufferedAudioHandlerImpl*) arg)->analysis_loop();
+    return 0;
+  }
+
+  void analysis_loop() {
+    uint64_t reported_overruns = 0;
+
+    while (running.load(std::memory_order_relaxed)) {
+      // Report overruns from here, the audio callback can't print.
+      uint64_t overruns = overrun_count.load(std::memory_order_relaxed);
+      if (overruns != reported_overruns) {
+        fprintf(stderr, "audio input overrun: %llu blocks (%llu frames) "
+                "dropped so far\n", (unsigned long long) overruns,
+                (unsigned long long) overrun_frames.load());
+        reported_overruns = overruns;
+      }
+
+      unsigned fill = ring.GetSize();
+      if (fill > max_fill_chunks.load(std::memory_order_relaxed))
+        max_fill_chunks.store(fill, std::memory_order_relaxed);
+
+      Chunk *chunk = ring.BeginRead();
+      if (!chunk) {
+        // Nothing to do, poll again in a millisecond. We deliberately don't
+        // signal from the producer, so that the audio callback never makes a
+        // system call.
+        usleep(1000);
+        continue;
+      }
+
+      latency_set_origin(chunk->capture_time);
+      latency_record(kLatencyStage_Dequeue);
+      handler->HandleBlock(chunk->left, chunk->right, chunk->frames,
+                           chunk->start_time);
+      ring.CommitRead();
+    }
+  }
+
+public:
+  BufferedAudioHandlerImpl(AudioMonitorHandler *handler_,
+                           unsigned capacity_frames)
+    : handler(handler_),
+      ring((capacity_frames + kChunkFrames - 1) / kChunkFrames),
+      running(true), overrun_count(0), overrun_frames(0),
+      sample_period(1.0 / 44100), max_fill_chunks(0)
+  {
+    pthread_create(&analysis_thread, 0, analysis_thread_main, this);
+  }
+
+  virtual ~BufferedAudioHandlerImpl() {
+    running.store(false);
+    pthread_join(analysis_thread, 0);
+    delete handler;
+  }
+
+  virtual void HandleBlock(const float *left, const float *right,
+                           unsigned frames, double start_time) {
+    int64_t capture_time = get_time_in_ns();
+    for (unsigned i = 0; i != frames; ) {
+      Chunk *chunk = ring.BeginWrite();
+      if (!chunk) {
+        overrun_count.fetch_add(1, std::memory_order_relaxed);
+        overrun_frames.fetch_add(frames - i, std::memory_order_relaxed);
+        break;
+      }
+
+      unsigned n = std::min(frames - i, (unsigned) kChunkFrames);
+      chunk->start_time = start_time + i * sample_period;
+      chunk->capture_time = capture_time;
+      chunk->frames = n;
+      memcpy(chunk->left, left + i, n * sizeof(float));
+      memcpy(chunk->right, right + i, n * sizeof(float));
+      ring.CommitWrite();
+
+      i += n;
+    }
+  }
+
+  virtual void SetSampleRate(double sample_rate) {
+    sample_period = 1.0 / sample_rate;
+    handler->SetSampleRate(sample_rate);
+  }
+
+  virtual uint64_t GetOverrunCount() const {
+    return overrun_count.load();
+  }
+  virtual uint64_t GetOverrunFrames() const {
+    return overrun_frames.load();
+  }
+  virtual unsigned GetMaxFillFrames() const {
+    return max_fill_chunks.load() * kChunkFrames;
+  }
+  virtual unsigned GetCapacityFrames() const {
+    return ring.GetCapacity() * kChunkFrames;
+  }
+};
+
+}
+
+BufferedAudioHandler *CreateBufferedAudioHandler(AudioMonitorHandler *handler,
+                                                 unsigned capacity_frames) {
+  return new BufferedAudioHandlerImpl(handler, capacity_frames);
+}
@@ -0,0 +1,39 @@
+// -*- C++ -*-
+
+#ifndef BUFFEREDAUDIOHANDLER_H
+#define BUFFEREDAUDIOHANDLER_H
+
+#include "AudioMonitor.h"
+
+#include <stdint.h>
+
+/// \brief An audio handler which decouples the audio callback from analysis.
+///
+/// HandleBlock() only copies the samples into a wait-free ring; a dedicated
+/// analysis thread drains the ring into the wrapped handler. If the analysis
+/// thread falls behind, new samples are dropped and counted as overruns.
+class BufferedAudioHandler : public AudioMonitorHandler {
+protected:
+  BufferedAudioHandler();
+
+public:
+  virtual ~BufferedAudioHandler();
+
+  /// \brief The number of blocks (whole or partial) which were dropped.
+  virtual uint64_t GetOverrunCount() const = 0;
+
+  /// \brief The number of sample frames which were dropped.
+  virtual uint64_t GetOverrunFrames() const = 0;
+
+  /// \brief The highest ring fill level seen, in frames.
+  virtual unsigned GetMaxFillFrames() const = 0;
+
+  virtual unsigned GetCapacityFrames() const = 0;
+};
+
+/// \brief Create a buffered handler forwarding to \arg handler (which it takes
+/// ownership of), able to hold \arg capacity_frames frames of backlog.
+BufferedAudioHandler *CreateBufferedAudioHandler(AudioMonitorHandler *handler,
+                                                 unsigned capacity_frames);
+
+#endif // BUFFEREDAUDIOHANDLER_H
@@ -0,0 +1,150 @@
+#include "Clock.h"
+
+#include "Util.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+Clock::Clock() {}
+Clock::~Clock() {}
+
+SimulatedClock::SimulatedClock() {}
+SimulatedClock::~SimulatedClock() {}
+
+namespace {
+
+int64_t system_time_in_ns() {
+#ifdef __APPLE__
+  static mach_timebase_info_data_t timebase;
+  if (timebase.denom == 0)
+    mach_timebase_info(&timebase);
+  uint64_t t = mach_absolute_time();
+  // Split the conversion so the multiply can't overflow.
+  return (t / timebase.denom) * timebase.numer +
+    (t % timebase.denom) * timebase.numer / timebase.denom;
+#else
+  // CLOCK_MONOTONIC_RAW is served from the vDSO, so this is no system call,
+  // and unlike CLOCK_MONOTONIC it is never slewed by NTP.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+class SystemClock : public Clock {
+public:
+  virtual int64_t GetTime() const {
+    return system_time_in_ns();
+  }
+
+  virtual const char *GetName() const {
+    return "system";
+  }
+};
+
+#if defined(__x86_64__)
+class TSCClock : public Clock {
+  uint64_t base_ticks;
+  int64_t base_ns;
+  /// Nanoseconds per tick, in 32.32 fixed point.
+  uint64_t scale;
+
+public:
+  TSCClock() {
+    // Calibrate over a short interval against the system clock. The error in
+    // the scale is about the clock read time over the interval, i.e. well under
+    // a part per million.
+    int64_t start_ns = system_time_in_ns();
+    uint64_t start_ticks = __rdtsc();
+    usleep(20000);
+    int64_t end_ns = system_time_in_ns();
+    uint64_t end_ticks = __rdtsc();
+
+    scale = (uint64_t) (((unsigned __int128) (end_ns - start_ns) << 32) /
+                        (end_ticks - start_ticks));
+    base_ticks = end_ticks;
+    base_ns = end_ns;
+  }
+
+  virtual int64_t GetTime() const {
+    uint64_t ticks = __rdtsc() - base_ticks;
+    return base_ns + (int64_t) (((unsigned __int128) ticks * scale) >> 32);
+  }
+
+  virtual const char *GetName() const {
+    return "tsc";
+  }
+};
+#endif
+
+class SimulatedClockImpl : public SimulatedClock {
+  std::atomic<int64_t> time;
+
+public:
+  SimulatedClockImpl(int64_t start) : time(start) {}
+
+  virtual int64_t GetTime() const {
+    return time.load(std::memory_order_relaxed);
+  }
+
+  virtual const char *GetName() const {
+    return "simulated";
+  }
+
+  virtual void SetTime(int64_t Time) {
+    time.store(Time, std::memory_order_relaxed);
+  }
+
+  virtual void Advance(int64_t Delta) {
+    time.fetch_add(Delta, std::memory_order_relaxed);
+  }
+};
+
+std::atomic<Clock*> current_clock(0);
+
+}
+
+Clock *CreateSystemClock() {
+  return new SystemClock();
+}
+
+Clock *CreateTSCClock() {
+#if defined(__x86_64__)
+  // Without an invariant TSC the counter rate follows frequency scaling, and
+  // may differ between cores.
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)))
+    return new TSCClock();
+  fprintf(stderr, "CPU has no invariant TSC\n");
+#else
+  fprintf(stderr, "TSC clock is only supported on x86-64\n");
+#endif
+  return 0;
+}
+
+SimulatedClock *CreateSimulatedClock(int64_t Start) {
+  return new SimulatedClockImpl(Start);
+}
+
+void set_clock(Clock *clock) {
+  current_clock.store(clock);
+  reset_elapsed_time();
+}
+
+int64_t get_time_in_ns() {
+  // The system clock is read directly, to save a virtual call in the common
+  // case.
+  Clock *clock = current_clock.load(std::memory_order_acquire);
+  return clock ? clock->GetTime() : system_time_in_ns();
+}
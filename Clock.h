@@ -0,0 +1,55 @@
+// -*- C++ -*-
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/// \brief A source of monotonic timestamps, in integer nanoseconds from an
+/// arbitrary epoch.
+class Clock {
+protected:
+  Clock();
+
+public:
+  virtual ~Clock();
+
+  virtual int64_t GetTime() const = 0;
+
+  virtual const char *GetName() const = 0;
+};
+
+/// \brief A clock which only moves when told to, for driving the light
+/// programs faster (or slower) than real time.
+class SimulatedClock : public Clock {
+protected:
+  SimulatedClock();
+
+public:
+  virtual ~SimulatedClock();
+
+  virtual void SetTime(int64_t Time) = 0;
+
+  virtual void Advance(int64_t Delta) = 0;
+};
+
+/// \brief Create the operating system's monotonic clock, which is unaffected by
+/// NTP adjustments (CLOCK_MONOTONIC_RAW on Linux, mach_absolute_time() on OS
+/// X).
+Clock *CreateSystemClock();
+
+/// \brief Create a clock reading the CPU timestamp counter, calibrated against
+/// the system clock. Returns null if the CPU has no invariant TSC.
+Clock *CreateTSCClock();
+
+SimulatedClock *CreateSimulatedClock(int64_t Start = 0);
+
+/// \brief Make \arg clock the clock used for all timestamps (it is not owned),
+/// or go back to the system clock if it is null. This also resets the origin
+/// of get_elapsed_time_in_seconds().
+void set_clock(Clock *clock);
+
+/// \brief Return the current time of the installed clock, in nanoseconds.
+int64_t get_time_in_ns();
+
+#endif // CLOCK_H
@@ -0,0 +1,69 @@
+// -*- C++ -*-
+
+#ifndef FADEENGINE_H
+#define FADEENGINE_H
+
+#include <vector>
+
+/// \brief The intensity of a set of channels, fading between levels over time.
+///
+/// Levels run from 0 (off) to 1 (full). The fade state is kept as one array per
+/// field, so Render() evaluates every channel in a single branch free loop the
+/// compiler vectorizes; a rig of a thousand channels renders in a few
+/// microseconds.
+class FadeEngine {
+public:
+  enum Curve {
+    /// Change at a constant rate.
+    kCurve_Linear,
+    /// Ease in and out (smoothstep), which looks more natural on incandescent
+    /// lamps.
+    kCurve_Smooth
+  };
+
+private:
+  /// The fade of channel i runs from From[i] to To[i], starting at Start[i]
+  /// (in seconds since Epoch) and progressing at Rate[i] per second. Shape[i]
+  /// is 0 for linear fades and 1 for smooth ones.
+  std::vector<float> From, To, Start, Rate, Shape;
+  /// The levels as of the last Render().
+  std::vector<float> Levels;
+
+  /// The times are kept relative to Epoch, which is moved along as time
+  /// passes so single precision stays accurate during a long set.
+  double Epoch;
+  /// The time the last fade ends, relative to Epoch.
+  float End;
+  /// Whether a level changed since the last Render(), and whether that render
+  /// was past the end of every fade.
+  bool Dirty, Settled;
+
+  float GetRelativeTime(double Now);
+  float Evaluate(unsigned Channel, float Time) const;
+
+public:
+  explicit FadeEngine(unsigned NumChannels);
+
+  unsigned size() const { return Levels.size(); }
+
+  /// \brief Set \arg Channel to \arg Level right away, cancelling any fade.
+  void SetLevel(unsigned Channel, float Level);
+
+  /// \brief Fade \arg Channel from its level at \arg Now to \arg Target over
+  /// \arg Duration seconds.
+  void StartFade(unsigned Channel, float Target, double Duration, double Now,
+                 Curve Shape = kCurve_Linear);
+
+  /// \brief Evaluate all channels at time \arg Now. Returns false if no level
+  /// can have changed since the last call, in which case GetLevels() is left
+  /// as it was.
+  bool Render(double Now);
+
+  /// \brief Check whether any channel is still fading at \arg Now.
+  bool IsFading(double Now) const { return Now - Epoch < End; }
+
+  /// \brief The levels of all channels, as of the last Render().
+  const float *GetLevels() const { return Levels.data(); }
+};
+
+#endif // FADEENGINE_H
@@ -0,0 +1,326 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+
+#include "AudioMonitor.h"
+#include "Clock.h"
+#include "Latency.h"
+#include "Util.h"
+
+namespace {
+
+class FileAudioMonitor : public AudioMonitor {
+  enum { kBlockFrames = 1024 };
+
+  /// The sample encodings we know how to decode.
+  enum SampleFormat {
+    kFormat_S16,
+    kFormat_S24,
+    kFormat_S32,
+    kFormat_Float32
+  };
+
+  AudioMonitorHandler *handler;
+  bool is_configured;
+
+  std::string path;
+  bool realtime;
+
+  // Stream format.
+  double sample_rate;
+  unsigned channels;
+  SampleFormat format;
+  unsigned bytes_per_frame;
+
+  // The mapped input file, or -1/null when streaming from stdin.
+  int fd;
+  const unsigned char *map_base;
+  size_t map_size;
+  const unsigned char *data;
+  uint64_t data_frames;
+
+  pthread_t replay_thread;
+  std::atomic<bool> running, thread_started;
+
+  float left_buffer[kBlockFrames], right_buffer[kBlockFrames];
+
+public:
+  FileAudioMonitor(AudioMonitorHandler *handler_, const char *path_,
+                   bool realtime_, double raw_sample_rate)
+    : handler(handler_), is_configured(false), path(path_),
+      realtime(realtime_), sample_rate(raw_sample_rate), channels(2),
+      format(kFormat_S16), bytes_per_frame(4), fd(-1), map_base(0),
+      map_size(0), data(0), data_frames(0), running(false),
+      thread_started(false) {}
+  virtual ~FileAudioMonitor() {
+    Stop();
+    if (map_base)
+      munmap((void*) map_base, map_size);
+    if (fd != -1)
+      close(fd);
+    delete handler;
+  }
+
+  virtual void Start();
+  virtual void Stop();
+  virtual void Wait();
+
+private:
+  bool Configure();
+  bool ParseWAV();
+
+  static void *replay_thread_main(void *arg) {
+    ((FileAudioMonitor*) arg)->ReplayLoop();
+    return 0;
+  }
+  void ReplayLoop();
+  void Deliver(const unsigned char *frames, unsigned count, uint64_t position,
+               double wall_start);
+};
+
+uint16_t read_le16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+uint32_t read_le32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+/// Read a 24-bit sample into the top bits of a 32-bit word.
+uint32_t read_le24(const unsigned char *p) {
+  return (p[0] << 8) | (p[1] << 16) | ((uint32_t) p[2] << 24);
+}
+
+}
+
+AudioMonitor *CreateFileAudioMonitor(AudioMonitorHandler *handler,
+                                     const char *path, bool realtime,
+                                     double raw_sample_rate) {
+  return new FileAudioMonitor(handler, path, realtime, raw_sample_rate);
+}
+
+bool FileAudioMonitor::ParseWAV() {
+  const unsigned char *end = map_base + map_size;
+  if (map_size < 12 || memcmp(map_base, "RIFF", 4) != 0 ||
+      memcmp(map_base + 8, "WAVE", 4) != 0) {
+    fprintf(stderr, "%s: not a WAV file\n", path.c_str());
+    return false;
+  }
+
+  bool have_format = false;
+  for (const unsigned char *chunk = map_base + 12; chunk + 8 <= end; ) {
+    uint32_t size = read_le32(chunk + 4);
+    const unsigned char *body = chunk + 8;
+    if (size > (uint64_t) (end - body))
+      size = end - body;
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+      unsigned tag = read_le16(body);
+      channels = read_le16(body + 2);
+      sample_rate = read_le32(body + 4);
+      unsigned bits = read_le16(body + 14);
+
+      // WAVE_FORMAT_EXTENSIBLE keeps the real tag in the sub-format GUID.
+      if (tag == 0xFFFE && size >= 26)
+        tag = read_le16(body + 24);
+
+      if (tag == 1 && bits == 16) {
+        format = kFormat_S16;
+      } else if (tag == 1 && bits == 24) {
+        format = kFormat_S24;
+      } else if (tag == 1 && bits == 32) {
+        format = kFormat_S32;
+      } else if (tag == 3 && bits == 32) {
+        format = kFormat_Float32;
+      } else {
+        fprintf(stderr, "%s: unsupported WAV encoding (tag %u, %u bits)\n",
+                path.c_str(), tag, bits);
+        return false;
+      }
+      if (channels == 0) {
+        fprintf(stderr, "%s: WAV file has no channels\n", path.c_str());
+        return false;
+      }
+      bytes_per_frame = channels * (bits / 8);
+      have_format = true;
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      if (!have_format) {
+        fprintf(stderr, "%s: WAV data precedes format\n", path.c_str());
+        return false;
+      }
+      data = body;
+      data_frames = size / bytes_per_frame;
+      return true;
+    }
+
+    // Chunks are padded to an even size.
+    chunk = body + size + (size & 1);
+  }
+
+  fprintf(stderr, "%s: WAV file has no data\n", path.c_str());
+  return false;
+}
+
+bool FileAudioMonitor::Configure() {
+  // Raw PCM from stdin is always interleaved 16-bit stereo.
+  if (path == "-")
+    return true;
+
+  fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "unable to open: %s\n", path.c_str());
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    fprintf(stderr, "unable to stat: %s\n", path.c_str());
+    return false;
+  }
+
+  // Map the file rather than reading it, so that long recordings are paged in
+  // on demand and never need to fit in memory at once.
+  map_size = st.st_size;
+  void *base = mmap(0, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "unable to map: %s\n", path.c_str());
+    return false;
+  }
+  map_base = (const unsigned char*) base;
+  madvise(base, map_size, MADV_SEQUENTIAL);
+
+  return ParseWAV();
+}
+
+void FileAudioMonitor::Deliver(const unsigned char *frames, unsigned count,
+                               uint64_t position, double wall_start) {
+  unsigned right_offset = channels > 1 ? bytes_per_frame / channels : 0;
+
+  for (unsigned i = 0; i != count; ++i) {
+    const unsigned char *l = frames + i * bytes_per_frame;
+    const unsigned char *r = l + right_offset;
+
+    switch (format) {
+    case kFormat_S16:
+      left_buffer[i] = (int16_t) read_le16(l) * (1.0f / 32768.0f);
+      right_buffer[i] = (int16_t) read_le16(r) * (1.0f / 32768.0f);
+      break;
+    case kFormat_S24:
+      left_buffer[i] = (int32_t) read_le24(l) * (1.0f / 2147483648.0f);
+      right_buffer[i] = (int32_t) read_le24(r) * (1.0f / 2147483648.0f);
+      break;
+    case kFormat_S32:
+      left_buffer[i] = (int32_t) read_le32(l) * (1.0f / 2147483648.0f);
+      right_buffer[i] = (int32_t) read_le32(r) * (1.0f / 2147483648.0f);
+      break;
+    case kFormat_Float32: {
+      uint32_t lv = read_le32(l), rv = read_le32(r);
+      memcpy(&left_buffer[i], &lv, sizeof(float));
+      memcpy(&right_buffer[i], &rv, sizeof(float));
+      break;
+    }
+    }
+  }
+
+  // Timestamps come from the sample position, not the wall clock, so they are
+  // exact regardless of how fast we are replaying.
+  double time = position / sample_rate;
+
+  if (realtime) {
+    double delay = wall_start + time - get_time_in_seconds();
+    if (delay > 0)
+      usleep(delay * 1e6);
+  }
+
+  // The replayed samples are "captured" as they are handed over.
+  latency_set_origin(get_time_in_ns());
+  handler->HandleBlock(left_buffer, right_buffer, count, time);
+}
+
+void FileAudioMonitor::ReplayLoop() {
+  double wall_start = get_time_in_seconds();
+  uint64_t position = 0;
+
+  if (data) {
+    // Drop pages we are done with every so often, so replaying a whole night
+    // doesn't leave it all resident.
+    const uint64_t release_frames = 1 << 20;
+    uint64_t released = 0;
+
+    while (running.load(std::memory_order_relaxed) &&
+           position != data_frames) {
+      unsigned count = kBlockFrames;
+      if (data_frames - position < count)
+        count = data_frames - position;
+      Deliver(data + position * bytes_per_frame, count, position, wall_start);
+      position += count;
+
+      if (position - released >= release_frames) {
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = ((uintptr_t) (data + released * bytes_per_frame) +
+                           page - 1) & ~(page - 1);
+        uintptr_t end = (uintptr_t) (data + position * bytes_per_frame) &
+          ~(page - 1);
+        if (end > begin)
+          madvise((void*) begin, end - begin, MADV_DONTNEED);
+        released = position;
+      }
+    }
+  } else {
+    unsigned char buffer[kBlockFrames * 4];
+    size_t pending = 0;
+
+    while (running.load(std::memory_order_relaxed)) {
+      ssize_t n = read(STDIN_FILENO, buffer + pending, sizeof(buffer) - pending);
+      if (n <= 0)
+        break;
+      pending += n;
+
+      unsigned count = pending / bytes_per_frame;
+      if (!count)
+        continue;
+      Deliver(buffer, count, position, wall_start);
+      position += count;
+
+      // Keep any trailing partial frame for the next read.
+      size_t used = count * bytes_per_frame;
+      memmove(buffer, buffer + used, pending - used);
+      pending -= used;
+    }
+  }
+
+  fprintf(stderr, "replay finished: %.2fs of audio in %.2fs\n",
+          position / sample_rate, get_time_in_seconds() - wall_start);
+}
+
+void FileAudioMonitor::Start() {
+  if (!is_configured) {
+    if (!Configure())
+      return;
+    handler->SetSampleRate(sample_rate);
+    is_configured = true;
+  }
+
+  if (thread_started.load())
+    return;
+
+  running.store(true);
+  thread_started.store(true);
+  pthread_create(&replay_thread, 0, replay_thread_main, this);
+}
+
+void FileAudioMonitor::Stop() {
+  running.store(false);
+  Wait();
+}
+
+void FileAudioMonitor::Wait() {
+  if (thread_started.exchange(false))
+    pthread_join(replay_thread, 0);
+}
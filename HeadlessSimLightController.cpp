@@ -0,0 +1,478 @@
+#include "SimLightController.h"
+
+#include "LightManager.h"
+#include "Util.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+namespace {
+
+/// The size of the rendered image, in pixels.
+const unsigned kWidth = 640, kHeight = 480;
+
+/// Half the height of the view, in light coordinates. This matches the GLUT
+/// simulator's perspective.
+const float kViewHalfHeight = .95f;
+
+/// How long the beat monitor shows after a beat, in seconds.
+const double kBeatMonitorTime = .05;
+
+/// The frame rate of YUV4MPEG2 dumps. Frames between changes repeat the last
+/// image.
+const unsigned kDumpFrameRate = 30;
+
+/// \brief Write \arg Value to \arg Out as a big endian 32-bit value.
+void append_be32(std::vector<uint8_t> &Out, uint32_t Value) {
+  Out.push_back(Value >> 24);
+  Out.push_back(Value >> 16);
+  Out.push_back(Value >> 8);
+  Out.push_back(Value);
+}
+
+uint32_t png_crc32(const uint8_t *Data, size_t Size, uint32_t CRC) {
+  static uint32_t Table[256];
+  if (!Table[1]) {
+    for (uint32_t i = 0; i != 256; ++i) {
+      uint32_t Value = i;
+      for (unsigned j = 0; j != 8; ++j)
+        Value = Value & 1 ? 0xEDB88320 ^ (Value >> 1) : Value >> 1;
+      Table[i] = Value;
+    }
+  }
+
+  CRC = ~CRC;
+  for (size_t i = 0; i != Size; ++i)
+    CRC = Table[(CRC ^ Data[i]) & 0xFF] ^ (CRC >> 8);
+  return ~CRC;
+}
+
+/// \brief Append a PNG chunk of \arg Type holding \arg Data to \arg Out.
+void append_png_chunk(std::vector<uint8_t> &Out, const char *Type,
+                      const std::vector<uint8_t> &Data) {
+  append_be32(Out, Data.size());
+  size_t Start = Out.size();
+  Out.insert(Out.end(), Type, Type + 4);
+  Out.insert(Out.end(), Data.begin(), Data.end());
+  append_be32(Out, png_crc32(&Out[Start], Out.size() - Start, 0));
+}
+
+/// \brief Encode the RGB \arg Image of \arg Width by \arg Height pixels as a
+/// PNG in \arg Out.
+///
+/// The image data is stored rather than compressed, which needs no library
+/// and is plenty for previews: the images are mostly flat and compress well
+/// later if they are kept.
+void encode_png(const uint8_t *Image, unsigned Width, unsigned Height,
+                std::vector<uint8_t> &Out, std::vector<uint8_t> &Scratch) {
+  static const uint8_t Signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  Out.assign(Signature, Signature + 8);
+
+  Scratch.clear();
+  append_be32(Scratch, Width);
+  append_be32(Scratch, Height);
+  const uint8_t Header[5] = {
+    8, // bits per sample
+    2, // RGB
+    0, 0, 0 }; // deflate, adaptive filtering, not interlaced
+  Scratch.insert(Scratch.end(), Header, Header + 5);
+  append_png_chunk(Out, "IHDR", Scratch);
+
+  // Each row is unfiltered, and the rows go in stored deflate blocks in a
+  // zlib stream.
+  size_t RowSize = 3 * Width, Size = (RowSize + 1) * Height;
+  const size_t kMaxBlockSize = 65535;
+  uint32_t A = 1, B = 0;
+  Scratch.clear();
+  Scratch.push_back(0x78);
+  Scratch.push_back(0x01);
+  size_t Position = 0;
+  do {
+    size_t BlockSize = std::min(Size - Position, kMaxBlockSize);
+    Scratch.push_back(Position + BlockSize == Size);
+    Scratch.push_back(BlockSize);
+    Scratch.push_back(BlockSize >> 8);
+    Scratch.push_back(~BlockSize);
+    Scratch.push_back(~BlockSize >> 8);
+    for (size_t End = Position + BlockSize; Position != End; ++Position) {
+      size_t Column = Position % (RowSize + 1);
+      uint8_t Value = Column ? Image[Position / (RowSize + 1) * RowSize +
+                                     Column - 1] : 0;
+      Scratch.push_back(Value);
+      A = (A + Value) % 65521;
+      B = (B + A) % 65521;
+    }
+  } while (Position != Size);
+  append_be32(Scratch, (B << 16) | A);
+  append_png_chunk(Out, "IDAT", Scratch);
+
+  Scratch.clear();
+  append_png_chunk(Out, "IEND", Scratch);
+}
+
+class HeadlessSimLightController : public SimLightController {
+  LightManager *light_manager;
+  /// The manager's setup, and the radius to draw its lights with.
+  std::vector<LightInfo> Setup;
+  float Radius;
+
+  pthread_t RenderThread;
+  pthread_mutex_t Lock;
+  pthread_cond_t Wakeup;
+
+  // Shared state, protected by Lock.
+  bool Running, Dirty;
+
+  /// Whether the render thread was started, and has been stopped.
+  bool Started, Finished;
+
+  // The render thread's state.
+  /// The current image, as RGB rows from the top.
+  std::vector<uint8_t> Image;
+  /// When the beat monitor must next be cleared (elapsed time), or -1.
+  double BeatMonitorDeadline;
+  unsigned NumRenderedFrames;
+
+  // The dump, if any.
+  std::string DumpPath;
+  FILE *DumpFile;
+  bool DumpPNG;
+  unsigned NumDumpedFrames;
+  /// For YUV4MPEG2, the last image converted, and the time and index of the
+  /// first frame it hasn't been written for.
+  std::vector<uint8_t> DumpFrame;
+  double DumpStartTime;
+  uint64_t NextDumpFrame;
+  std::vector<uint8_t> PNGData, PNGScratch;
+
+  static void *render_thread_main(void *arg) {
+    ((HeadlessSimLightController*) arg)->RenderLoop();
+    return 0;
+  }
+
+  void RenderLoop();
+  void Render(LightManager *Manager);
+  void FillRect(float x0, float y0, float x1, float y1, const uint8_t *Color);
+  void FillDisc(float cx, float cy, float radius, const uint8_t *Color);
+
+  void DumpImage(double Now);
+  void WriteDumpFrames(uint64_t End);
+
+  /// Mark the image as out of date, waking the render thread.
+  void Invalidate() {
+    pthread_mutex_lock(&Lock);
+    Dirty = true;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+  }
+
+public:
+  HeadlessSimLightController()
+    : light_manager(0), Radius(0), Running(true), Dirty(true), Started(false),
+      Finished(false), Image(3 * kWidth * kHeight), BeatMonitorDeadline(-1),
+      NumRenderedFrames(0), DumpFile(0), DumpPNG(false), NumDumpedFrames(0),
+      DumpStartTime(-1), NextDumpFrame(0)
+  {
+    pthread_mutex_init(&Lock, 0);
+    pthread_cond_init(&Wakeup, 0);
+  }
+
+  virtual ~HeadlessSimLightController() {
+    Finish();
+    if (DumpFile)
+      fclose(DumpFile);
+    pthread_cond_destroy(&Wakeup);
+    pthread_mutex_destroy(&Lock);
+  }
+
+  /// Open the dump at \arg Path, returning false on failure.
+  bool OpenDump(const std::string &Path);
+
+  /// Start rendering, once the controller is set up. Returns false on
+  /// failure.
+  bool Start() {
+    if (pthread_create(&RenderThread, 0, render_thread_main, this) != 0) {
+      fprintf(stderr, "headless sim: failed to create render thread\n");
+      return false;
+    }
+    Started = true;
+    return true;
+  }
+
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    Invalidate();
+  }
+
+  virtual void BeatNotification(unsigned Index, double Time) {
+    Invalidate();
+  }
+
+  virtual void MainLoop() {}
+
+  virtual void RegisterLightManager(LightManager &Manager) {
+    pthread_mutex_lock(&Lock);
+    light_manager = &Manager;
+    Setup = Manager.GetSetup();
+    Radius = get_sim_light_radius(Setup);
+    Dirty = true;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+  }
+
+  virtual void Finish() {
+    if (!Started || Finished)
+      return;
+    Finished = true;
+
+    // The render thread draws the final state before exiting.
+    pthread_mutex_lock(&Lock);
+    Running = false;
+    Dirty = true;
+    pthread_cond_signal(&Wakeup);
+    pthread_mutex_unlock(&Lock);
+    pthread_join(RenderThread, 0);
+
+    if (DumpFile) {
+      // Hold the last image until now, and for one more frame.
+      if (DumpStartTime >= 0) {
+        uint64_t End = (uint64_t) ((get_elapsed_time_in_seconds() -
+                                    DumpStartTime) * kDumpFrameRate);
+        WriteDumpFrames(std::max(NextDumpFrame, End) + 1);
+      }
+      if (fclose(DumpFile) != 0)
+        perror("headless sim: fclose");
+      DumpFile = 0;
+    }
+
+    if (DumpPath.empty())
+      fprintf(stderr, "headless sim: %u frames rendered\n", NumRenderedFrames);
+    else
+      fprintf(stderr, "headless sim: %u frames rendered, %u written to: %s\n",
+              NumRenderedFrames, NumDumpedFrames, DumpPath.c_str());
+  }
+};
+
+bool HeadlessSimLightController::OpenDump(const std::string &Path) {
+  DumpPath = Path;
+  size_t Length = Path.size();
+  if (Length > 4 && Path.compare(Length - 4, 4, ".png") == 0) {
+    DumpPNG = true;
+    return true;
+  }
+  if (Length <= 4 || Path.compare(Length - 4, 4, ".y4m") != 0) {
+    fprintf(stderr, "headless sim: unknown dump format: %s\n", Path.c_str());
+    return false;
+  }
+
+  DumpFile = fopen(Path.c_str(), "wb");
+  if (!DumpFile) {
+    perror(("headless sim: " + Path).c_str());
+    return false;
+  }
+  fprintf(DumpFile, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", kWidth, kHeight,
+          kDumpFrameRate);
+  DumpFrame.resize(3 * kWidth * kHeight);
+  return true;
+}
+
+void HeadlessSimLightController::RenderLoop() {
+  pthread_mutex_lock(&Lock);
+  for (;;) {
+    // Sleep until something changes, or the beat monitor is due to clear.
+    while (Running && !Dirty) {
+      if (BeatMonitorDeadline < 0) {
+        pthread_cond_wait(&Wakeup, &Lock);
+        continue;
+      }
+
+      // The condition variable waits for an absolute real time, so convert
+      // the delay.
+      double Delay = BeatMonitorDeadline - get_elapsed_time_in_seconds();
+      if (Delay <= 0) {
+        Dirty = true;
+        break;
+      }
+      struct timeval Now;
+      gettimeofday(&Now, 0);
+      int64_t Deadline = (int64_t) Now.tv_sec * 1000000000 +
+        Now.tv_usec * 1000 + (int64_t) (Delay * 1e9);
+      struct timespec TS;
+      TS.tv_sec = Deadline / 1000000000;
+      TS.tv_nsec = Deadline % 1000000000;
+      pthread_cond_timedwait(&Wakeup, &Lock, &TS);
+    }
+    if (!Dirty)
+      break;
+
+    Dirty = false;
+    bool Stopping = !Running;
+    LightManager *Manager = light_manager;
+    pthread_mutex_unlock(&Lock);
+
+    Render(Manager);
+    if (DumpFile || DumpPNG)
+      DumpImage(get_elapsed_time_in_seconds());
+
+    pthread_mutex_lock(&Lock);
+    if (Stopping)
+      break;
+  }
+  pthread_mutex_unlock(&Lock);
+}
+
+void HeadlessSimLightController::FillRect(float x0, float y0, float x1,
+                                          float y1, const uint8_t *Color) {
+  // Map from light coordinates (y up) to pixels (y down), covering the pixels
+  // whose centers are inside.
+  float Scale = kHeight / (2 * kViewHalfHeight);
+  float cx = kWidth / 2.f, cy = kHeight / 2.f;
+  int Left = std::max(0, (int) ceilf(cx + x0 * Scale - .5f));
+  int Right = std::min((int) kWidth, (int) ceilf(cx + x1 * Scale - .5f));
+  int Top = std::max(0, (int) ceilf(cy - y1 * Scale - .5f));
+  int Bottom = std::min((int) kHeight, (int) ceilf(cy - y0 * Scale - .5f));
+  for (int y = Top; y < Bottom; ++y) {
+    uint8_t *Row = &Image[3 * kWidth * y];
+    for (int x = Left; x < Right; ++x)
+      memcpy(&Row[3 * x], Color, 3);
+  }
+}
+
+void HeadlessSimLightController::FillDisc(float x, float y, float radius,
+                                          const uint8_t *Color) {
+  float Scale = kHeight / (2 * kViewHalfHeight);
+  float cx = kWidth / 2.f + x * Scale, cy = kHeight / 2.f - y * Scale;
+  float r = radius * Scale;
+
+  // Each row is one span, so there is a square root per row rather than any
+  // per pixel work.
+  int Top = std::max(0, (int) ceilf(cy - r - .5f));
+  int Bottom = std::min((int) kHeight, (int) ceilf(cy + r - .5f));
+  for (int Row = Top; Row < Bottom; ++Row) {
+    float dy = Row + .5f - cy;
+    if (fabsf(dy) > r)
+      continue;
+    float Half = sqrtf(r * r - dy * dy);
+    int Left = std::max(0, (int) ceilf(cx - Half - .5f));
+    int Right = std::min((int) kWidth, (int) ceilf(cx + Half - .5f));
+    uint8_t *Pixels = &Image[3 * kWidth * Row];
+    for (int Column = Left; Column < Right; ++Column)
+      memcpy(&Pixels[3 * Column], Color, 3);
+  }
+}
+
+void HeadlessSimLightController::Render(LightManager *Manager) {
+  ++NumRenderedFrames;
+  std::fill(Image.begin(), Image.end(), 0);
+  BeatMonitorDeadline = -1;
+  if (!Manager)
+    return;
+
+  LightManagerSnapshot state;
+  Manager->GetSnapshot(state);
+
+  unsigned NumLights = std::min(unsigned(Setup.size()), state.NumLights);
+  for (unsigned i = 0; i != NumLights; ++i) {
+    float v = state.Levels[i];
+    if (v <= 0)
+      continue;
+
+    float Full[3];
+    uint8_t Color[3];
+    get_sim_light_color(Setup[i].Color, Full);
+    for (unsigned j = 0; j != 3; ++j)
+      Color[j] = (uint8_t) (std::min(Full[j] * v, 1.f) * 255 + .5f);
+    FillDisc(Setup[i].X, Setup[i].Y, Radius, Color);
+  }
+
+  // Draw the beat monitor, and come back to clear it.
+  double elapsed = get_elapsed_time_in_seconds();
+  if (state.LastBeatTime >= 0 &&
+      elapsed - state.LastBeatTime <= kBeatMonitorTime) {
+    double v = 1 - (elapsed - state.LastBeatTime) / kBeatMonitorTime;
+    uint8_t Level = (uint8_t) (v * 255 + .5);
+    uint8_t Color[3] = { Level, Level, Level };
+    FillRect(-.9, -.9, -.7, -.8, Color);
+    BeatMonitorDeadline = state.LastBeatTime + kBeatMonitorTime;
+  }
+}
+
+void HeadlessSimLightController::DumpImage(double Now) {
+  if (DumpPNG) {
+    char Suffix[32];
+    snprintf(Suffix, sizeof(Suffix), "-%06u.png", NumDumpedFrames + 1);
+    std::string Path = DumpPath.substr(0, DumpPath.size() - 4) + Suffix;
+
+    encode_png(&Image[0], kWidth, kHeight, PNGData, PNGScratch);
+    FILE *File = fopen(Path.c_str(), "wb");
+    if (!File) {
+      perror(("headless sim: " + Path).c_str());
+      DumpPNG = false;
+      return;
+    }
+    fwrite(&PNGData[0], 1, PNGData.size(), File);
+    if (fclose(File) != 0) {
+      perror(("headless sim: " + Path).c_str());
+      DumpPNG = false;
+      return;
+    }
+    ++NumDumpedFrames;
+    return;
+  }
+
+  // The previous image held until now.
+  if (DumpStartTime < 0)
+    DumpStartTime = Now;
+  WriteDumpFrames((uint64_t) ((Now - DumpStartTime) * kDumpFrameRate));
+  if (!DumpFile)
+    return;
+
+  // Convert to planar YCbCr (BT.601, studio range) once, however many frames
+  // it is written for.
+  const unsigned NumPixels = kWidth * kHeight;
+  uint8_t *Y = &DumpFrame[0], *Cb = Y + NumPixels, *Cr = Cb + NumPixels;
+  for (unsigned i = 0; i != NumPixels; ++i) {
+    int R = Image[3 * i], G = Image[3 * i + 1], B = Image[3 * i + 2];
+    Y[i] = ((66 * R + 129 * G + 25 * B + 128) >> 8) + 16;
+    Cb[i] = ((-38 * R - 74 * G + 112 * B + 128) >> 8) + 128;
+    Cr[i] = ((112 * R - 94 * G - 18 * B + 128) >> 8) + 128;
+  }
+}
+
+void HeadlessSimLightController::WriteDumpFrames(uint64_t End) {
+  // Nothing has been converted before the first image.
+  if (!DumpFile || DumpStartTime < 0)
+    return;
+
+  for (; NextDumpFrame < End; ++NextDumpFrame) {
+    if (fputs("FRAME\n", DumpFile) == EOF ||
+        fwrite(&DumpFrame[0], 1, DumpFrame.size(), DumpFile) !=
+          DumpFrame.size()) {
+      perror(("headless sim: " + DumpPath).c_str());
+      fclose(DumpFile);
+      DumpFile = 0;
+      return;
+    }
+    ++NumDumpedFrames;
+  }
+}
+
+}
+
+SimLightController *CreateHeadlessSimLightController(const char *DumpPath) {
+  HeadlessSimLightController *Result = new HeadlessSimLightController();
+  if ((DumpPath && !Result->OpenDump(DumpPath)) || !Result->Start()) {
+    delete Result;
+    return 0;
+  }
+  return Result;
+}
@@ -0,0 +1,157 @@
+#include "Latency.h"
+
+#include "Clock.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace {
+
+/// \brief A lock-free log-linear (HDR style) histogram of nanosecond values.
+///
+/// Values below 2 * kSubBuckets are counted exactly. Above that, each power of
+/// two range is split into kSubBuckets buckets, so every value is counted
+/// within 1/kSubBuckets (1.6%) of its true value.
+class LatencyHistogram {
+  enum {
+    kSubBucketBits = 6,
+    kSubBuckets = 1 << kSubBucketBits,
+    /// Values are clamped to 2^kMaxValueBits ns (about 18 minutes).
+    kMaxValueBits = 40,
+    kNumBuckets = (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets
+  };
+
+  std::atomic<uint64_t> counts[kNumBuckets];
+  std::atomic<uint64_t> total_count;
+  std::atomic<int64_t> max_value;
+
+  static unsigned GetBucket(uint64_t value) {
+    if (value < 2 * kSubBuckets)
+      return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - kSubBucketBits;
+    return shift * kSubBuckets + (value >> shift);
+  }
+
+  /// Return the highest value counted in \arg bucket.
+  static uint64_t GetBucketValue(unsigned bucket) {
+    if (bucket < 2 * kSubBuckets)
+      return bucket;
+    unsigned shift = bucket / kSubBuckets - 1;
+    uint64_t sub = bucket - shift * kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  LatencyHistogram() : total_count(0), max_value(0) {
+    for (unsigned i = 0; i != kNumBuckets; ++i)
+      counts[i].store(0, std::memory_order_relaxed);
+  }
+
+  void Record(int64_t value) {
+    if (value < 0)
+      value = 0;
+    if (value >= (int64_t(1) << kMaxValueBits))
+      value = (int64_t(1) << kMaxValueBits) - 1;
+
+    counts[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    total_count.fetch_add(1, std::memory_order_relaxed);
+
+    int64_t max = max_value.load(std::memory_order_relaxed);
+    while (value > max &&
+           !max_value.compare_exchange_weak(max, value,
+                                            std::memory_order_relaxed))
+      ;
+  }
+
+  uint64_t GetCount() const {
+    return total_count.load(std::memory_order_relaxed);
+  }
+
+  int64_t GetMax() const {
+    return max_value.load(std::memory_order_relaxed);
+  }
+
+  /// Return the value below which \arg percentile percent of the recorded
+  /// values fall. Concurrent recording makes this approximate.
+  int64_t GetPercentile(double percentile) const {
+    uint64_t count = GetCount();
+    if (!count)
+      return 0;
+
+    uint64_t target = (uint64_t) (count * percentile / 100 + .5);
+    if (target < 1)
+      target = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i != kNumBuckets; ++i) {
+      seen += counts[i].load(std::memory_order_relaxed);
+      if (seen >= target)
+        return std::min((int64_t) GetBucketValue(i), GetMax());
+    }
+    return GetMax();
+  }
+};
+
+const char *stage_names[kNumLatencyStages] = {
+  "dequeue",
+  "detect",
+  "manager",
+  "step",
+  "apply",
+  "output"
+};
+
+LatencyHistogram histograms[kNumLatencyStages];
+
+thread_local int64_t current_origin = 0;
+
+void *signal_dump_thread_main(void *arg) {
+  sigset_t *signals = (sigset_t*) arg;
+  for (;;) {
+    int signal;
+    if (sigwait(signals, &signal) == 0)
+      latency_dump(stderr);
+  }
+  return 0;
+}
+
+}
+
+void latency_set_origin(int64_t origin) {
+  current_origin = origin;
+}
+
+int64_t latency_get_origin() {
+  return current_origin;
+}
+
+void latency_record(LatencyStage stage) {
+  if (current_origin)
+    histograms[stage].Record(get_time_in_ns() - current_origin);
+}
+
+void latency_dump(FILE *fp) {
+  fprintf(fp, "%-10s %10s %10s %10s %10s %10s\n", "latency", "count",
+          "p50 (ms)", "p90 (ms)", "p99 (ms)", "max (ms)");
+  for (unsigned i = 0; i != kNumLatencyStages; ++i) {
+    const LatencyHistogram &H = histograms[i];
+    fprintf(fp, "%-10s %10llu %10.3f %10.3f %10.3f %10.3f\n", stage_names[i],
+            (unsigned long long) H.GetCount(), H.GetPercentile(50) * 1e-6,
+            H.GetPercentile(90) * 1e-6, H.GetPercentile(99) * 1e-6,
+            H.GetMax() * 1e-6);
+  }
+}
+
+void latency_start_signal_dump() {
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, 0);
+
+  pthread_t thread;
+  pthread_create(&thread, 0, signal_dump_thread_main, &signals);
+  pthread_detach(thread);
+}
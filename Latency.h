@@ -0,0 +1,51 @@
+// -*- C++ -*-
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/// \brief The points along the path from audio capture to the lights at which
+/// we measure the time since the samples were captured.
+enum LatencyStage {
+  /// The analysis thread picked the samples up from the audio ring.
+  kLatencyStage_Dequeue,
+  /// The onset detector reported a beat.
+  kLatencyStage_Detect,
+  /// The light manager received the beat.
+  kLatencyStage_Manager,
+  /// A channel program stepped on the beat.
+  kLatencyStage_Step,
+  /// The light controller finished applying the light changes for a beat.
+  kLatencyStage_ApplyFrame,
+  /// An asynchronous controller finished writing a change to the device.
+  kLatencyStage_Output,
+  kNumLatencyStages
+};
+
+/// \brief Set the capture time (see get_time_in_ns()) of the audio the current
+/// thread is working on, or 0 if its work didn't come from captured audio.
+///
+/// The origin is thread local, so it follows the work for free while it stays
+/// on one thread. Code handing work to another thread must carry the origin
+/// along and set it again on the other side.
+void latency_set_origin(int64_t origin);
+
+int64_t latency_get_origin();
+
+/// \brief Record the time since the current thread's origin, if it has one,
+/// against \arg stage. This is lock-free, and safe on real-time threads.
+void latency_record(LatencyStage stage);
+
+/// \brief Print the latency percentiles of every stage to \arg fp.
+void latency_dump(FILE *fp);
+
+/// \brief Dump latencies to stderr whenever the process receives SIGUSR1.
+///
+/// This blocks SIGUSR1 in the calling thread and waits for it on a new thread,
+/// so it must be called before any other threads are created (they inherit the
+/// signal mask).
+void latency_start_signal_dump();
+
+#endif // LATENCY_H
@@ -0,0 +1,83 @@
+// -*- C++ -*-
+
+#ifndef LIGHTBYTECODE_H
+#define LIGHTBYTECODE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/// \brief One instruction of a compiled channel program.
+///
+/// A channel program is a contiguous array of these, run by the interpreter in
+/// LightProgram.cpp. Instructions are plain data and jumps are relative, so
+/// compiled programs can be copied (or mapped from a file) as is.
+///
+/// Each beat runs the channel's instructions from its current position until
+/// one of them ends the step. Instructions which keep state across beats (the
+/// repeat counters and timers) have it reset when a jump goes back past them.
+struct LightInstruction {
+  enum Opcode {
+    /// Set the light to Value (0 or 1) and end the step.
+    kOp_Set,
+    /// Fade the light to level Value over Count beats, with curve Curve, and
+    /// hold the channel until the fade is done.
+    kOp_Fade,
+    /// Jump by Offset until this has been reached Count times, then end the
+    /// step.
+    kOp_RepeatCount,
+    /// Jump by Offset until Value seconds have passed since the instruction was
+    /// reset, then end the step. Between beats, once the time is up, the
+    /// channel continues with the next instruction.
+    kOp_RepeatTime,
+    /// Jump by Offset if the light has been on for at most a fraction Value of
+    /// the time and the BPM is at least MinBPM, otherwise end the step.
+    kOp_IfOkToStrobe,
+    /// Jump by Offset.
+    kOp_Goto,
+
+    kNumOpcodes
+  };
+
+  uint8_t Op;
+  /// The FadeEngine::Curve, for kOp_Fade.
+  uint8_t Curve;
+  /// The jump offset from this instruction.
+  int16_t Offset;
+  /// The repeat count, or the length of a fade in beats.
+  uint32_t Count;
+  /// The light level, time, or strobe fraction, depending on the opcode.
+  float Value;
+  float MinBPM;
+};
+
+static_assert(sizeof(LightInstruction) == 16,
+              "instructions should stay compact");
+
+/// \brief The compiled code of one channel of a light program.
+struct LightChannelCode {
+  /// Whether the channel drives a strobe (rather than a pinspot).
+  bool NeedsStrobe;
+  /// The LightInfo::LightColor the light must have, or -1 for any.
+  int Color;
+  /// The mask of beat kinds which step the channel.
+  unsigned BeatKinds;
+  std::vector<LightInstruction> Code;
+};
+
+/// \brief A compiled light program, see CreateLightProgram().
+struct LightProgramCode {
+  std::string Name;
+  /// The longest the program runs before asking for a switch, in seconds.
+  double MaxProgramTime;
+  /// Beats closer together than this, in seconds, are ignored.
+  double ShortestBeatInterval;
+  /// The BPM above which the program isn't selected, or -1 for no limit.
+  double MaxBPM;
+  /// The relative chance of selecting the program.
+  double Rating;
+  std::vector<LightChannelCode> Channels;
+};
+
+#endif // LIGHTBYTECODE_H
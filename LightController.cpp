@@ -2,15 +2,29 @@
 #include <string.h>
 #include <phidget21.h>
 
+#include <algorithm>
+
 #include "LightController.h"
 
 LightController::LightController() {}
 LightController::~LightController() {}
 
+void LightController::SetLight(unsigned Index, bool Enable) {
+  LightFrame Frame;
+  Frame.SetLight(Index, Enable);
+  ApplyFrame(Frame);
+}
+
 namespace {
 
 class PhidgetLightController : public LightController {
   CPhidgetInterfaceKitHandle ifKit;
+  double OutputLatency;
+  int num_outputs;
+
+  /// The output states as last written, and which outputs have been written
+  /// at all.
+  uint64_t written, known;
 
   static int attach_handler(CPhidgetHandle IFK, void *data) {
     int serialNo;
@@ -43,7 +57,8 @@ class PhidgetLightController : public LightController {
   }
 
 public:
-  PhidgetLightController() {
+  PhidgetLightController(double OutputLatency_)
+    : OutputLatency(OutputLatency_), num_outputs(0), written(0), known(0) {
     // Initialize the phidget interfaces.
     // Create the InterfaceKit object.
     CPhidgetInterfaceKit_create(&ifKit);
@@ -68,7 +83,6 @@ public:
 
     // Check some properties of the device.
     const char *device_type;
-    int num_outputs;
     CPhidget_getDeviceType((CPhidgetHandle)ifKit, &device_type);
 
     CPhidgetInterfaceKit_getOutputCount(ifKit, &num_outputs);
@@ -87,11 +101,32 @@ public:
   virtual void BeatNotification(unsigned Index, double Time) {
   }
 
-  virtual void SetLight(unsigned Index, bool Enable) {
-    CPhidgetInterfaceKit_setOutputState(ifKit, Index, Enable);
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    // The interface kit can only set one output per request, so at least only
+    // send the outputs which change. The outputs all fit in the first word.
+    uint64_t outputs = (uint64_t(1) << num_outputs) - 1;
+    uint64_t mask = Frame.Mask[0], enabled = Frame.Enabled[0];
+    uint64_t changed = ((enabled ^ written) | ~known) & mask & outputs;
+    for (int i = 0; changed; ++i, changed >>= 1) {
+      if (changed & 1)
+        CPhidgetInterfaceKit_setOutputState(ifKit, i, Frame.IsEnabled(i));
+    }
+
+    written = (written & ~mask) | (enabled & mask);
+    known |= mask & outputs;
+  }
+
+  virtual double GetOutputLatency() const {
+    return OutputLatency;
   }
 };
 
+class NullLightController : public LightController {
+public:
+  virtual void BeatNotification(unsigned Index, double Time) {}
+  virtual void ApplyFrame(const LightFrame &Frame) {}
+};
+
 class ChainedLightController : public LightController {
   LightController *a, *b;
 
@@ -108,16 +143,25 @@ public:
     b->BeatNotification(Index, Time);
   }
 
-  virtual void SetLight(unsigned Index, bool Enable) {
-    a->SetLight(Index, Enable);
-    b->SetLight(Index, Enable);
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    a->ApplyFrame(Frame);
+    b->ApplyFrame(Frame);
+  }
+
+  virtual double GetOutputLatency() const {
+    // We can only schedule for one latency, so favor the real lights.
+    return std::max(a->GetOutputLatency(), b->GetOutputLatency());
   }
 };
 
 }
 
-LightController *CreatePhidgetLightController() {
-  return new PhidgetLightController();
+LightController *CreatePhidgetLightController(double OutputLatency) {
+  return new PhidgetLightController(OutputLatency);
+}
+
+LightController *CreateNullLightController() {
+  return new NullLightController();
 }
 
 LightController *CreateChainedLightController(LightController *a,
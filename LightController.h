@@ -3,17 +3,48 @@
 #ifndef LIGHTCONTROLLER_H
 #define LIGHTCONTROLLER_H
 
+#include "LightFrame.h"
+
 class LightController {
 public:
   LightController();
   virtual ~LightController();
 
+  // The light manager publishes its snapshot before calling these, so it
+  // already shows the beat or frame being notified. It doesn't hold its lock,
+  // so a beat notification may come while another thread applies a frame.
+
   virtual void BeatNotification(unsigned Index, double Time) = 0;
 
-  virtual void SetLight(unsigned Index, bool Enable) = 0;
+  /// \brief Apply all the light changes in \arg Frame, as one update where the
+  /// device allows it.
+  virtual void ApplyFrame(const LightFrame &Frame) = 0;
+
+  /// \brief Change a single light, as a frame of its own.
+  void SetLight(unsigned Index, bool Enable);
+
+  /// \brief The time, in seconds, between applying a frame and the lights
+  /// visibly changing.
+  virtual double GetOutputLatency() const { return 0; }
 };
 
-LightController *CreatePhidgetLightController();
+/// \brief Create a controller for a Phidget interface kit driving relays,
+/// which take \arg OutputLatency seconds to switch.
+LightController *CreatePhidgetLightController(double OutputLatency = .010);
+
+/// \brief Create a controller sending DMX512 over Art-Net to \arg Address
+/// ("host" or "host:port", which may be a broadcast address). It drives
+/// \arg NumUniverses universes starting at port-address \arg FirstUniverse,
+/// with each light patched to the next \arg ChannelsPerLight channels. Returns
+/// null on failure.
+LightController *CreateArtNetLightController(const char *Address,
+                                             unsigned FirstUniverse,
+                                             unsigned NumUniverses,
+                                             unsigned ChannelsPerLight = 1);
+
+/// \brief Create a controller which ignores all requests, for running without
+/// any lights attached.
+LightController *CreateNullLightController();
 
 LightController *CreateChainedLightController(LightController *a,
                                               LightController *b);
@@ -0,0 +1,106 @@
+// -*- C++ -*-
+
+#ifndef LIGHTFRAME_H
+#define LIGHTFRAME_H
+
+#include <cassert>
+#include <stdint.h>
+#include <string.h>
+
+/// \brief A set of light changes to apply at once, over the controller's light
+/// indices.
+///
+/// A frame need not set every light: lights whose Mask bit is clear keep their
+/// current state. The bits are kept in 64-bit words, light i being bit i % 64
+/// of word i / 64. Each light set has a 16-bit intensity level; controllers
+/// which can only switch lights treat levels of at least kOnLevel as on.
+struct LightFrame {
+  enum {
+    /// Enough for a DMX universe of single channel fixtures.
+    kMaxLights = 512,
+    kMaxLevel = 0xFFFF,
+    kOnLevel = 0x8000,
+    kNumWords = kMaxLights / 64
+  };
+
+  /// Bit i is set if the frame turns light i on (its level is at least
+  /// kOnLevel).
+  uint64_t Enabled[kNumWords];
+  /// Bit i is set if the frame sets light i at all.
+  uint64_t Mask[kNumWords];
+  /// The level of each light set by the frame.
+  uint16_t Levels[kMaxLights];
+
+  LightFrame() {
+    clear();
+  }
+
+  static uint64_t GetBit(unsigned Index) {
+    assert(Index < kMaxLights && "Invalid light index");
+    return uint64_t(1) << (Index % 64);
+  }
+
+  void SetLevel(unsigned Index, uint16_t Level) {
+    uint64_t Bit = GetBit(Index);
+    unsigned Word = Index / 64;
+    Mask[Word] |= Bit;
+    Levels[Index] = Level;
+    if (Level >= kOnLevel)
+      Enabled[Word] |= Bit;
+    else
+      Enabled[Word] &= ~Bit;
+  }
+
+  void SetLight(unsigned Index, bool Enable) {
+    SetLevel(Index, Enable ? kMaxLevel : 0);
+  }
+
+  bool SetsLight(unsigned Index) const {
+    return (Mask[Index / 64] & GetBit(Index)) != 0;
+  }
+
+  bool IsEnabled(unsigned Index) const {
+    return (Enabled[Index / 64] & GetBit(Index)) != 0;
+  }
+
+  uint16_t GetLevel(unsigned Index) const {
+    assert(SetsLight(Index) && "Light is not set by frame");
+    return Levels[Index];
+  }
+
+  bool empty() const {
+    for (unsigned w = 0; w != kNumWords; ++w)
+      if (Mask[w])
+        return false;
+    return true;
+  }
+
+  /// \brief Return the number of lights the frame sets.
+  unsigned size() const {
+    unsigned Result = 0;
+    for (unsigned w = 0; w != kNumWords; ++w)
+      Result += __builtin_popcountll(Mask[w]);
+    return Result;
+  }
+
+  /// \brief Stop setting any lights.
+  void clear() {
+    memset(Enabled, 0, sizeof(Enabled));
+    memset(Mask, 0, sizeof(Mask));
+  }
+
+  /// \brief Apply the changes in \arg Other on top of this frame.
+  void Update(const LightFrame &Other) {
+    for (unsigned w = 0; w != kNumWords; ++w) {
+      for (uint64_t Bits = Other.Mask[w]; Bits; Bits &= Bits - 1) {
+        unsigned i = w * 64 + __builtin_ctzll(Bits);
+        Levels[i] = Other.Levels[i];
+      }
+      Enabled[w] = (Enabled[w] & ~Other.Mask[w]) |
+        (Other.Enabled[w] & Other.Mask[w]);
+      Mask[w] |= Other.Mask[w];
+    }
+  }
+};
+
+#endif // LIGHTFRAME_H
@@ -0,0 +1,70 @@
+#include "LightInfo.h"
+
+#include "LightFrame.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+bool LightInfo::ParseColor(const std::string &Name, LightColor &Result) {
+  static const char *Names[] = { "red", "blue", "green", "yellow", "white" };
+  for (unsigned i = 0; i != sizeof(Names) / sizeof(Names[0]); ++i) {
+    if (Name == Names[i]) {
+      Result = LightColor(kLightColor_Red + i);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool LightInfo::LoadSetup(const std::string &Path,
+                          std::vector<LightInfo> &Result) {
+  FILE *fp = fopen(Path.c_str(), "r");
+  if (!fp) {
+    fprintf(stderr, "unable to open light setup: %s: %s\n", Path.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  std::vector<bool> UsedIndices(LightFrame::kMaxLights);
+  unsigned NumErrors = 0;
+  char Buffer[256];
+  for (unsigned Line = 1; fgets(Buffer, sizeof(Buffer), fp); ++Line) {
+    char Kind[32], Color[32];
+    float X, Y;
+    int Index = Result.size(), End = 0;
+    int Count = sscanf(Buffer, " %31s %31s %f %f %n%d %n", Kind, Color, &X, &Y,
+                       &End, &Index, &End);
+    if (Count <= 0 || Kind[0] == '#')
+      continue;
+
+    LightInfo Light;
+    const char *Error = 0;
+    if (Count < 4 || Buffer[End] != '\0')
+      Error = "expected 'KIND COLOR X Y [INDEX]'";
+    else if (strcmp(Kind, "pinspot") != 0 && strcmp(Kind, "strobe") != 0)
+      Error = "unknown light kind";
+    else if (!ParseColor(Color, Light.Color))
+      Error = "unknown color";
+    else if (Index < 0 || Index >= LightFrame::kMaxLights)
+      Error = "invalid light index";
+    else if (UsedIndices[Index])
+      Error = "duplicate light index";
+    if (Error) {
+      fprintf(stderr, "%s:%u: error: %s\n", Path.c_str(), Line, Error);
+      ++NumErrors;
+      continue;
+    }
+
+    UsedIndices[Index] = true;
+    Result.push_back(Make(strcmp(Kind, "strobe") == 0 ? kLightKind_Strobe :
+                          kLightKind_Pinspot, Light.Color, Index, X, Y));
+  }
+  fclose(fp);
+
+  if (!NumErrors && Result.empty()) {
+    fprintf(stderr, "%s: error: no lights\n", Path.c_str());
+    ++NumErrors;
+  }
+  return NumErrors == 0;
+}
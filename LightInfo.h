@@ -3,6 +3,9 @@
 #ifndef LIGHTINFO_H
 #define LIGHTINFO_H
 
+#include <string>
+#include <vector>
+
 struct LightInfo {
 public:
   enum LightKind {
@@ -21,12 +24,18 @@ public:
   LightKind Kind;
   LightColor Color;
   unsigned Index;
+  /// Where the light is, as the simulators show it. The view spans a little
+  /// over [-1, 1] vertically, and more horizontally.
+  float X, Y;
 
-  static LightInfo Make(LightKind Kind, LightColor Color, unsigned Index) {
+  static LightInfo Make(LightKind Kind, LightColor Color, unsigned Index,
+                        float X = 0, float Y = 0) {
     LightInfo Result;
     Result.Kind = Kind;
     Result.Color = Color;
     Result.Index = Index;
+    Result.X = X;
+    Result.Y = Y;
     return Result;
   }
 
@@ -36,6 +45,34 @@ public:
   bool isStrobe() const {
     return Kind == kLightKind_Strobe;
   }
+
+  /// \brief Return the light configuration of our rig. We just hard code it
+  /// for now.
+  static std::vector<LightInfo> GetDefaultSetup() {
+    std::vector<LightInfo> Result;
+    Result.push_back(Make(kLightKind_Pinspot, kLightColor_White, /*Index=*/0,
+                          -.5, -.5));
+    Result.push_back(Make(kLightKind_Pinspot, kLightColor_Red, /*Index=*/1,
+                          .5, -.5));
+    Result.push_back(Make(kLightKind_Pinspot, kLightColor_Green, /*Index=*/2,
+                          .5, .5));
+    Result.push_back(Make(kLightKind_Strobe, kLightColor_White, /*Index=*/3,
+                          -.5, .5));
+    return Result;
+  }
+
+  /// \brief Parse the color called \arg Name ("red", "blue", ...) into
+  /// \arg Result, returning false if there is none.
+  static bool ParseColor(const std::string &Name, LightColor &Result);
+
+  /// \brief Load a light configuration from the file at \arg Path into
+  /// \arg Result, returning false (after reporting the errors) on failure.
+  ///
+  /// Each line describes a light as "KIND COLOR X Y [INDEX]", where the kind
+  /// is "pinspot" or "strobe", and the index defaults to the number of lights
+  /// before it. Blank lines and those starting with '#' are ignored.
+  static bool LoadSetup(const std::string &Path,
+                        std::vector<LightInfo> &Result);
 };
 
 #endif
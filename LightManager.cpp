@@ -1,29 +1,91 @@
 #include "LightManager.h"
 
+#include "AliasTable.h"
+#include "Latency.h"
 #include "LightController.h"
 #include "LightInfo.h"
 #include "LightProgram.h"
+#include "Random.h"
+#include "SeqLock.h"
+#include "TempoEstimator.h"
 #include "Util.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdio>
-#include <cstdlib>
+#include <cstring>
 #include <vector>
 
+#include <pthread.h>
+
 namespace {
 
+  /// \brief The programs available to the manager, replaced as a whole when
+  /// the programs are reloaded.
+  struct ProgramSet {
+    std::vector<LightProgram *> Programs;
+    /// The distinct maximum BPMs of the programs, in order. The ratings only
+    /// change when the BPM crosses one of these, or the recent beat kinds
+    /// change.
+    std::vector<double> MaxBPMs;
+    /// The ratings of the programs under the conditions in RatingsKey (see
+    /// GetRatingsKey()), and the table sampling them.
+    std::vector<double> Ratings;
+    AliasTable Table;
+    int RatingsKey;
+    /// The next set in the retired list.
+    ProgramSet *NextRetired;
+
+    ProgramSet() : RatingsKey(-1), NextRetired(0) {}
+
+    ~ProgramSet() {
+      for (unsigned i = 0, e = Programs.size(); i != e; ++i)
+        delete Programs[i];
+    }
+  };
+
   class LightManagerImpl : public LightManager {
     LightController *Controller;
     std::vector<LightInfo> LightSetup;
 
-    std::vector<LightProgram *> AvailablePrograms;
+    ProgramSet *AvailablePrograms;
+    /// The set of reloaded programs waiting for the next program switch.
+    std::atomic<ProgramSet *> PendingPrograms;
+    /// The sets replaced by program switches, which ReloadPrograms() deletes
+    /// so that switching never frees memory.
+    std::atomic<ProgramSet *> RetiredPrograms;
     std::vector<LightState> LightStates;
     LightProgram *ActiveProgram;
-    bool ChangeProgramRequested;
-
-    double RecentBeatTimes[64];
-    unsigned RecentBeatPosition, NumRecentBeatTimes;
-    bool StrobeEnabled;
+    std::atomic<bool> ChangeProgramRequested;
+
+    /// The level of each light in the setup, and the level last sent to the
+    /// controller (-1 until one is sent).
+    FadeEngine Fades;
+    std::vector<int> OutputLevels;
+
+    /// Serializes handling beats with rendering frames. The controller is
+    /// never called with it held, so a slow device can't hold up beats.
+    mutable pthread_mutex_t Lock;
+
+    /// The changes rendered but not yet sent to the controller, merged, and
+    /// whether a thread is sending. Only one thread sends at a time, so the
+    /// frames reach the controller in order. Protected by Lock.
+    LightFrame PendingFrame;
+    bool Sending;
+
+    /// The tempo of the low beats, and its value as of the last beat or frame
+    /// (0 if unknown, or the beats have stopped).
+    TempoEstimator Tempo;
+    std::atomic<double> RecentBPM;
+    double LastBeatTimes[MusicMonitorHandler::kNumBeatKinds];
+    std::atomic<bool> StrobeEnabled;
+    Random Generator;
+
+    /// The state for other threads, updated while handling beats and frames
+    /// and published at the end of each.
+    LightManagerSnapshot Snapshot;
+    SeqLock<LightManagerSnapshot> PublishedSnapshot;
 
   protected:
     virtual LightController &GetController() const {
@@ -35,25 +97,56 @@ namespace {
 
   public:
     LightManagerImpl(LightController *Controller_,
-                     std::vector<LightInfo> LightSetup_)
+                     std::vector<LightInfo> LightSetup_,
+                     const std::vector<LightProgram *> &AllPrograms,
+                     uint64_t Seed)
       : Controller(Controller_),
         LightSetup(LightSetup_),
+        AvailablePrograms(0),
+        PendingPrograms(0),
+        RetiredPrograms(0),
         ActiveProgram(0),
         ChangeProgramRequested(false),
-        RecentBeatTimes(),
-        RecentBeatPosition(0),
-        NumRecentBeatTimes(sizeof(RecentBeatTimes)/sizeof(RecentBeatTimes[0])),
-        StrobeEnabled(true)
+        Fades(LightSetup.size()),
+        OutputLevels(LightSetup.size(), -1),
+        Sending(false),
+        RecentBPM(0),
+        StrobeEnabled(true),
+        Generator(Seed)
     {
-      // Load the list of all programs.
-      std::vector<LightProgram *> AllPrograms;
-      LightProgram::LoadAllPrograms(AllPrograms);
+      pthread_mutex_init(&Lock, 0);
+
+      for (unsigned i = 0; i != MusicMonitorHandler::kNumBeatKinds; ++i)
+        LastBeatTimes[i] = -1;
 
-      // Add the programs which are available given the current lighting setup.
-      for (unsigned i = 0, e = AllPrograms.size(); i != e; ++i) {
-        LightProgram *LP = AllPrograms[i];
+      memset(&Snapshot, 0, sizeof(Snapshot));
+      Snapshot.LastBeatTime = -1;
+      Snapshot.NumLights = std::min(unsigned(LightSetup.size()),
+                                    unsigned(LightFrame::kMaxLights));
+      PublishSnapshot();
+
+      AvailablePrograms = CreateProgramSet(AllPrograms);
+
+      for (unsigned i = 0, e = LightSetup.size(); i != e; ++i)
+        LightStates.push_back(LightState());
+    }
+
+    ~LightManagerImpl() {
+      delete AvailablePrograms;
+      delete PendingPrograms.load();
+      DeleteRetiredPrograms();
+      delete Controller;
+      pthread_mutex_destroy(&Lock);
+    }
+
+    /// Create the set of \arg Programs which are available given the current
+    /// lighting setup, deleting the others.
+    ProgramSet *CreateProgramSet(const std::vector<LightProgram *> &Programs) {
+      ProgramSet *Result = new ProgramSet;
+      for (unsigned i = 0, e = Programs.size(); i != e; ++i) {
+        LightProgram *LP = Programs[i];
         if (LP->WorksWithSetup(GetSetup())) {
-          AvailablePrograms.push_back(LP);
+          Result->Programs.push_back(LP);
         } else {
           fprintf(stderr, "ignoring light program: '%s' (not available)\n",
                   LP->GetName().c_str());
@@ -61,14 +154,42 @@ namespace {
         }
       }
 
-      for (unsigned i = 0, e = LightSetup.size(); i != e; ++i)
-        LightStates.push_back(LightState());
+      // Make room to rate and select without allocating.
+      for (unsigned i = 0, e = Result->Programs.size(); i != e; ++i) {
+        double MaxBPM = Result->Programs[i]->GetMaxBPM();
+        if (MaxBPM != -1)
+          Result->MaxBPMs.push_back(MaxBPM);
+      }
+      std::sort(Result->MaxBPMs.begin(), Result->MaxBPMs.end());
+      Result->MaxBPMs.erase(std::unique(Result->MaxBPMs.begin(),
+                                        Result->MaxBPMs.end()),
+                            Result->MaxBPMs.end());
+      Result->Ratings.resize(Result->Programs.size());
+      Result->Table.Reserve(Result->Programs.size());
+      return Result;
     }
 
-    ~LightManagerImpl() {
-      for (unsigned i = 0, e = AvailablePrograms.size(); i != e; ++i)
-        delete AvailablePrograms[i];
-      delete Controller;
+    void DeleteRetiredPrograms() {
+      ProgramSet *PS = RetiredPrograms.exchange(0);
+      while (PS) {
+        ProgramSet *Next = PS->NextRetired;
+        delete PS;
+        PS = Next;
+      }
+    }
+
+    virtual void ReloadPrograms(const std::vector<LightProgram *> &Programs) {
+      DeleteRetiredPrograms();
+
+      ProgramSet *PS = CreateProgramSet(Programs);
+      if (PS->Programs.empty()) {
+        fprintf(stderr, "not reloading light programs: none are available\n");
+        delete PS;
+        return;
+      }
+
+      // A pending set which was never switched to was never used either.
+      delete PendingPrograms.exchange(PS);
     }
 
     virtual void ChangePrograms() {
@@ -76,42 +197,172 @@ namespace {
     }
 
     virtual void HandleBeat(MusicMonitorHandler::BeatKind Kind, double Time) {
-      RecentBeatTimes[RecentBeatPosition % NumRecentBeatTimes] =
-        get_elapsed_time_in_seconds();
-      ++RecentBeatPosition;
+      latency_record(kLatencyStage_Manager);
 
-      Controller->BeatNotification(Kind, Time);
+      pthread_mutex_lock(&Lock);
+      double Elapsed = get_elapsed_time_in_seconds();
+      LastBeatTimes[Kind] = Elapsed;
+      Snapshot.LastBeatTime = Elapsed;
+
+      // Only the low (or full band) beats count towards the BPM, otherwise
+      // multi-band monitors would inflate it. The intervals come from the
+      // beats' own times, which are not skewed by delivery.
+      if (Kind == MusicMonitorHandler::kBeatLow)
+        Tempo.AddBeat(Time);
+      UpdateRecentBPM(Elapsed);
 
       MaybeSwitchPrograms();
 
       ActiveProgram->HandleBeat(Kind, Time);
+
+      // Send all the changes for this beat at once. Controllers may read the
+      // snapshot when notified, so publish it first.
+      RenderLevels(Elapsed);
+      PublishSnapshot();
+      LightFrame Frame;
+      bool Send = TakePendingFrame(Frame);
+      pthread_mutex_unlock(&Lock);
+
+      Controller->BeatNotification(Kind, Time);
+      if (Send) {
+        SendFrames(Frame);
+        latency_record(kLatencyStage_ApplyFrame);
+      }
     }
 
-    virtual void SetLight(unsigned Index, bool Enable) {
-      assert(Index < LightStates.size() && "Invalid index");
+    virtual void RenderFrame() {
+      pthread_mutex_lock(&Lock);
+      double Elapsed = get_elapsed_time_in_seconds();
 
-      const LightInfo &Info = LightSetup[Index];
+      // Programs keep running through silence, time based actions only need
+      // the clock.
+      UpdateRecentBPM(Elapsed);
+      MaybeSwitchPrograms();
+      ActiveProgram->HandleTick();
 
-      // Honor the strobe disable flag.
-      if (Info.isStrobe() && !StrobeEnabled)
-        Enable = false;
+      RenderLevels(Elapsed);
+      PublishSnapshot();
+      LightFrame Frame;
+      bool Send = TakePendingFrame(Frame);
+      pthread_mutex_unlock(&Lock);
+
+      if (Send)
+        SendFrames(Frame);
+    }
+
+    /// Take the pending frame into \arg Frame for this thread to send, unless
+    /// it is empty or another thread is sending (which then sends it too).
+    /// This is only called with the lock held.
+    bool TakePendingFrame(LightFrame &Frame) {
+      if (Sending || PendingFrame.empty())
+        return false;
+      Sending = true;
+      Frame = PendingFrame;
+      PendingFrame.clear();
+      return true;
+    }
+
+    /// Send \arg Frame, from TakePendingFrame(), and any frames rendered by
+    /// other threads meanwhile. This is called without the lock.
+    void SendFrames(LightFrame &Frame) {
+      for (;;) {
+        Controller->ApplyFrame(Frame);
+
+        pthread_mutex_lock(&Lock);
+        Sending = false;
+        bool More = TakePendingFrame(Frame);
+        pthread_mutex_unlock(&Lock);
+        if (!More)
+          return;
+      }
+    }
 
-      Controller->SetLight(Info.Index, Enable);
+    /// Cache the tempo for GetRecentBPM(), dropping it to zero once the low
+    /// beats have stopped.
+    void UpdateRecentBPM(double Elapsed) {
+      double LastBeat = LastBeatTimes[MusicMonitorHandler::kBeatLow];
+      bool Stale = LastBeat < 0 ||
+        Elapsed - LastBeat > TempoEstimator::kMaxInterval;
+      RecentBPM.store(Stale ? 0 : Tempo.GetBPM(), std::memory_order_relaxed);
+    }
+
+    /// Publish the current state for GetSnapshot(). This is only called with
+    /// the lock held, so there is one writer.
+    void PublishSnapshot() {
+      Snapshot.RecentBPM = GetRecentBPM();
+      Snapshot.StrobeEnabled = StrobeEnabled.load(std::memory_order_relaxed);
+      const float *Levels = Fades.GetLevels();
+      for (unsigned i = 0; i != Snapshot.NumLights; ++i)
+        Snapshot.Levels[i] = Levels[i];
+      PublishedSnapshot.Store(Snapshot);
+    }
+
+    virtual void GetSnapshot(LightManagerSnapshot &Result) const {
+      PublishedSnapshot.Load(Result);
+    }
 
-      // Update the light tracking state.
+    /// Render the light levels at \arg Now, adding the ones which changed to
+    /// the pending frame.
+    void RenderLevels(double Now) {
+      if (!Fades.Render(Now))
+        return;
+
+      const float *Levels = Fades.GetLevels();
+      for (unsigned i = 0, e = LightSetup.size(); i != e; ++i) {
+        int Level = int(Levels[i] * LightFrame::kMaxLevel + .5f);
+        if (Level == OutputLevels[i])
+          continue;
+
+        OutputLevels[i] = Level;
+        PendingFrame.SetLevel(LightSetup[i].Index, Level);
+        UpdateLightState(i, Levels[i], Now);
+      }
+    }
+
+    /// Update the tracking state of the light at \arg Index for it reaching
+    /// \arg Level at \arg Now.
+    void UpdateLightState(unsigned Index, double Level, double Now) {
       LightState &State = LightStates[Index];
+      bool Enable = Level > 0;
+      State.Level = Level;
       if (Enable != State.Enabled) {
-        double Elapsed = get_elapsed_time_in_seconds();
-
         State.Enabled = Enable;
         if (Enable) {
-          State.LastEnableTime = Elapsed;
+          State.LastEnableTime = Now;
         } else {
-          State.TotalEnabledTime += Elapsed - State.LastEnableTime;
+          State.TotalEnabledTime += Now - State.LastEnableTime;
         }
       }
     }
 
+    virtual void SetLight(unsigned Index, bool Enable) {
+      assert(Index < LightStates.size() && "Invalid index");
+
+      const LightInfo &Info = LightSetup[Index];
+
+      // Honor the strobe disable flag.
+      if (Info.isStrobe() && !StrobeEnabled)
+        Enable = false;
+
+      // The light tracking state is updated once the level is sent.
+      Fades.SetLevel(Index, Enable ? 1 : 0);
+    }
+
+    virtual void FadeLight(unsigned Index, double Level, double Duration,
+                           FadeEngine::Curve Shape) {
+      assert(Index < LightStates.size() && "Invalid index");
+
+      const LightInfo &Info = LightSetup[Index];
+
+      // Honor the strobe disable flag.
+      if (Info.isStrobe() && !StrobeEnabled)
+        Level = 0;
+
+      Level = std::min(std::max(Level, 0.0), 1.0);
+      Fades.StartFade(Index, Level, Duration, get_elapsed_time_in_seconds(),
+                      Shape);
+    }
+
     virtual const LightState &GetLightState(unsigned Index) const {
       assert(Index < LightStates.size() && "Invalid index");
       return LightStates[Index];
@@ -119,49 +370,70 @@ namespace {
 
     void MaybeSwitchPrograms() {
       // If a change was requested, stop the current program.
-      if (ChangeProgramRequested && ActiveProgram) {
+      if (ActiveProgram && ChangeProgramRequested.exchange(false)) {
         ActiveProgram->Stop();
         ActiveProgram = 0;
       }
 
       // Otherwise, if there is no active program, select one.
       if (!ActiveProgram) {
-        ChangeProgramRequested = false;
-
-        // Compute the current selection rating for each program.
-        std::vector<double> Ratings;
-        double SumRatings = 0.0;
-        for (unsigned i = 0, e = AvailablePrograms.size(); i != e; ++i) {
-          double Rating = AvailablePrograms[i]->GetRating(*this);
-          Ratings.push_back(Rating);
-          SumRatings += Rating;
+        ChangeProgramRequested.store(false);
+
+        // Switch to any reloaded programs, now that none is running. The old
+        // set is retired rather than deleted, to keep this path from freeing
+        // memory.
+        if (ProgramSet *PS = PendingPrograms.exchange(0)) {
+          ProgramSet *Old = AvailablePrograms;
+          Old->NextRetired = RetiredPrograms.load();
+          while (!RetiredPrograms.compare_exchange_weak(Old->NextRetired, Old))
+            ;
+          AvailablePrograms = PS;
         }
 
-        // Select a program based on the weighted probability.
-        double PickValue = drand48() * SumRatings;
-        for (unsigned i = 0, e = AvailablePrograms.size(); i != e; ++i) {
-          PickValue -= Ratings[i];
-
-          if (PickValue <= 0.0 || i == e - 1) {
-            ActiveProgram = AvailablePrograms[i];
-            break;
-          }
+        // Rate the programs again if the conditions changed.
+        ProgramSet &PS = *AvailablePrograms;
+        assert(!PS.Programs.empty() && "no light programs available!");
+        int Key = GetRatingsKey(PS);
+        if (Key != PS.RatingsKey) {
+          for (unsigned i = 0, e = PS.Programs.size(); i != e; ++i)
+            PS.Ratings[i] = PS.Programs[i]->GetRating(*this);
+          PS.Table.Build(PS.Ratings.data(), PS.Ratings.size());
+          PS.RatingsKey = Key;
         }
-        assert(ActiveProgram && "random selection failed!");
+
+        // Select a program based on the weighted probability, or the first if
+        // none has a rating.
+        ActiveProgram =
+          PS.Programs[PS.Table.empty() ? 0 : PS.Table.Sample(Generator)];
 
         // Start the program.
         ActiveProgram->Start(*this);
-        fprintf(stderr, "current program: '%s'\n",
-                ActiveProgram->GetName().c_str());
+        ++Snapshot.ProgramId;
+        strncpy(Snapshot.ProgramName, ActiveProgram->GetName().c_str(),
+                sizeof(Snapshot.ProgramName) - 1);
       }
     }
 
+    /// Return a key for the conditions the program ratings depend on: the
+    /// range of the recent BPM between the programs' maximums, and the beat
+    /// kinds seen recently.
+    int GetRatingsKey(const ProgramSet &PS) const {
+      int Range = std::lower_bound(PS.MaxBPMs.begin(), PS.MaxBPMs.end(),
+                                   GetRecentBPM()) - PS.MaxBPMs.begin();
+      int Kinds = 0;
+      for (unsigned i = 0; i != MusicMonitorHandler::kNumBeatKinds; ++i)
+        if (HasRecentBeats(MusicMonitorHandler::BeatKind(i)))
+          Kinds |= 1 << i;
+      return (Range << MusicMonitorHandler::kNumBeatKinds) | Kinds;
+    }
+
     virtual double GetRecentBPM() const {
-      unsigned NumBeats = std::min(RecentBeatPosition, NumRecentBeatTimes);
-      double OldestTime = RecentBeatTimes[
-        (RecentBeatPosition + 1) % NumRecentBeatTimes];
+      return RecentBPM.load(std::memory_order_relaxed);
+    }
 
-      return 60 * NumBeats / (get_elapsed_time_in_seconds() - OldestTime);
+    virtual bool HasRecentBeats(MusicMonitorHandler::BeatKind Kind) const {
+      return LastBeatTimes[Kind] >= 0 &&
+        get_elapsed_time_in_seconds() - LastBeatTimes[Kind] < 10.0;
     }
 
     virtual std::string GetProgramName() const {
@@ -170,10 +442,12 @@ namespace {
       return "(no active program)";
     }
 
-    virtual bool GetStrobeEnabled() const { return StrobeEnabled; }
+    virtual Random &GetRandom() { return Generator; }
+
+    virtual bool GetStrobeEnabled() const { return StrobeEnabled.load(); }
 
     virtual void SetStrobeEnabled(bool Value) {
-      StrobeEnabled = Value;
+      StrobeEnabled.store(Value);
     }
   };
 
@@ -183,6 +457,8 @@ LightManager::LightManager() {}
 LightManager::~LightManager() {}
 
 LightManager *CreateLightManager(LightController *Controller,
-                                 std::vector<LightInfo> LightSetup) {
-  return new LightManagerImpl(Controller, LightSetup);
+                                 std::vector<LightInfo> LightSetup,
+                                 const std::vector<LightProgram *> &Programs,
+                                 uint64_t Seed) {
+  return new LightManagerImpl(Controller, LightSetup, Programs, Seed);
 }
@@ -3,20 +3,44 @@
 #ifndef LIGHTMANAGER_H
 #define LIGHTMANAGER_H
 
+#include "FadeEngine.h"
+#include "LightFrame.h"
 #include "MusicMonitor.h"
+#include <stdint.h>
+#include <string>
 #include <vector>
 
 struct LightInfo;
 class LightController;
 class LightProgram;
 class MusicMonitorHandler;
+class Random;
 
 struct LightState {
+  /// Whether the light is on at all, i.e., its level is above zero.
   bool Enabled;
+  /// The light's level, from 0 (off) to 1 (full).
+  double Level;
   double TotalEnabledTime;
   double LastEnableTime;
 };
 
+/// \brief A copy of the manager's state for other threads (like a renderer),
+/// published after every beat and frame. See LightManager::GetSnapshot().
+struct LightManagerSnapshot {
+  /// The time of the last beat of any kind, or -1.
+  double LastBeatTime;
+  double RecentBPM;
+  /// A number which changes whenever a program is started, and the program's
+  /// name.
+  unsigned ProgramId;
+  char ProgramName[64];
+  bool StrobeEnabled;
+  /// The levels of the first NumLights lights of the setup, from 0 to 1.
+  unsigned NumLights;
+  float Levels[LightFrame::kMaxLights];
+};
+
 class LightManager : public MusicMonitorHandler {
 protected:
   LightManager();
@@ -25,23 +49,66 @@ public:
 
   virtual const std::vector<LightInfo> &GetSetup() const = 0;
 
+  /// \brief Ask for another program at the next beat or frame. This may be
+  /// called from any thread.
   virtual void ChangePrograms() = 0;
 
+  /// \brief Replace the programs with \arg Programs, taking ownership of
+  /// them. The running program keeps going, and the new programs are used from
+  /// the next program switch. This may be called from any one thread, while
+  /// beats are being handled.
+  virtual void ReloadPrograms(const std::vector<LightProgram *> &Programs) = 0;
+
   virtual void HandleBeat(MusicMonitorHandler::BeatKind Kind, double time) = 0;
 
+  /// \brief Set the light at \arg Index in the setup. Changes are sent to the
+  /// controller as one frame, after the current beat has been handled.
   virtual void SetLight(unsigned Index, bool Enable) = 0;
 
+  /// \brief Fade the light at \arg Index in the setup from its current level
+  /// to \arg Level (0 to 1) over \arg Duration seconds. The fade is rendered
+  /// by RenderFrame().
+  virtual void FadeLight(unsigned Index, double Level, double Duration,
+                         FadeEngine::Curve Shape =
+                           FadeEngine::kCurve_Linear) = 0;
+
+  /// \brief Advance the active program to the current time, and send the
+  /// lights which changed (including any fading) to the controller as one
+  /// frame. This is called at the frame rate, independently of beats.
+  virtual void RenderFrame() = 0;
+
   virtual const LightState &GetLightState(unsigned Index) const = 0;
 
   virtual double GetRecentBPM() const = 0;
+
+  /// \brief Check whether beats of the given kind have been seen recently,
+  /// i.e., whether the music monitor is producing them at all.
+  virtual bool HasRecentBeats(MusicMonitorHandler::BeatKind Kind) const = 0;
   
   virtual std::string GetProgramName() const = 0;
 
+  /// \brief The generator for the random choices of the manager and its
+  /// programs. This may only be used while handling a beat or frame.
+  virtual Random &GetRandom() = 0;
+
+  /// \brief Whether strobes may be turned on. These may be called from any
+  /// thread.
   virtual bool GetStrobeEnabled() const = 0;
   virtual void SetStrobeEnabled(bool Value) = 0;
+
+  /// \brief Read the state last published by the manager. Unlike the other
+  /// accessors this may be called from any thread; it never blocks the beat
+  /// path, or takes a lock.
+  virtual void GetSnapshot(LightManagerSnapshot &Result) const = 0;
 };
 
+/// \brief Create a light manager running \arg Programs, see
+/// LightProgram::LoadAllPrograms(). The manager takes ownership of the
+/// programs, and deletes those which don't work with \arg LightSetup. The
+/// random choices are made from \arg Seed.
 LightManager *CreateLightManager(LightController *Controller,
-                                 std::vector<LightInfo> LightSetup);
+                                 std::vector<LightInfo> LightSetup,
+                                 const std::vector<LightProgram *> &Programs,
+                                 uint64_t Seed);
 
 #endif // LIGHTMANAGER_H
@@ -1,200 +1,251 @@
 #include "LightProgram.h"
 
+#include "LightBytecode.h"
+#include "Latency.h"
 #include "LightInfo.h"
 #include "LightManager.h"
+#include "Random.h"
 #include "Util.h"
 
+#include <algorithm>
 #include <cassert>
-#include <cmath>
 #include <vector>
 
 namespace {
-  class ChannelProgram;
-  class LightProgramImpl;
-
-  class ChannelAction {
-  public:
-    struct ActionResult {
-    public:
-      enum ResultKind {
-        Retry,
-        Advance,
-        Next,
-        Goto,
-        SwitchPrograms
-      } Kind;
-      unsigned Value;
-
-    private:
-      static ActionResult Make(ResultKind Kind, unsigned Value = 0) {
-        ActionResult Result = { Kind, Value };
-        return Result;
-      }
-
-    public:
-      static ActionResult MakeRetry() {
-        return Make(Retry);
-      }
-      static ActionResult MakeAdvance() {
-        return Make(Advance);
-      }
-      static ActionResult MakeNext() {
-        return Make(Next);
-      }
-      static ActionResult MakeGoto(unsigned Index) {
-        return Make(Goto, Index);
-      }
-      static ActionResult MakeSwitchPrograms() {
-        return Make(SwitchPrograms);
-      }
-    };
-
-  public:
-    virtual ~ChannelAction() {}
+  class LightProgramImpl : public LightProgram {
+    LightManager *ActiveManager;
+    /// The light (in the setup) driven by each channel, and the channel
+    /// driving each light or -1. These are reserved ahead of Start(), which
+    /// runs on the beat path, so that it doesn't allocate.
+    std::vector<int> ActiveAssignments;
+    mutable std::vector<int> ActiveOwners;
+    double ActiveStartTime;
+    double ActiveBeatElapsed;
+    /// The time of the last beat or tick.
+    double ActiveElapsed;
+    double LastBeatElapsed[MusicMonitorHandler::kNumBeatKinds];
+    /// The smoothed interval between beats of each kind, or -1 if unknown.
+    double BeatInterval[MusicMonitorHandler::kNumBeatKinds];
 
-    virtual void Start() {};
+    /// The mask of beat kinds any channel program responds to.
+    unsigned BeatKinds;
 
-    virtual void Initialize(ChannelProgram &Program) {};
+    /// The program name.
+    std::string Name;
 
-    virtual ActionResult Step(MusicMonitorHandler::BeatKind Kind,
-                              ChannelProgram &Program) = 0;
-  };
+    /// The maximum amount of time to run this program before requesting the
+    /// manager switch programs.
+    double MaxProgramTime;
 
-  class ChannelProgram {
-    LightProgramImpl *ActiveProgram;
-    unsigned ActiveLightIndex;
+    /// The code of all channels, back to back, and the state of each
+    /// instruction (a repeat count, start time, or beats into a fade).
+    std::vector<LightInstruction> Code;
+    std::vector<double> State;
 
-    std::vector<ChannelAction *> Actions;
-    unsigned Position;
-    bool NeedsStrobe;
+    /// The channels, as parallel arrays. The code of channel i is
+    /// Code[ChannelStart[i]] up to Code[ChannelStart[i + 1]].
+    std::vector<unsigned> ChannelStart;
+    std::vector<unsigned> ChannelPosition;
+    std::vector<unsigned> ChannelBeatKinds;
+    std::vector<bool> ChannelNeedsStrobe;
+    std::vector<int> ChannelColor;
 
-  public:
-    ChannelProgram(bool NeedsStrobe_ = false)
-      : ActiveProgram(0), ActiveLightIndex(0), Position(0),
-        NeedsStrobe(NeedsStrobe_) {}
-
-    ~ChannelProgram() {
-      while (!Actions.empty()) {
-        delete Actions.back();
-        Actions.pop_back();
-      }
-    }
+    double ShortestBeatInterval;
+    double MaxBPM;
+    double Rating;
 
-    LightProgramImpl &GetProgram() {
-      assert(ActiveProgram && "Channel program is not active!");
-      return *ActiveProgram;
+    /// The light assignment for the setup in AssignedSetup, if any, computed
+    /// by WorksWithSetup(): the channel driving each light (or -1), and the
+    /// lights grouped into classes which work with the same channels. Any
+    /// permutation of the lights within a class is also an assignment.
+    mutable std::vector<LightInfo> AssignedSetup;
+    mutable bool HasAssignedSetup, HasAssignment;
+    mutable std::vector<int> LightOwners;
+    mutable std::vector<unsigned> ClassLights, ClassStart;
+
+    unsigned GetNumChannels() const {
+      return ChannelPosition.size();
     }
 
-    LightManager &GetManager();
-
-    std::vector<ChannelAction*> &GetActions() { return Actions; }
+    bool WorksWithLight(unsigned Channel, const LightInfo &Info) const {
+      if (ChannelColor[Channel] != -1 && Info.Color != ChannelColor[Channel])
+        return false;
 
-    void Start(unsigned LightIndex, LightProgramImpl &Program) {
-      assert(!Actions.empty() && "Channel program has no actions!");
-
-      ActiveProgram = &Program;
-      ActiveLightIndex = LightIndex;
-      
-      Position = 0;
-      for (unsigned i = 0, e = Actions.size(); i != e; ++i)
-        Actions[i]->Initialize(*this);
-      Actions[0]->Start();
-    }
-    void Stop() {
-      ActiveProgram = 0;
-    }
+      if (ChannelNeedsStrobe[Channel])
+        return Info.isStrobe();
 
-    unsigned GetPosition() {
-      return Position;
+      return !Info.isStrobe();
     }
 
-    void Step(MusicMonitorHandler::BeatKind Kind);
-
-    void GotoPosition(unsigned NewPosition) {
-      assert(NewPosition < Actions.size() && "Invalid position!");
-
-      // If we are jumping backwards, reinitialize all the actions in between.
-      for (unsigned i = NewPosition + 1, e = Position; i < e; ++i) {
-        Actions[i]->Initialize(*this);
+    /// Orders lights by the channels they work with.
+    struct CompareLights {
+      const LightProgramImpl &Program;
+      const std::vector<LightInfo> &Lights;
+
+      CompareLights(const LightProgramImpl &Program_,
+                    const std::vector<LightInfo> &Lights_)
+        : Program(Program_), Lights(Lights_) {}
+
+      bool operator()(unsigned A, unsigned B) const {
+        for (unsigned i = 0, e = Program.GetNumChannels(); i != e; ++i) {
+          bool WorksWithA = Program.WorksWithLight(i, Lights[A]);
+          bool WorksWithB = Program.WorksWithLight(i, Lights[B]);
+          if (WorksWithA != WorksWithB)
+            return WorksWithA < WorksWithB;
+        }
+        return false;
       }
+    };
 
-      // Update the position.
-      Position = NewPosition;
-      Actions[Position]->Start();
+    /// Try to find a light for \arg Channel, moving other channels to other
+    /// lights if needed (an augmenting path, in Kuhn's matching algorithm).
+    bool AssignChannel(unsigned Channel, const std::vector<LightInfo> &Lights,
+                       std::vector<bool> &Visited) const {
+      for (unsigned i = 0, e = Lights.size(); i != e; ++i) {
+        if (Visited[i] || !WorksWithLight(Channel, Lights[i]))
+          continue;
+
+        Visited[i] = true;
+        if (LightOwners[i] == -1 ||
+            AssignChannel(LightOwners[i], Lights, Visited)) {
+          LightOwners[i] = Channel;
+          return true;
+        }
+      }
+      return false;
     }
 
-    const LightState &GetLightState() {
-      return GetManager().GetLightState(ActiveLightIndex);
+    bool IsAssignedSetup(const std::vector<LightInfo> &Lights) const {
+      if (!HasAssignedSetup || Lights.size() != AssignedSetup.size())
+        return false;
+      for (unsigned i = 0, e = Lights.size(); i != e; ++i) {
+        if (Lights[i].Kind != AssignedSetup[i].Kind ||
+            Lights[i].Color != AssignedSetup[i].Color ||
+            Lights[i].Index != AssignedSetup[i].Index)
+          return false;
+      }
+      return true;
     }
 
-    void SetLight(bool Enable) {
-      return GetManager().SetLight(ActiveLightIndex, Enable);
+    void ResetInstruction(unsigned Index) {
+      switch (Code[Index].Op) {
+      case LightInstruction::kOp_RepeatCount:
+        State[Index] = 1;
+        break;
+      case LightInstruction::kOp_RepeatTime:
+        State[Index] = ActiveElapsed;
+        break;
+      default:
+        State[Index] = 0;
+        break;
+      }
     }
 
-    const LightState &GetLightState(bool Enable) {
-      return GetManager().GetLightState(ActiveLightIndex);
-    }
+    void GotoPosition(unsigned Channel, unsigned NewPosition) {
+      unsigned &Position = ChannelPosition[Channel];
+      assert(NewPosition >= ChannelStart[Channel] &&
+             NewPosition < ChannelStart[Channel + 1] && "Invalid position!");
 
-    bool WorksWithLight(const LightInfo &Info) const {
-      if (NeedsStrobe)
-        return Info.isStrobe();
+      // If we are jumping backwards, reset all the instructions in between.
+      for (unsigned i = NewPosition + 1; i < Position; ++i)
+        ResetInstruction(i);
 
-      return !Info.isStrobe();
+      // Update the position. A fade starts counting its beats afresh.
+      Position = NewPosition;
+      if (Code[Position].Op == LightInstruction::kOp_Fade)
+        State[Position] = 0;
     }
-  };
-
-  class LightProgramImpl : public LightProgram {
-    LightManager *ActiveManager;
-    std::vector<int> ActiveAssignments;
-    double ActiveStartTime;
-    double ActiveBeatElapsed;
 
-    /// The program name.
-    std::string Name;
-
-    /// The maximum amount of time to run this program before requesting the
-    /// manager switch programs.
-    double MaxProgramTime;
-
-    /// The program to run for each light channel.
-    std::vector<ChannelProgram *> ChannelPrograms;
-
-    double ShortestBeatInterval;
-    double MaxBPM;
-    double Rating;
+    void RunChannel(unsigned Channel, MusicMonitorHandler::BeatKind Kind,
+                    bool IsTick);
 
   public:
-    LightProgramImpl(std::string Name_, double MaxProgramTime_,
-                     std::vector<ChannelProgram *> ChannelPrograms_,
-                     double ShortestBeatInterval_ = 0.03,
-                     double MaxBPM_ = -1,
-                     double Rating_ = 1.0)
+    LightProgramImpl(const LightProgramCode &Program)
       : ActiveManager(0),
         ActiveStartTime(-1),
         ActiveBeatElapsed(-1),
-        Name(Name_),
-        MaxProgramTime(MaxProgramTime_),
-        ChannelPrograms(ChannelPrograms_),
-        ShortestBeatInterval(ShortestBeatInterval_),
-        MaxBPM(MaxBPM_),
-        Rating(Rating_)
+        ActiveElapsed(-1),
+        Name(Program.Name),
+        MaxProgramTime(Program.MaxProgramTime),
+        ShortestBeatInterval(Program.ShortestBeatInterval),
+        MaxBPM(Program.MaxBPM),
+        Rating(Program.Rating),
+        HasAssignedSetup(false),
+        HasAssignment(false)
     {
+      // Lay the channels out back to back.
+      BeatKinds = 0;
+      for (unsigned i = 0, e = Program.Channels.size(); i != e; ++i) {
+        const LightChannelCode &Channel = Program.Channels[i];
+        assert(!Channel.Code.empty() && "Channel program has no actions!");
+
+        ChannelStart.push_back(Code.size());
+        ChannelPosition.push_back(Code.size());
+        ChannelBeatKinds.push_back(Channel.BeatKinds);
+        ChannelNeedsStrobe.push_back(Channel.NeedsStrobe);
+        ChannelColor.push_back(Channel.Color);
+        Code.insert(Code.end(), Channel.Code.begin(), Channel.Code.end());
+        BeatKinds |= Channel.BeatKinds;
+      }
+      ChannelStart.push_back(Code.size());
+      State.resize(Code.size());
+      ActiveAssignments.reserve(GetNumChannels());
     }
 
     virtual bool WorksWithSetup(const std::vector<LightInfo> &Lights) const {
-      // FIXME: Implement.
-      return true;
+      if (IsAssignedSetup(Lights))
+        return HasAssignment;
+
+      // Match the channels to the lights.
+      AssignedSetup = Lights;
+      HasAssignedSetup = true;
+      LightOwners.assign(Lights.size(), -1);
+      ActiveOwners.reserve(Lights.size());
+      HasAssignment = GetNumChannels() <= Lights.size();
+      std::vector<bool> Visited;
+      for (unsigned i = 0, e = GetNumChannels(); HasAssignment && i != e; ++i) {
+        Visited.assign(Lights.size(), false);
+        HasAssignment = AssignChannel(i, Lights, Visited);
+      }
+
+      // Group the lights which are interchangeable.
+      ClassLights.clear();
+      ClassStart.clear();
+      for (unsigned i = 0, e = Lights.size(); i != e; ++i)
+        ClassLights.push_back(i);
+      CompareLights Compare(*this, Lights);
+      std::stable_sort(ClassLights.begin(), ClassLights.end(), Compare);
+      for (unsigned i = 0, e = ClassLights.size(); i != e; ++i)
+        if (i == 0 || Compare(ClassLights[i - 1], ClassLights[i]))
+          ClassStart.push_back(i);
+      ClassStart.push_back(ClassLights.size());
+
+      return HasAssignment;
     }
 
-    virtual std::string GetName() const {
+    virtual const std::string &GetName() const {
       return Name;
     }
 
+    virtual double GetMaxBPM() const {
+      return MaxBPM;
+    }
+
     virtual double GetRating(LightManager &Manager) const {
       // If the current BPM is above the max BPM, don't select this program.
       if (MaxBPM != -1 && Manager.GetRecentBPM() > MaxBPM)
         return 0.0;
 
+      // Don't select programs which follow beat kinds the music monitor isn't
+      // producing, their channels would never step. Low beats are always
+      // produced.
+      for (unsigned i = 0; i != MusicMonitorHandler::kNumBeatKinds; ++i) {
+        MusicMonitorHandler::BeatKind Kind = MusicMonitorHandler::BeatKind(i);
+        if (Kind != MusicMonitorHandler::kBeatLow &&
+            (BeatKinds & (1 << Kind)) && !Manager.HasRecentBeats(Kind))
+          return 0.0;
+      }
+
       // Otherwise, return the rating.
       return Rating;
     }
@@ -206,49 +257,49 @@ namespace {
       ActiveManager = &Manager;
       ActiveStartTime = get_elapsed_time_in_seconds();
       ActiveBeatElapsed = -1;
-
-      // Create the light assignment. This isn't really good enough, as it could
-      // fail to find assignments if programs got more complicated (could assign
-      // to multiple light types). Good enough for now though.
-      std::vector<LightInfo> AvailableLights = Manager.GetSetup();
-      for (unsigned i = 0, e = ChannelPrograms.size(); i != e; ++i) {
-        std::vector<unsigned> UsableLights;
-        ChannelProgram *Program = ChannelPrograms[i];
-
-        // Determine the lights that this program can use.
-        for (unsigned j = 0; j != AvailableLights.size(); ++j) {
-          if (Program->WorksWithLight(AvailableLights[j]))
-            UsableLights.push_back(j);
-        }
-
-        assert(!UsableLights.empty() &&
-               "unable to compute light assignment!");
-        unsigned Index = int(floorf(drand48() * UsableLights.size()));
-
-        ActiveAssignments.push_back(AvailableLights[UsableLights[Index]].Index);
-        AvailableLights.erase(AvailableLights.begin() + UsableLights[Index]);
+      ActiveElapsed = 0;
+      for (unsigned i = 0; i != MusicMonitorHandler::kNumBeatKinds; ++i)
+        LastBeatElapsed[i] = BeatInterval[i] = -1;
+
+      // Take the assignment for this setup (normally already computed when
+      // the program was loaded), and shuffle the lights within each class.
+      bool Works = WorksWithSetup(Manager.GetSetup());
+      assert(Works && "unable to compute light assignment!");
+      (void) Works;
+      ActiveOwners.assign(LightOwners.begin(), LightOwners.end());
+      Random &Generator = Manager.GetRandom();
+      for (unsigned i = 0, e = ClassStart.size() - 1; i != e; ++i) {
+        const unsigned *Class = &ClassLights[ClassStart[i]];
+        for (unsigned j = ClassStart[i + 1] - ClassStart[i]; j > 1; --j)
+          std::swap(ActiveOwners[Class[j - 1]],
+                    ActiveOwners[Class[Generator.GetIndex(j)]]);
       }
+      ActiveAssignments.resize(GetNumChannels());
+      for (unsigned i = 0, e = ActiveOwners.size(); i != e; ++i)
+        if (ActiveOwners[i] != -1)
+          ActiveAssignments[ActiveOwners[i]] = i;
 
-      for (unsigned i = 0, e = ChannelPrograms.size(); i != e; ++i) {
-        ChannelPrograms[i]->Start(ActiveAssignments[i], *this);
-      }
+      // Reset all the channels to their first instruction.
+      for (unsigned i = 0, e = GetNumChannels(); i != e; ++i)
+        ChannelPosition[i] = ChannelStart[i];
+      for (unsigned i = 0, e = Code.size(); i != e; ++i)
+        ResetInstruction(i);
 
       // Turn off any lights which aren't assigned.
-      for (unsigned i = 0, e = AvailableLights.size(); i != e; ++i) {
-        GetManager().SetLight(AvailableLights[i].Index, false);
+      for (unsigned i = 0, e = ActiveOwners.size(); i != e; ++i) {
+        if (ActiveOwners[i] == -1)
+          GetManager().SetLight(i, false);
       }
     }
     virtual void Stop() {
-      for (unsigned i = 0, e = ChannelPrograms.size(); i != e; ++i) {
-        ChannelPrograms[i]->Stop();
-      }
-
       ActiveManager = 0;
       ActiveAssignments.clear();
     }
 
-    double GetActiveBeatElapsed() const {
-      return ActiveBeatElapsed;
+    /// Get the recent interval between beats of the given kind, assuming 120
+    /// BPM until we have seen a couple.
+    double GetBeatInterval(MusicMonitorHandler::BeatKind Kind) const {
+      return BeatInterval[Kind] < 0 ? 0.5 : BeatInterval[Kind];
     }
 
     LightManager &GetManager() const {
@@ -266,539 +317,165 @@ namespace {
       GetManager().SetLight(LightIndex, Enable);
     }
 
+    void FadeChannel(unsigned ChannelIndex, double Level, double Duration,
+                     FadeEngine::Curve Shape) {
+      assert(ChannelIndex < ActiveAssignments.size() &&
+             "Invalid channel index");
+      int LightIndex = ActiveAssignments[ChannelIndex];
+      if (LightIndex == -1)
+        return;
+
+      GetManager().FadeLight(LightIndex, Level, Duration, Shape);
+    }
+
     virtual void HandleBeat(MusicMonitorHandler::BeatKind Kind, double time) {
       double Elapsed = get_elapsed_time_in_seconds() - ActiveStartTime;
 
+      if (!(BeatKinds & (1 << Kind)))
+        return;
+
       // For now, we globally filter out beats that are too fast. I haven't
       // figured out a better place to incorporate this yet.
-      if (Elapsed - ActiveBeatElapsed < ShortestBeatInterval)
+      if (Elapsed - LastBeatElapsed[Kind] < ShortestBeatInterval)
         return;
 
-      ActiveBeatElapsed = Elapsed;
+      // Track the beat interval, ignoring gaps in the music.
+      double Interval = Elapsed - LastBeatElapsed[Kind];
+      if (LastBeatElapsed[Kind] >= 0 && Interval < 2.0) {
+        if (BeatInterval[Kind] < 0)
+          BeatInterval[Kind] = Interval;
+        else
+          BeatInterval[Kind] += .25 * (Interval - BeatInterval[Kind]);
+      }
+
+      LastBeatElapsed[Kind] = Elapsed;
+      ActiveBeatElapsed = ActiveElapsed = Elapsed;
 
-      for (unsigned i = 0, e = ChannelPrograms.size(); i != e; ++i)
-        ChannelPrograms[i]->Step(Kind);
+      for (unsigned i = 0, e = GetNumChannels(); i != e; ++i) {
+        if (ChannelBeatKinds[i] & (1 << Kind)) {
+          latency_record(kLatencyStage_Step);
+          RunChannel(i, Kind, /*IsTick=*/false);
+        }
+      }
 
       if (ActiveBeatElapsed > MaxProgramTime)
         GetManager().ChangePrograms();
     }
+
+    virtual void HandleTick() {
+      ActiveElapsed = get_elapsed_time_in_seconds() - ActiveStartTime;
+
+      // If the current instruction lets a channel continue, the following ones
+      // run as if on a beat of the (first) kind it follows.
+      for (unsigned i = 0, e = GetNumChannels(); i != e; ++i)
+        RunChannel(i,
+                   MusicMonitorHandler::BeatKind(
+                     __builtin_ctz(ChannelBeatKinds[i])),
+                   /*IsTick=*/true);
+
+      if (ActiveElapsed > MaxProgramTime)
+        GetManager().ChangePrograms();
+    }
   };
 }
 
 LightProgram::LightProgram() {}
 LightProgram::~LightProgram() {}
 
-LightManager &ChannelProgram::GetManager() {
-  return GetProgram().GetManager();
-}
+void LightProgramImpl::RunChannel(unsigned Channel,
+                                  MusicMonitorHandler::BeatKind Kind,
+                                  bool IsTick) {
+  enum { Retry, Advance, Next, Jump } Result;
 
-void ChannelProgram::Step(MusicMonitorHandler::BeatKind Kind) {
-  // Execute program actions in a loop.
+  // Execute instructions until one ends the step.
   for (;;) {
-    // Get the current action.
-    ChannelAction *Action = Actions[Position];
+    unsigned Position = ChannelPosition[Channel];
+    const LightInstruction &I = Code[Position];
+    double &S = State[Position];
+
+    // Only the instruction current at a tick sees the tick, the ones it lets
+    // the channel continue to run as on a beat.
+    if (IsTick) {
+      IsTick = false;
+      if (I.Op != LightInstruction::kOp_RepeatTime ||
+          ActiveElapsed - S < I.Value)
+        return;
+      Result = Next;
+    } else {
+      switch (I.Op) {
+      case LightInstruction::kOp_Set:
+        SetChannel(Channel, I.Value != 0);
+        Result = Advance;
+        break;
+
+      case LightInstruction::kOp_Fade:
+        // Hold the channel for as many beats as the fade takes.
+        if (S++ == 0)
+          FadeChannel(Channel, I.Value, I.Count * GetBeatInterval(Kind),
+                      FadeEngine::Curve(I.Curve));
+        Result = S < I.Count ? Retry : Advance;
+        break;
+
+      case LightInstruction::kOp_RepeatCount:
+        Result = ++S < I.Count ? Jump : Advance;
+        break;
+
+      case LightInstruction::kOp_RepeatTime:
+        Result = ActiveElapsed - S < I.Value ? Jump : Advance;
+        break;
+
+      case LightInstruction::kOp_IfOkToStrobe: {
+        double BPM = GetManager().GetRecentBPM();
+        double Elapsed = get_elapsed_time_in_seconds();
+        double EnabledTime = GetManager().GetLightState(
+          ActiveAssignments[Channel]).TotalEnabledTime;
+        double PercentStrobed =  EnabledTime / Elapsed;
+#ifdef DEBUG_STROBE
+        fprintf(stderr,
+                "strobe? %.2f / %.2f  = %.2f < %.2f, bpm: %.2f < %.2f\n",
+                EnabledTime, Elapsed, PercentStrobed, I.Value, BPM, I.MinBPM);
+#endif
+        Result = PercentStrobed <= I.Value && BPM >= I.MinBPM ? Jump : Advance;
+        break;
+      }
+
+      case LightInstruction::kOp_Goto:
+        Result = Jump;
+        break;
 
-    // Step the action.
-    ChannelAction::ActionResult Result = Action->Step(Kind, *this);
+      default:
+        assert(0 && "Invalid opcode!");
+        return;
+      }
+    }
 
     // Handle the result.
-    switch (Result.Kind) {
-    case ChannelAction::ActionResult::Retry:
-      // We are done, we will restart with this action.
+    switch (Result) {
+    case Retry:
+      // We are done, we will restart with this instruction.
       return;
 
-    case ChannelAction::ActionResult::Advance:
-    case ChannelAction::ActionResult::Next:
-      // Goto the next action, or restart if at the end. We increment the
-      // position first because we want to reinitialize everything when we
-      // restart.
-      ++Position;
-      GotoPosition(Position % Actions.size());
-
-      // If this was an advance action, we are done.
-      if (Result.Kind == ChannelAction::ActionResult::Advance)
+    case Advance:
+    case Next:
+      // Goto the next instruction, or restart if at the end. We increment the
+      // position first because we want to reset everything when we restart.
+      if (++ChannelPosition[Channel] == ChannelStart[Channel + 1])
+        GotoPosition(Channel, ChannelStart[Channel]);
+      else
+        GotoPosition(Channel, ChannelPosition[Channel]);
+
+      // If this was an advance, we are done.
+      if (Result == Advance)
         return;
       break;
 
-    case ChannelAction::ActionResult::Goto:
-      // Goto the requested position.
-      GotoPosition(Result.Value);
+    case Jump:
+      GotoPosition(Channel, Position + I.Offset);
       break;
-
-    case ChannelAction::ActionResult::SwitchPrograms:
-      // Ask the manager to switch programs at the next opportunity.
-      GetProgram().GetManager().ChangePrograms();
-      return;
     }
   }
 }
 
-/*
- * Channel Actions
- */
-
-namespace {
-  class SetLightAction : public ChannelAction {
-    bool Enable;
-
-  public:
-    SetLightAction(bool Enable_) : Enable(Enable_) {}
-
-    virtual ActionResult Step(MusicMonitorHandler::BeatKind Kind,
-                              ChannelProgram &Program) {
-      Program.SetLight(Enable);
-      return ActionResult::MakeAdvance();
-    }
-  };
-
-  class RepeatCount : public ChannelAction {
-    unsigned Count;
-    int GotoPosition;
-
-    unsigned CurrentCount;
-
-  public:
-    RepeatCount(unsigned Count_, int GotoPosition_)
-      : Count(Count_), GotoPosition(GotoPosition_) {}
-
-    virtual void Initialize(ChannelProgram &Program) {
-      CurrentCount = 1;
-    }
-
-    virtual ActionResult Step(MusicMonitorHandler::BeatKind Kind,
-                              ChannelProgram &Program) {
-      if (++CurrentCount < Count)
-        return ActionResult::MakeGoto(Program.GetPosition() + GotoPosition);
-      return ActionResult::MakeAdvance();
-    }
-  };
-
-  class RepeatTime : public ChannelAction {
-    double Time;
-    int GotoPosition;
-
-    double StartTime;
-
-  public:
-    RepeatTime(unsigned Time_, int GotoPosition_)
-      : Time(Time_), GotoPosition(GotoPosition_) {}
-
-    virtual void Initialize(ChannelProgram &Program) {
-      StartTime = Program.GetProgram().GetActiveBeatElapsed();
-    }
-
-    virtual ActionResult Step(MusicMonitorHandler::BeatKind Kind,
-                              ChannelProgram &Program) {
-      double Elapsed = Program.GetProgram().GetActiveBeatElapsed() - StartTime;
-      if (Elapsed < Time)
-        return ActionResult::MakeGoto(Program.GetPosition() + GotoPosition);
-      return ActionResult::MakeAdvance();
-    }
-  };
-
-  class IfOkToStrobe : public ChannelAction {
-    double Percent;
-    int GotoPosition;
-    double MinBPM;
-
-  public:
-    IfOkToStrobe(double Percent_, int GotoPosition_,
-                 double MinBPM_ = 300.0)
-      : Percent(Percent_), GotoPosition(GotoPosition_), MinBPM(MinBPM_) {}
-
-    virtual ActionResult Step(MusicMonitorHandler::BeatKind Kind,
-                              ChannelProgram &Program) {
-      double BPM = Program.GetManager().GetRecentBPM();
-      double Elapsed = get_elapsed_time_in_seconds();
-      double EnabledTime = Program.GetLightState().TotalEnabledTime;
-      double PercentStrobed =  EnabledTime / Elapsed;
-      fprintf(stderr, "strobe? %.2f / %.2f  = %.2f < %.2f, bpm: %.2f < %.2f\n",
-              EnabledTime, Elapsed, PercentStrobed, Percent, BPM, MinBPM);
-
-      if (PercentStrobed <= Percent && BPM >= MinBPM)
-        return ActionResult::MakeGoto(Program.GetPosition() + GotoPosition);
-      return ActionResult::MakeAdvance();
-    }
-  };
-}
-
-///
-
-static ChannelProgram *GetStrobeProgram() {
-  ChannelProgram *P = new ChannelProgram(/*NeedStrobe=*/true);
-
-  P->GetActions().push_back(new IfOkToStrobe(.1, 4));
-
-  // Not ok to strobe.
-  P->GetActions().push_back(new SetLightAction(false));
-  P->GetActions().push_back(new RepeatCount(180, -1));
-  P->GetActions().push_back(new RepeatCount(999, -3));
-
-  // Ok to strobe.
-  P->GetActions().push_back(new SetLightAction(true));
-  P->GetActions().push_back(new RepeatCount(90, -1));
-  P->GetActions().push_back(new SetLightAction(false));
-  P->GetActions().push_back(new RepeatCount(30, -1));
-  P->GetActions().push_back(new RepeatCount(5, -4));
-                                           
-  return P;
-}
-
-void LightProgram::LoadAllPrograms(std::vector<LightProgram *> &Result) {
-  std::vector<ChannelProgram *> Programs;
-  double MaxProgramTime = 60;
-  ChannelProgram *P0, *P1, *P2;
-
-  // Create a simple toggle program, by making alternating channels.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(false));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("alternating", MaxProgramTime,
-                                        Programs));
-
-  // Create a simple toggle program, by making alternating channels.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(true));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new SetLightAction(false));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("alternating (2x)", MaxProgramTime,
-                                        Programs));
-
-  // Create a simple chase program.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(true));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("chase", MaxProgramTime, Programs,
-                                        /*ShortesteBeatInterval=*/.1));
-
-  // Create a double chase program.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(true));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("double chase", MaxProgramTime,
-                                        Programs,
-                                        /*ShortesteBeatInterval=*/.1));
-
-  // Create a double chase (delayed) program.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("double chase (slow)", MaxProgramTime,
-                                        Programs,
-                                        /*ShortesteBeatInterval=*/.1));
-
-  // Create a roll program.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatCount(4, -1));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new RepeatCount(4, -1));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new RepeatCount(4, -1));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("roll (slow)", MaxProgramTime,
-                                        Programs,
-                                        /*ShortesteBeatInterval=*/.1));
-
-  // Create a roll program.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P2 = new ChannelProgram();
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(false));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new SetLightAction(true));
-  P2->GetActions().push_back(new SetLightAction(true));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(P2);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("roll", MaxProgramTime,
-                                        Programs,
-                                        /*ShortesteBeatInterval=*/.1));
-
-  // Create a slightly more complex toggle program, that leaves one light on
-  // while toggling the other, then switches.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(GetStrobeProgram());
-  Result.push_back(new LightProgramImpl("long alternating", MaxProgramTime,
-                                        Programs));
-
-  // Create an alternating toggle that toggles for 5s.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatTime(5, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatTime(10, -2));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatTime(5, -2));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatTime(10, -1));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Programs.push_back(GetStrobeProgram());
-  if (true)
-    Result.push_back(new LightProgramImpl("timed alternating", MaxProgramTime,
-                                          Programs));
-
-  // Create a slow toggle that switches lights every 3s.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(true));
-  P0->GetActions().push_back(new RepeatTime(3, -1));
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatTime(6, -1));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(false));
-  P1->GetActions().push_back(new RepeatTime(3, -1));
-  P1->GetActions().push_back(new SetLightAction(true));
-  P1->GetActions().push_back(new RepeatTime(6, -1));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  if (true)
-    Result.push_back(new LightProgramImpl("slow alternating", MaxProgramTime,
-                                          Programs));
-
-  // Create a program that leaves one light on, and alternates the other one in
-  // varying patterns.
-  P0 = new ChannelProgram();
-  P0->GetActions().push_back(new SetLightAction(false));
-  P0->GetActions().push_back(new RepeatTime(1, -1));
-  P0->GetActions().push_back(new SetLightAction(true));
-  P1 = new ChannelProgram();
-  P1->GetActions().push_back(new SetLightAction(true));
-
-  Programs.clear();
-  Programs.push_back(P0);
-  Programs.push_back(P1);
-  Result.push_back(new LightProgramImpl("stable with flicker", MaxProgramTime,
-                                        Programs, 0.05, 200, .5));
-
-  // Very slow patterns (early).
-
-  if (true) {
-    P0 = new ChannelProgram();
-    P0->GetActions().push_back(new SetLightAction(true));
-    P1 = new ChannelProgram();
-    P1->GetActions().push_back(new SetLightAction(false));
-  
-    Programs.clear();
-    Programs.push_back(P0);
-    Programs.push_back(P1);
-    Result.push_back(new LightProgramImpl("static: mono", MaxProgramTime,
-                                          Programs, 0.05, 200, .2));
-  }
-
-  if (true) {
-    P0 = new ChannelProgram();
-    P0->GetActions().push_back(new SetLightAction(true));
-    P1 = new ChannelProgram();
-    P1->GetActions().push_back(new SetLightAction(true));
-  
-    Programs.clear();
-    Programs.push_back(P0);
-    Programs.push_back(P1);
-    Result.push_back(new LightProgramImpl("static: dual", MaxProgramTime,
-                                          Programs, 0.05, 200, .2));
-  }
-
-  if (true) {
-    unsigned Length = 90;
-    P0 = new ChannelProgram();
-    P0->GetActions().push_back(new SetLightAction(true));
-    P0->GetActions().push_back(new RepeatCount(Length, -1));
-    P0->GetActions().push_back(new SetLightAction(false));
-    P0->GetActions().push_back(new RepeatCount(Length, -1));
-    P1 = new ChannelProgram();
-    P1->GetActions().push_back(new SetLightAction(false));
-    P1->GetActions().push_back(new RepeatCount(Length, -1));
-    P1->GetActions().push_back(new SetLightAction(true));
-    P1->GetActions().push_back(new RepeatCount(Length, -1));
-  
-    Programs.clear();
-    Programs.push_back(P0);
-    Programs.push_back(P1);
-    Result.push_back(new LightProgramImpl("vs: alternating", MaxProgramTime,
-                                          Programs, 0.05, 200, .2));
-  }
-
-  if (true) {
-    unsigned Length = 90;
-    P0 = new ChannelProgram();
-    P0->GetActions().push_back(new SetLightAction(true));
-    P0->GetActions().push_back(new RepeatCount(Length, -1));
-    P0->GetActions().push_back(new SetLightAction(false));
-    P0->GetActions().push_back(new RepeatCount(Length, -1));
-    P0->GetActions().push_back(new SetLightAction(true));
-    P0->GetActions().push_back(new RepeatCount(Length, -1));
-    P1 = new ChannelProgram();
-    P1->GetActions().push_back(new SetLightAction(false));
-    P1->GetActions().push_back(new RepeatCount(Length, -1));
-    P1->GetActions().push_back(new SetLightAction(true));
-    P1->GetActions().push_back(new RepeatCount(Length, -1));
-    P1->GetActions().push_back(new SetLightAction(true));
-    P1->GetActions().push_back(new RepeatCount(Length, -1));
-  
-    Programs.clear();
-    Programs.push_back(P0);
-    Programs.push_back(P1);
-    Result.push_back(new LightProgramImpl("vs: alternating (2)", MaxProgramTime,
-                                          Programs, 0.05, 200, .2));
-  }
+LightProgram *CreateLightProgram(const LightProgramCode &Code) {
+  return new LightProgramImpl(Code);
 }
@@ -9,6 +9,7 @@
 
 class LightManager;
 struct LightInfo;
+struct LightProgramCode;
 
 class LightProgram {
   friend class LightManager;
@@ -17,19 +18,43 @@ protected:
   LightProgram();
   
 public:
-  static void LoadAllPrograms(std::vector<LightProgram *> &Result);
+  /// \brief Load the programs from all the program files (*.ldp) in
+  /// \arg Directory, in name order. Files which fail to compile are reported
+  /// and skipped, and counted in \arg NumFailedFiles if given. Returns false
+  /// if the directory can't be read.
+  ///
+  /// Compiled programs are cached in Directory/.cache, keyed by a hash of the
+  /// file contents, so unchanged files aren't parsed again. Cache files no
+  /// longer matching any program file are removed.
+  static bool LoadAllPrograms(const std::string &Directory,
+                              std::vector<LightProgram *> &Result,
+                              unsigned *NumFailedFiles = 0);
 
   virtual ~LightProgram();
 
-  virtual std::string GetName() const = 0;
+  virtual const std::string &GetName() const = 0;
+
+  /// \brief Return the relative chance of selecting the program. The manager
+  /// caches ratings, so they may only depend on whether the recent BPM is
+  /// above GetMaxBPM(), and on which beat kinds have been seen recently.
   virtual double GetRating(LightManager &Manager) const = 0;
 
+  /// \brief The BPM above which the program isn't selected, or -1.
+  virtual double GetMaxBPM() const = 0;
+
   virtual bool WorksWithSetup(const std::vector<LightInfo> &Lights) const = 0;
 
   virtual void Start(LightManager &Manager) = 0;
   virtual void Stop() = 0;
 
   virtual void HandleBeat(MusicMonitorHandler::BeatKind Kind, double time) = 0;
+
+  /// \brief Advance the program to the current time, between beats. This is
+  /// called once per rendered frame.
+  virtual void HandleTick() = 0;
 };
 
+/// \brief Create a program running the compiled \arg Code.
+LightProgram *CreateLightProgram(const LightProgramCode &Code);
+
 #endif // LIGHTPROGRAM_H
@@ -0,0 +1,825 @@
+// Loading light programs from program files (*.ldp), see README.md for the
+// language.
+
+#include "LightProgram.h"
+
+#include "FadeEngine.h"
+#include "LightBytecode.h"
+#include "LightInfo.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/*
+ * Code Checks
+ */
+
+/// Check that the interpreter can run instruction \arg Index of the channel
+/// \arg Code, returning the problem or null. The compiler reports these, and
+/// cached code failing them is compiled again.
+const char *CheckInstruction(const std::vector<LightInstruction> &Code,
+                             unsigned Index) {
+  const LightInstruction &I = Code[Index];
+  switch (I.Op) {
+  case LightInstruction::kOp_Set:
+    return 0;
+  case LightInstruction::kOp_Fade:
+    if (I.Count == 0 || I.Curve > FadeEngine::kCurve_Smooth)
+      return "invalid fade";
+    return 0;
+  case LightInstruction::kOp_RepeatCount:
+    if (I.Count == 0)
+      return "invalid repeat count";
+    break;
+  case LightInstruction::kOp_RepeatTime:
+  case LightInstruction::kOp_IfOkToStrobe:
+  case LightInstruction::kOp_Goto:
+    break;
+  default:
+    return "invalid opcode";
+  }
+
+  int e = Code.size();
+  int Target = int(Index) + I.Offset;
+  if (Target < 0 || Target >= e)
+    return "jump target is outside the channel";
+
+  // Jumps which depend on nothing that changes during a beat must reach a
+  // light change, or the channel would loop forever.
+  int NumJumps = 0;
+  for (unsigned j = Index; NumJumps <= e; ++NumJumps) {
+    unsigned Op = Code[j].Op;
+    if (Op != LightInstruction::kOp_Goto &&
+        Op != LightInstruction::kOp_RepeatTime &&
+        Op != LightInstruction::kOp_IfOkToStrobe)
+      break;
+    int Next = int(j) + Code[j].Offset;
+    if (Next < 0 || Next >= e)
+      break;
+    j = Next;
+  }
+  if (NumJumps > e)
+    return "jumps loop forever";
+  return 0;
+}
+
+/// Return true if instruction \arg I changes the light, ending the step.
+bool IsStepInstruction(const LightInstruction &I) {
+  return I.Op == LightInstruction::kOp_Set ||
+    I.Op == LightInstruction::kOp_Fade;
+}
+
+/*
+ * Compiler
+ */
+
+/// The source line of each instruction of a channel, and the labels.
+struct ChannelSource {
+  unsigned StartLine;
+  LightChannelCode Channel;
+  std::vector<unsigned> Lines;
+  std::map<std::string, unsigned> Labels;
+
+  struct Fixup {
+    unsigned Index;
+    std::string Label;
+  };
+  std::vector<Fixup> Fixups;
+};
+
+class ProgramCompiler {
+  const char *Path;
+  unsigned Line;
+  unsigned NumErrors;
+
+  std::vector<LightProgramCode> &Programs;
+  std::vector<unsigned> ProgramLines;
+  std::map<std::string, LightChannelCode> Templates;
+
+  /// The channel being compiled, if any, and the template it defines.
+  ChannelSource *Current;
+  std::string TemplateName;
+
+  void Error(const char *Format, ...) __attribute__((format(printf, 2, 3)));
+  void ErrorAt(unsigned AtLine, const std::string &Message);
+
+  bool ParseNumber(const std::string &Token, double &Result,
+                   const char *Suffix = "");
+  bool ParseCount(const std::string &Token, unsigned &Result);
+  bool ParseTarget(const std::string &Token, LightInstruction &I);
+  bool ParseBeatKinds(const std::string &Token, unsigned &Result);
+  bool ParseColor(const std::string &Token, int &Result);
+
+  void FinishChannel();
+  void StartChannel(const std::vector<std::string> &Tokens, unsigned First);
+  void ParseProgram(const std::vector<std::string> &Tokens);
+  void ParseChannel(const std::vector<std::string> &Tokens);
+  void ParseTemplate(const std::vector<std::string> &Tokens);
+  void ParseInstruction(const std::vector<std::string> &Tokens, unsigned First);
+
+public:
+  ProgramCompiler(const char *Path_, std::vector<LightProgramCode> &Programs_)
+    : Path(Path_), Line(0), NumErrors(0), Programs(Programs_), Current(0) {}
+
+  ~ProgramCompiler() {
+    delete Current;
+  }
+
+  bool Compile(const std::string &Source);
+};
+
+void ProgramCompiler::Error(const char *Format, ...) {
+  char Buffer[256];
+  va_list Args;
+  va_start(Args, Format);
+  vsnprintf(Buffer, sizeof(Buffer), Format, Args);
+  va_end(Args);
+  ErrorAt(Line, Buffer);
+}
+
+void ProgramCompiler::ErrorAt(unsigned AtLine, const std::string &Message) {
+  fprintf(stderr, "%s:%u: error: %s\n", Path, AtLine, Message.c_str());
+  ++NumErrors;
+}
+
+bool ProgramCompiler::ParseNumber(const std::string &Token, double &Result,
+                                  const char *Suffix) {
+  char *End;
+  Result = strtod(Token.c_str(), &End);
+  if (End == Token.c_str() || (strcmp(End, "") != 0 && strcmp(End, Suffix))) {
+    Error("invalid number: '%s'", Token.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ProgramCompiler::ParseCount(const std::string &Token, unsigned &Result) {
+  char *End;
+  long Value = strtol(Token.c_str(), &End, 10);
+  if (End == Token.c_str() || *End || Value < 1 || Value > 1000000) {
+    Error("invalid count: '%s'", Token.c_str());
+    return false;
+  }
+  Result = Value;
+  return true;
+}
+
+bool ProgramCompiler::ParseTarget(const std::string &Token,
+                                  LightInstruction &I) {
+  // Signed numbers are offsets from the instruction, anything else a label.
+  if (Token[0] == '+' || Token[0] == '-' || isdigit(Token[0])) {
+    char *End;
+    long Offset = strtol(Token.c_str(), &End, 10);
+    if (End == Token.c_str() || *End) {
+      Error("invalid jump target: '%s'", Token.c_str());
+      return false;
+    }
+    I.Offset = Offset < -32768 || Offset > 32767 ? 32767 : Offset;
+    return true;
+  }
+
+  ChannelSource::Fixup F = { unsigned(Current->Channel.Code.size()), Token };
+  Current->Fixups.push_back(F);
+  return true;
+}
+
+bool ProgramCompiler::ParseBeatKinds(const std::string &Token,
+                                     unsigned &Result) {
+  Result = 0;
+  std::string::size_type Start = 0;
+  for (;;) {
+    std::string::size_type End = Token.find(',', Start);
+    std::string Kind = Token.substr(Start, End - Start);
+    if (Kind == "low") {
+      Result |= 1 << MusicMonitorHandler::kBeatLow;
+    } else if (Kind == "mid") {
+      Result |= 1 << MusicMonitorHandler::kBeatMid;
+    } else if (Kind == "hi") {
+      Result |= 1 << MusicMonitorHandler::kBeatHi;
+    } else {
+      Error("unknown beat kind: '%s'", Kind.c_str());
+      return false;
+    }
+    if (End == std::string::npos)
+      return true;
+    Start = End + 1;
+  }
+}
+
+bool ProgramCompiler::ParseColor(const std::string &Token, int &Result) {
+  LightInfo::LightColor Color;
+  if (!LightInfo::ParseColor(Token, Color)) {
+    Error("unknown color: '%s'", Token.c_str());
+    return false;
+  }
+  Result = Color;
+  return true;
+}
+
+void ProgramCompiler::FinishChannel() {
+  if (!Current)
+    return;
+
+  ChannelSource &S = *Current;
+  std::vector<LightInstruction> &Code = S.Channel.Code;
+
+  // Resolve the labels.
+  bool Resolved = true;
+  for (unsigned i = 0, e = S.Fixups.size(); i != e; ++i) {
+    const ChannelSource::Fixup &F = S.Fixups[i];
+    // Never patch past the code, whatever was dropped.
+    if (F.Index >= Code.size())
+      continue;
+    std::map<std::string, unsigned>::iterator it = S.Labels.find(F.Label);
+    if (it == S.Labels.end()) {
+      ErrorAt(S.Lines[F.Index], "unknown label: '" + F.Label + "'");
+      Resolved = false;
+      continue;
+    }
+    Code[F.Index].Offset = int(it->second) - int(F.Index);
+  }
+
+  bool HasStep = false;
+  for (unsigned i = 0, e = Code.size(); Resolved && i != e; ++i) {
+    if (IsStepInstruction(Code[i]))
+      HasStep = true;
+    if (const char *Problem = CheckInstruction(Code, i))
+      ErrorAt(S.Lines[i], Problem);
+  }
+
+  if (Code.empty())
+    ErrorAt(S.StartLine, "channel has no instructions");
+  else if (Resolved && !HasStep)
+    ErrorAt(S.StartLine, "channel never sets its light");
+
+  if (!TemplateName.empty())
+    Templates[TemplateName] = S.Channel;
+  else if (!Programs.empty())
+    Programs.back().Channels.push_back(S.Channel);
+
+  delete Current;
+  Current = 0;
+  TemplateName.clear();
+}
+
+void ProgramCompiler::StartChannel(const std::vector<std::string> &Tokens,
+                                   unsigned First) {
+  FinishChannel();
+
+  Current = new ChannelSource();
+  Current->StartLine = Line;
+  Current->Channel.NeedsStrobe = false;
+  Current->Channel.Color = -1;
+  Current->Channel.BeatKinds = 1 << MusicMonitorHandler::kBeatLow;
+  for (unsigned i = First, e = Tokens.size(); i != e; ++i) {
+    if (Tokens[i] == "strobe") {
+      Current->Channel.NeedsStrobe = true;
+    } else if (Tokens[i] == "beats" && i + 1 != e) {
+      ParseBeatKinds(Tokens[++i], Current->Channel.BeatKinds);
+    } else if (Tokens[i] == "color" && i + 1 != e) {
+      ParseColor(Tokens[++i], Current->Channel.Color);
+    } else {
+      Error("unexpected '%s'", Tokens[i].c_str());
+    }
+  }
+}
+
+void ProgramCompiler::ParseProgram(const std::vector<std::string> &Tokens) {
+  FinishChannel();
+
+  if (Tokens.size() < 2 || Tokens[1].size() < 2 || Tokens[1][0] != '"') {
+    Error("expected a quoted program name");
+    return;
+  }
+
+  LightProgramCode P;
+  P.Name = Tokens[1].substr(1, Tokens[1].size() - 2);
+  P.MaxProgramTime = 60;
+  P.ShortestBeatInterval = 0.03;
+  P.MaxBPM = -1;
+  P.Rating = 1.0;
+  for (unsigned i = 2, e = Tokens.size(); i != e; ++i) {
+    const std::string &Key = Tokens[i];
+    if (i + 1 == e) {
+      Error("missing value for '%s'", Key.c_str());
+      break;
+    }
+    const std::string &Value = Tokens[++i];
+    if (Key == "max-time")
+      ParseNumber(Value, P.MaxProgramTime, "s");
+    else if (Key == "shortest-beat")
+      ParseNumber(Value, P.ShortestBeatInterval, "s");
+    else if (Key == "max-bpm")
+      ParseNumber(Value, P.MaxBPM);
+    else if (Key == "rating")
+      ParseNumber(Value, P.Rating);
+    else
+      Error("unknown program option: '%s'", Key.c_str());
+  }
+  if (P.Rating < 0)
+    Error("rating must not be negative");
+
+  for (unsigned i = 0, e = Programs.size(); i != e; ++i)
+    if (Programs[i].Name == P.Name)
+      Error("duplicate program: '%s'", P.Name.c_str());
+  Programs.push_back(P);
+  ProgramLines.push_back(Line);
+}
+
+void ProgramCompiler::ParseChannel(const std::vector<std::string> &Tokens) {
+  if (Programs.empty()) {
+    FinishChannel();
+    Error("channel outside of a program");
+    return;
+  }
+
+  if (Tokens.size() >= 2 && Tokens[1] == "use") {
+    FinishChannel();
+    if (Tokens.size() != 3) {
+      Error("expected 'channel use TEMPLATE'");
+      return;
+    }
+    std::map<std::string, LightChannelCode>::iterator it =
+      Templates.find(Tokens[2]);
+    if (it == Templates.end()) {
+      Error("unknown template: '%s'", Tokens[2].c_str());
+      return;
+    }
+    Programs.back().Channels.push_back(it->second);
+    return;
+  }
+
+  StartChannel(Tokens, 1);
+}
+
+void ProgramCompiler::ParseTemplate(const std::vector<std::string> &Tokens) {
+  if (Tokens.size() < 2) {
+    FinishChannel();
+    Error("expected a template name");
+    return;
+  }
+  if (Templates.count(Tokens[1]))
+    Error("duplicate template: '%s'", Tokens[1].c_str());
+
+  StartChannel(Tokens, 2);
+  TemplateName = Tokens[1];
+}
+
+void ProgramCompiler::ParseInstruction(const std::vector<std::string> &Tokens,
+                                       unsigned First) {
+  if (!Current) {
+    Error("instruction outside of a channel");
+    return;
+  }
+
+  const std::string &Op = Tokens[First];
+  unsigned NumArgs = Tokens.size() - First - 1;
+  const std::string *Args = &Tokens[First + 1];
+
+  // Labels are resolved once the channel is finished, so a rejected
+  // instruction must take its fixup with it.
+  unsigned NumFixups = Current->Fixups.size();
+
+  LightInstruction I = { 0, 0, 0, 0, 0, 0 };
+  bool Valid = true;
+  if (Op == "set" && NumArgs == 1) {
+    I.Op = LightInstruction::kOp_Set;
+    if (Args[0] == "on" || Args[0] == "off")
+      I.Value = Args[0] == "on";
+    else
+      Valid = false;
+  } else if (Op == "fade" && (NumArgs == 3 || NumArgs == 4) &&
+             Args[1] == "over") {
+    double Level;
+    I.Op = LightInstruction::kOp_Fade;
+    Valid = ParseNumber(Args[0], Level) && ParseCount(Args[2], I.Count);
+    if (Valid && (Level < 0 || Level > 1)) {
+      Error("fade level must be between 0 and 1");
+      return;
+    }
+    I.Value = Level;
+    I.Curve = FadeEngine::kCurve_Linear;
+    if (NumArgs == 4) {
+      if (Args[3] == "smooth")
+        I.Curve = FadeEngine::kCurve_Smooth;
+      else if (Args[3] != "linear")
+        Valid = false;
+    }
+  } else if (Op == "repeat" && NumArgs == 2) {
+    I.Op = LightInstruction::kOp_RepeatCount;
+    Valid = ParseCount(Args[0], I.Count) && ParseTarget(Args[1], I);
+  } else if (Op == "repeat-for" && NumArgs == 2) {
+    double Time;
+    I.Op = LightInstruction::kOp_RepeatTime;
+    Valid = ParseNumber(Args[0], Time, "s") && ParseTarget(Args[1], I);
+    I.Value = Time;
+  } else if (Op == "if-strobe-ok" && (NumArgs == 2 || NumArgs == 4)) {
+    double Fraction, MinBPM = 300;
+    I.Op = LightInstruction::kOp_IfOkToStrobe;
+    Valid = ParseNumber(Args[0], Fraction);
+    if (Valid && NumArgs == 4)
+      Valid = Args[2] == "min-bpm" && ParseNumber(Args[3], MinBPM);
+    Valid = Valid && ParseTarget(Args[1], I);
+    I.Value = Fraction;
+    I.MinBPM = MinBPM;
+  } else if (Op == "goto" && NumArgs == 1) {
+    I.Op = LightInstruction::kOp_Goto;
+    Valid = ParseTarget(Args[0], I);
+  } else {
+    Error("unknown instruction: '%s' with %u arguments", Op.c_str(), NumArgs);
+    return;
+  }
+
+  if (!Valid) {
+    Error("invalid '%s' instruction", Op.c_str());
+    Current->Fixups.resize(NumFixups);
+    return;
+  }
+
+  Current->Channel.Code.push_back(I);
+  Current->Lines.push_back(Line);
+}
+
+/// Split \arg Text into whitespace separated tokens, keeping quoted strings
+/// (with their quotes) together and dropping comments.
+bool Tokenize(const std::string &Text, std::vector<std::string> &Tokens) {
+  Tokens.clear();
+  for (std::string::size_type i = 0, e = Text.size(); i != e;) {
+    char c = Text[i];
+    if (isspace(c)) {
+      ++i;
+    } else if (c == '#') {
+      break;
+    } else if (c == '"') {
+      std::string::size_type End = Text.find('"', i + 1);
+      if (End == std::string::npos)
+        return false;
+      Tokens.push_back(Text.substr(i, End + 1 - i));
+      i = End + 1;
+    } else {
+      std::string::size_type Start = i;
+      while (i != e && !isspace(Text[i]) && Text[i] != '#')
+        ++i;
+      Tokens.push_back(Text.substr(Start, i - Start));
+    }
+  }
+  return true;
+}
+
+bool ProgramCompiler::Compile(const std::string &Source) {
+  std::vector<std::string> Tokens;
+  std::string::size_type Start = 0;
+  while (Start < Source.size()) {
+    std::string::size_type End = Source.find('\n', Start);
+    if (End == std::string::npos)
+      End = Source.size();
+    ++Line;
+    bool Ok = Tokenize(Source.substr(Start, End - Start), Tokens);
+    Start = End + 1;
+
+    if (!Ok) {
+      Error("unterminated string");
+      continue;
+    }
+    if (Tokens.empty())
+      continue;
+
+    const std::string &Keyword = Tokens[0];
+    if (Keyword == "program") {
+      ParseProgram(Tokens);
+    } else if (Keyword == "channel") {
+      ParseChannel(Tokens);
+    } else if (Keyword == "template") {
+      ParseTemplate(Tokens);
+    } else if (Keyword[Keyword.size() - 1] == ':') {
+      // A label, optionally followed by an instruction.
+      std::string Label = Keyword.substr(0, Keyword.size() - 1);
+      if (!Current)
+        Error("label outside of a channel");
+      else if (!Current->Labels.insert(std::make_pair(
+                 Label, unsigned(Current->Channel.Code.size()))).second)
+        Error("duplicate label: '%s'", Label.c_str());
+      if (Tokens.size() > 1)
+        ParseInstruction(Tokens, 1);
+    } else {
+      ParseInstruction(Tokens, 0);
+    }
+  }
+  FinishChannel();
+
+  for (unsigned i = 0, e = Programs.size(); i != e; ++i)
+    if (Programs[i].Channels.empty())
+      ErrorAt(ProgramLines[i], "program has no channels");
+
+  return NumErrors == 0;
+}
+
+/*
+ * Binary Cache
+ *
+ * A cache file holds the compiled programs of one source file, as a header
+ * followed by flat arrays which are used straight from the mapped file.
+ */
+
+const char kCacheMagic[8] = { 'L', 'D', 'P', 'C', 'A', 'C', 'H', 'E' };
+/// Bump this when the cache format or the instruction encoding changes.
+const uint32_t kCacheVersion = 2;
+
+struct CacheHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t InstructionSize;
+  uint64_t SourceHash;
+  uint32_t NumPrograms, NumChannels, NumInstructions, StringsSize;
+};
+
+struct CacheProgram {
+  uint32_t NameOffset, NameLength;
+  uint32_t FirstChannel, NumChannels;
+  double MaxProgramTime, ShortestBeatInterval, MaxBPM, Rating;
+};
+
+struct CacheChannel {
+  uint32_t FirstInstruction, NumInstructions;
+  uint32_t BeatKinds, NeedsStrobe;
+  int32_t Color;
+};
+
+uint64_t HashSource(const std::string &Source) {
+  // 64-bit FNV-1a.
+  uint64_t Hash = 14695981039346656037ULL;
+  for (unsigned i = 0, e = Source.size(); i != e; ++i) {
+    Hash ^= (unsigned char) Source[i];
+    Hash *= 1099511628211ULL;
+  }
+  return Hash;
+}
+
+std::string GetCachePath(const std::string &Directory, uint64_t Hash) {
+  char Name[32];
+  snprintf(Name, sizeof(Name), "%016llx.ldpc", (unsigned long long) Hash);
+  return Directory + "/.cache/" + Name;
+}
+
+/// Check a cached channel as the compiler checks the channels it compiles, so
+/// a damaged cache can't reach the interpreter.
+bool IsValidChannel(const LightChannelCode &Channel) {
+  if (Channel.BeatKinds == 0 ||
+      Channel.BeatKinds >= 1u << MusicMonitorHandler::kNumBeatKinds ||
+      Channel.Color < -1 || Channel.Color > LightInfo::kLightColor_White)
+    return false;
+
+  bool HasStep = false;
+  for (unsigned i = 0, e = Channel.Code.size(); i != e; ++i) {
+    if (CheckInstruction(Channel.Code, i))
+      return false;
+    if (IsStepInstruction(Channel.Code[i]))
+      HasStep = true;
+  }
+  return HasStep;
+}
+
+bool ReadCache(const std::string &Path, uint64_t Hash,
+               std::vector<LightProgramCode> &Programs) {
+  int fd = open(Path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat Stat;
+  if (fstat(fd, &Stat) == -1 || size_t(Stat.st_size) < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  size_t Size = Stat.st_size;
+  void *Data = mmap(0, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (Data == MAP_FAILED)
+    return false;
+
+  // Check the cache is complete and current before trusting anything in it.
+  const char *Base = (const char*) Data;
+  const CacheHeader *H = (const CacheHeader*) Base;
+  const CacheProgram *P = (const CacheProgram*) (H + 1);
+  const CacheChannel *C = (const CacheChannel*) (P + H->NumPrograms);
+  const LightInstruction *I = (const LightInstruction*) (C + H->NumChannels);
+  const char *Strings = (const char*) (I + H->NumInstructions);
+  bool Valid = memcmp(H->Magic, kCacheMagic, sizeof(kCacheMagic)) == 0 &&
+    H->Version == kCacheVersion &&
+    H->InstructionSize == sizeof(LightInstruction) && H->SourceHash == Hash &&
+    sizeof(CacheHeader) + uint64_t(H->NumPrograms) * sizeof(CacheProgram) +
+    uint64_t(H->NumChannels) * sizeof(CacheChannel) +
+    uint64_t(H->NumInstructions) * sizeof(LightInstruction) +
+    H->StringsSize == Size;
+  for (unsigned i = 0; Valid && i != H->NumPrograms; ++i)
+    Valid = uint64_t(P[i].NameOffset) + P[i].NameLength <= H->StringsSize &&
+      P[i].NumChannels != 0 &&
+      uint64_t(P[i].FirstChannel) + P[i].NumChannels <= H->NumChannels;
+  for (unsigned i = 0; Valid && i != H->NumChannels; ++i)
+    Valid = uint64_t(C[i].FirstInstruction) + C[i].NumInstructions <=
+      H->NumInstructions;
+
+  for (unsigned i = 0; Valid && i != H->NumPrograms; ++i) {
+    LightProgramCode Program;
+    Program.Name.assign(Strings + P[i].NameOffset, P[i].NameLength);
+    Program.MaxProgramTime = P[i].MaxProgramTime;
+    Program.ShortestBeatInterval = P[i].ShortestBeatInterval;
+    Program.MaxBPM = P[i].MaxBPM;
+    Program.Rating = P[i].Rating;
+    for (unsigned j = 0; Valid && j != P[i].NumChannels; ++j) {
+      const CacheChannel &CC = C[P[i].FirstChannel + j];
+      LightChannelCode Channel;
+      Channel.NeedsStrobe = CC.NeedsStrobe;
+      Channel.Color = CC.Color;
+      Channel.BeatKinds = CC.BeatKinds;
+      Channel.Code.assign(I + CC.FirstInstruction,
+                          I + CC.FirstInstruction + CC.NumInstructions);
+      Valid = IsValidChannel(Channel);
+      Program.Channels.push_back(Channel);
+    }
+    Programs.push_back(Program);
+  }
+
+  munmap(Data, Size);
+  return Valid;
+}
+
+void WriteCache(const std::string &Path, uint64_t Hash,
+                const std::vector<LightProgramCode> &Programs) {
+  CacheHeader H;
+  memcpy(H.Magic, kCacheMagic, sizeof(kCacheMagic));
+  H.Version = kCacheVersion;
+  H.InstructionSize = sizeof(LightInstruction);
+  H.SourceHash = Hash;
+
+  std::vector<CacheProgram> P;
+  std::vector<CacheChannel> C;
+  std::vector<LightInstruction> I;
+  std::string Strings;
+  for (unsigned i = 0, e = Programs.size(); i != e; ++i) {
+    const LightProgramCode &Program = Programs[i];
+    CacheProgram CP;
+    memset(&CP, 0, sizeof(CP));
+    CP.NameOffset = Strings.size();
+    CP.NameLength = Program.Name.size();
+    CP.FirstChannel = C.size();
+    CP.NumChannels = Program.Channels.size();
+    CP.MaxProgramTime = Program.MaxProgramTime;
+    CP.ShortestBeatInterval = Program.ShortestBeatInterval;
+    CP.MaxBPM = Program.MaxBPM;
+    CP.Rating = Program.Rating;
+    P.push_back(CP);
+    Strings += Program.Name;
+
+    for (unsigned j = 0, je = Program.Channels.size(); j != je; ++j) {
+      const LightChannelCode &Channel = Program.Channels[j];
+      CacheChannel CC;
+      CC.FirstInstruction = I.size();
+      CC.NumInstructions = Channel.Code.size();
+      CC.BeatKinds = Channel.BeatKinds;
+      CC.NeedsStrobe = Channel.NeedsStrobe;
+      CC.Color = Channel.Color;
+      C.push_back(CC);
+      I.insert(I.end(), Channel.Code.begin(), Channel.Code.end());
+    }
+  }
+  H.NumPrograms = P.size();
+  H.NumChannels = C.size();
+  H.NumInstructions = I.size();
+  H.StringsSize = Strings.size();
+
+  // Write to a temporary file and rename it into place, so readers never see
+  // a partial cache.
+  std::string TempPath = Path + ".tmp";
+  FILE *fp = fopen(TempPath.c_str(), "wb");
+  if (!fp)
+    return;
+  bool Ok = fwrite(&H, sizeof(H), 1, fp) == 1 &&
+    fwrite(P.data(), sizeof(CacheProgram), P.size(), fp) == P.size() &&
+    fwrite(C.data(), sizeof(CacheChannel), C.size(), fp) == C.size() &&
+    fwrite(I.data(), sizeof(LightInstruction), I.size(), fp) == I.size() &&
+    fwrite(Strings.data(), 1, Strings.size(), fp) == Strings.size();
+  if (fclose(fp) != 0 || !Ok || rename(TempPath.c_str(), Path.c_str()) != 0)
+    unlink(TempPath.c_str());
+}
+
+bool ReadFile(const std::string &Path, std::string &Result) {
+  FILE *fp = fopen(Path.c_str(), "rb");
+  if (!fp)
+    return false;
+
+  char Buffer[65536];
+  size_t Count;
+  while ((Count = fread(Buffer, 1, sizeof(Buffer), fp)) != 0)
+    Result.append(Buffer, Count);
+  bool Ok = !ferror(fp);
+  fclose(fp);
+  return Ok;
+}
+
+/// Remove the cache files in \arg Directory other than those in \arg Keep,
+/// which were left behind by edited or deleted program files.
+void RemoveStaleCacheFiles(const std::string &Directory,
+                           const std::vector<std::string> &Keep) {
+  std::string CacheDirectory = Directory + "/.cache";
+  DIR *Dir = opendir(CacheDirectory.c_str());
+  if (!Dir)
+    return;
+
+  std::vector<std::string> Stale;
+  while (struct dirent *Entry = readdir(Dir)) {
+    std::string Name = Entry->d_name;
+    std::string Path = CacheDirectory + "/" + Name;
+    if (Name.size() > 5 && Name.compare(Name.size() - 5, 5, ".ldpc") == 0 &&
+        std::find(Keep.begin(), Keep.end(), Path) == Keep.end())
+      Stale.push_back(Path);
+  }
+  closedir(Dir);
+
+  for (unsigned i = 0, e = Stale.size(); i != e; ++i)
+    unlink(Stale[i].c_str());
+}
+
+}
+
+bool LightProgram::LoadAllPrograms(const std::string &Directory,
+                                   std::vector<LightProgram *> &Result,
+                                   unsigned *NumFailedFiles) {
+  if (NumFailedFiles)
+    *NumFailedFiles = 0;
+
+  DIR *Dir = opendir(Directory.c_str());
+  if (!Dir) {
+    fprintf(stderr, "unable to open program directory: %s: %s\n",
+            Directory.c_str(), strerror(errno));
+    return false;
+  }
+
+  std::vector<std::string> Names;
+  while (struct dirent *Entry = readdir(Dir)) {
+    std::string Name = Entry->d_name;
+    if (Name.size() > 4 && Name.compare(Name.size() - 4, 4, ".ldp") == 0)
+      Names.push_back(Name);
+  }
+  closedir(Dir);
+  std::sort(Names.begin(), Names.end());
+
+  // The cache is best effort, we just compile every time if it can't be
+  // written.
+  mkdir((Directory + "/.cache").c_str(), 0777);
+
+  std::vector<std::string> CachePaths;
+  bool AllRead = true;
+  for (unsigned i = 0, e = Names.size(); i != e; ++i) {
+    std::string Path = Directory + "/" + Names[i];
+    std::string Source;
+    if (!ReadFile(Path, Source)) {
+      fprintf(stderr, "unable to read program file: %s\n", Path.c_str());
+      if (NumFailedFiles)
+        ++*NumFailedFiles;
+      AllRead = false;
+      continue;
+    }
+
+    uint64_t Hash = HashSource(Source);
+    std::string CachePath = GetCachePath(Directory, Hash);
+    CachePaths.push_back(CachePath);
+    std::vector<LightProgramCode> Programs;
+    if (!ReadCache(CachePath, Hash, Programs)) {
+      Programs.clear();
+      ProgramCompiler Compiler(Path.c_str(), Programs);
+      if (!Compiler.Compile(Source)) {
+        fprintf(stderr, "ignoring program file: %s\n", Path.c_str());
+        if (NumFailedFiles)
+          ++*NumFailedFiles;
+        continue;
+      }
+      WriteCache(CachePath, Hash, Programs);
+    }
+
+    for (unsigned j = 0, je = Programs.size(); j != je; ++j)
+      Result.push_back(CreateLightProgram(Programs[j]));
+  }
+
+  // Each edit leaves a cache file for the old source. Only prune once every
+  // source has been read, so a file which couldn't be keeps its cache.
+  if (AllRead)
+    RemoveStaleCacheFiles(Directory, CachePaths);
+
+  return true;
+}
@@ -10,7 +10,10 @@ class MusicMonitorHandler {
 public:
   enum BeatKind {
     kBeatLow = 0,
-    kBeatHi
+    kBeatHi,
+    kBeatMid,
+
+    kNumBeatKinds
   };
 
 protected:
@@ -25,12 +28,24 @@ public:
 class MusicMonitor : public AudioMonitorHandler {
 protected:
   MusicMonitor();
-  virtual void HandleSample(double time, double left, double right) = 0;
-  
+  virtual void HandleBlock(const float *left, const float *right,
+                           unsigned frames, double start_time) = 0;
+
 public:
   virtual ~MusicMonitor();
 };
 
 MusicMonitor *CreateAubioMusicMonitor(MusicMonitorHandler *handler);
 
+/// \brief Create the built-in spectral flux onset detector, using the spectral
+/// kernels named \arg kernels_name (see GetSpectralKernels()). Returns null if
+/// those kernels aren't available.
+///
+/// With one band, all onsets are reported as kBeatLow. With three, the low,
+/// mid and high bands (split around 200 Hz and 4 kHz) are detected separately
+/// and reported as kBeatLow, kBeatMid and kBeatHi.
+MusicMonitor *CreateSpectralFluxMusicMonitor(MusicMonitorHandler *handler,
+                                             const char *kernels_name = "auto",
+                                             unsigned num_bands = 1);
+
 #endif // MUSICMONITOR_H
@@ -0,0 +1,193 @@
+#include "ProgramWatcher.h"
+
+#include "LightManager.h"
+#include "LightProgram.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+ProgramWatcher::ProgramWatcher() {}
+ProgramWatcher::~ProgramWatcher() {}
+
+namespace {
+
+/// How long the files must be left alone before reloading, in milliseconds,
+/// so an editor's save is picked up as one change.
+const int kSettleTime = 250;
+
+bool IsProgramFile(const char *Name) {
+  size_t Length = strlen(Name);
+  return Length > 4 && strcmp(Name + Length - 4, ".ldp") == 0;
+}
+
+class ProgramWatcherImpl : public ProgramWatcher {
+  LightManager &Manager;
+  std::string Directory;
+
+  pthread_t WatcherThread;
+  std::atomic<bool> Running;
+  std::atomic<unsigned> NumReloads;
+
+  static void *watcher_thread_main(void *arg) {
+    ((ProgramWatcherImpl*) arg)->Loop();
+    return 0;
+  }
+
+  void Loop();
+
+  /// Compile the programs and hand them to the manager, unless any file
+  /// fails.
+  void Reload() {
+    std::vector<LightProgram *> Programs;
+    unsigned NumFailedFiles;
+    if (!LightProgram::LoadAllPrograms(Directory, Programs, &NumFailedFiles))
+      return;
+
+    if (NumFailedFiles || Programs.empty()) {
+      if (NumFailedFiles)
+        fprintf(stderr, "not reloading light programs: %u files failed\n",
+                NumFailedFiles);
+      else
+        fprintf(stderr, "not reloading light programs: none in: %s\n",
+                Directory.c_str());
+      for (unsigned i = 0, e = Programs.size(); i != e; ++i)
+        delete Programs[i];
+      return;
+    }
+
+    fprintf(stderr, "reloading %u light programs from: %s\n",
+            unsigned(Programs.size()), Directory.c_str());
+    Manager.ReloadPrograms(Programs);
+    ++NumReloads;
+  }
+
+public:
+  ProgramWatcherImpl(LightManager &Manager_, const std::string &Directory_)
+    : Manager(Manager_), Directory(Directory_), Running(true), NumReloads(0)
+  {
+    pthread_create(&WatcherThread, 0, watcher_thread_main, this);
+  }
+
+  virtual ~ProgramWatcherImpl() {
+    // The thread notices within the settle time.
+    Running.store(false);
+    pthread_join(WatcherThread, 0);
+  }
+
+  virtual unsigned GetNumReloads() const {
+    return NumReloads.load();
+  }
+};
+
+#ifdef __linux__
+
+void ProgramWatcherImpl::Loop() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    perror("program watcher: inotify_init1");
+    return;
+  }
+  if (inotify_add_watch(fd, Directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO |
+                        IN_MOVED_FROM | IN_DELETE) == -1) {
+    perror("program watcher: inotify_add_watch");
+    close(fd);
+    return;
+  }
+
+  bool Changed = false;
+  while (Running.load(std::memory_order_relaxed)) {
+    struct pollfd PFD = { fd, POLLIN, 0 };
+    if (poll(&PFD, 1, kSettleTime) > 0) {
+      char Buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t Size;
+      while ((Size = read(fd, Buffer, sizeof(Buffer))) > 0) {
+        for (char *it = Buffer; it < Buffer + Size;) {
+          struct inotify_event *Event = (struct inotify_event*) it;
+          if (Event->len && IsProgramFile(Event->name))
+            Changed = true;
+          it += sizeof(struct inotify_event) + Event->len;
+        }
+      }
+      continue;
+    }
+
+    // Nothing happened for the settle time.
+    if (Changed) {
+      Changed = false;
+      Reload();
+    }
+  }
+
+  close(fd);
+}
+
+#else
+
+/// Describe the program files in \arg Directory by their names, sizes and
+/// modification times.
+std::string GetDirectoryState(const std::string &Directory) {
+  std::string Result;
+  DIR *Dir = opendir(Directory.c_str());
+  if (!Dir)
+    return Result;
+
+  while (struct dirent *Entry = readdir(Dir)) {
+    struct stat Stat;
+    if (!IsProgramFile(Entry->d_name) ||
+        stat((Directory + "/" + Entry->d_name).c_str(), &Stat) == -1)
+      continue;
+
+    char Buffer[64];
+    snprintf(Buffer, sizeof(Buffer), ":%lld:%lld;", (long long) Stat.st_size,
+             (long long) Stat.st_mtime);
+    Result += Entry->d_name;
+    Result += Buffer;
+  }
+  closedir(Dir);
+  return Result;
+}
+
+void ProgramWatcherImpl::Loop() {
+  // Without inotify, poll the file times. Reload once they have stopped
+  // changing.
+  std::string State = GetDirectoryState(Directory);
+  bool Changed = false;
+  while (Running.load(std::memory_order_relaxed)) {
+    usleep(kSettleTime * 1000);
+
+    std::string NewState = GetDirectoryState(Directory);
+    if (NewState != State) {
+      State = NewState;
+      Changed = true;
+      continue;
+    }
+
+    if (Changed) {
+      Changed = false;
+      Reload();
+    }
+  }
+}
+
+#endif
+
+}
+
+ProgramWatcher *CreateProgramWatcher(LightManager &Manager,
+                                     const std::string &Directory) {
+  return new ProgramWatcherImpl(Manager, Directory);
+}
@@ -0,0 +1,34 @@
+// -*- C++ -*-
+
+#ifndef PROGRAMWATCHER_H
+#define PROGRAMWATCHER_H
+
+#include <string>
+
+class LightManager;
+
+/// \brief A thread reloading the light programs when the program files
+/// change, so programs can be edited during a show.
+///
+/// Changes are noticed with inotify on Linux, and by polling the file times
+/// elsewhere. The programs are compiled on the watcher thread and handed to
+/// LightManager::ReloadPrograms(), which switches to them at the next program
+/// switch. If any file fails to compile the running programs are kept.
+class ProgramWatcher {
+protected:
+  ProgramWatcher();
+
+public:
+  /// \brief Stop watching; the destructor waits for the thread to exit.
+  virtual ~ProgramWatcher();
+
+  /// \brief The number of times the programs have been reloaded.
+  virtual unsigned GetNumReloads() const = 0;
+};
+
+/// \brief Start watching the program files in \arg Directory, reloading the
+/// programs of \arg Manager when they change.
+ProgramWatcher *CreateProgramWatcher(LightManager &Manager,
+                                     const std::string &Directory);
+
+#endif // PROGRAMWATCHER_H
@@ -0,0 +1,62 @@
+// -*- C++ -*-
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+/// \brief A small, fast, seedable pseudo-random number generator
+/// (xoshiro256**).
+///
+/// Unlike drand48() the state is explicit, so each user can be seeded (and
+/// replayed) independently. It is not thread safe; each thread should use its
+/// own generator.
+class Random {
+  uint64_t State[4];
+
+  static uint64_t RotateLeft(uint64_t Value, int Bits) {
+    return (Value << Bits) | (Value >> (64 - Bits));
+  }
+
+public:
+  explicit Random(uint64_t Seed = 0) {
+    SetSeed(Seed);
+  }
+
+  /// \brief Restart the sequence from \arg Seed.
+  void SetSeed(uint64_t Seed) {
+    // Expand the seed with splitmix64, which never yields an all zero state.
+    for (unsigned i = 0; i != 4; ++i) {
+      uint64_t Value = (Seed += 0x9E3779B97F4A7C15ULL);
+      Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBULL;
+      State[i] = Value ^ (Value >> 31);
+    }
+  }
+
+  /// \brief Return 64 random bits.
+  uint64_t GetBits() {
+    uint64_t Result = RotateLeft(State[1] * 5, 7) * 9;
+    uint64_t Shifted = State[1] << 17;
+    State[2] ^= State[0];
+    State[3] ^= State[1];
+    State[1] ^= State[2];
+    State[0] ^= State[3];
+    State[2] ^= Shifted;
+    State[3] = RotateLeft(State[3], 45);
+    return Result;
+  }
+
+  /// \brief Return a uniform value in [0, 1).
+  double GetDouble() {
+    return (GetBits() >> 11) * (1.0 / (1ULL << 53));
+  }
+
+  /// \brief Return a uniform index in [0, \arg Count), with \arg Count > 0.
+  unsigned GetIndex(unsigned Count) {
+    // Scale the top 32 bits rather than taking a remainder.
+    return unsigned(((GetBits() >> 32) * Count) >> 32);
+  }
+};
+
+#endif // RANDOM_H
@@ -0,0 +1,177 @@
+#include "RenderLoop.h"
+
+#include "Clock.h"
+#include "LightManager.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+RenderLoop::RenderLoop() {}
+RenderLoop::~RenderLoop() {}
+
+namespace {
+
+class RenderLoopImpl : public RenderLoop {
+  LightManager &Manager;
+  double FrameRate;
+  int64_t Period;
+
+  pthread_t RenderThread;
+  std::atomic<bool> Running;
+
+  // The frame statistics, protected by Lock.
+  mutable pthread_mutex_t Lock;
+  FrameStats Stats;
+  double TotalJitter, TotalRenderTime;
+
+  static void *render_thread_main(void *arg) {
+    ((RenderLoopImpl*) arg)->Loop();
+    return 0;
+  }
+
+  void Loop();
+
+  /// Render a frame, woken \arg Lateness ns after its deadline, with
+  /// \arg Missed deadlines skipped before it.
+  void Render(int64_t Lateness, uint64_t Missed) {
+    int64_t Start = get_time_in_ns();
+    Manager.RenderFrame();
+    double RenderTime = (get_time_in_ns() - Start) * 1e-9;
+    double Jitter = Lateness * 1e-9;
+
+    pthread_mutex_lock(&Lock);
+    ++Stats.NumFrames;
+    Stats.NumMissedFrames += Missed;
+    TotalJitter += Jitter;
+    if (Jitter > Stats.MaxJitter)
+      Stats.MaxJitter = Jitter;
+    if (Lateness * 10 > Period)
+      ++Stats.NumLateFrames;
+    TotalRenderTime += RenderTime;
+    if (RenderTime > Stats.MaxRenderTime)
+      Stats.MaxRenderTime = RenderTime;
+    pthread_mutex_unlock(&Lock);
+  }
+
+public:
+  RenderLoopImpl(LightManager &Manager_, double FrameRate_)
+    : Manager(Manager_), FrameRate(FrameRate_),
+      Period(int64_t(1e9 / FrameRate)), Running(true), TotalJitter(0),
+      TotalRenderTime(0)
+  {
+    Stats.NumFrames = Stats.NumMissedFrames = Stats.NumLateFrames = 0;
+    Stats.MeanJitter = Stats.MaxJitter = 0;
+    Stats.MeanRenderTime = Stats.MaxRenderTime = 0;
+
+    pthread_mutex_init(&Lock, 0);
+    pthread_create(&RenderThread, 0, render_thread_main, this);
+  }
+
+  virtual ~RenderLoopImpl() {
+    // The thread notices within a frame.
+    Running.store(false);
+    pthread_join(RenderThread, 0);
+    pthread_mutex_destroy(&Lock);
+  }
+
+  virtual double GetFrameRate() const {
+    return FrameRate;
+  }
+
+  virtual FrameStats GetFrameStats() const {
+    pthread_mutex_lock(&Lock);
+    FrameStats Result = Stats;
+    if (Stats.NumFrames) {
+      Result.MeanJitter = TotalJitter / Stats.NumFrames;
+      Result.MeanRenderTime = TotalRenderTime / Stats.NumFrames;
+    }
+    pthread_mutex_unlock(&Lock);
+    return Result;
+  }
+};
+
+#ifdef __linux__
+
+int64_t get_monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct timespec make_timespec(int64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return ts;
+}
+
+void RenderLoopImpl::Loop() {
+  // Let the kernel keep the schedule: a periodic timer on absolute deadlines,
+  // which also counts the deadlines we slept through.
+  int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (fd == -1) {
+    perror("render loop: timerfd_create");
+    return;
+  }
+
+  int64_t Deadline = get_monotonic_ns() + Period;
+  struct itimerspec Spec;
+  Spec.it_interval = make_timespec(Period);
+  Spec.it_value = make_timespec(Deadline);
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &Spec, 0) == -1) {
+    perror("render loop: timerfd_settime");
+    close(fd);
+    return;
+  }
+
+  while (Running.load(std::memory_order_relaxed)) {
+    uint64_t Expirations;
+    if (read(fd, &Expirations, sizeof(Expirations)) != sizeof(Expirations))
+      continue;
+
+    // Render for the latest deadline, skipping any before it.
+    Deadline += (Expirations - 1) * Period;
+    Render(get_monotonic_ns() - Deadline, Expirations - 1);
+    Deadline += Period;
+  }
+
+  close(fd);
+}
+
+#else
+
+void RenderLoopImpl::Loop() {
+  int64_t Deadline = get_time_in_ns() + Period;
+
+  while (Running.load(std::memory_order_relaxed)) {
+    int64_t Now = get_time_in_ns();
+    if (Now < Deadline) {
+      usleep((Deadline - Now) / 1000);
+      continue;
+    }
+
+    // Render for the latest deadline, skipping any before it.
+    uint64_t Missed = (Now - Deadline) / Period;
+    Deadline += Missed * Period;
+    Render(Now - Deadline, Missed);
+    Deadline += Period;
+  }
+}
+
+#endif
+
+}
+
+RenderLoop *CreateRenderLoop(LightManager &Manager, double FrameRate) {
+  assert(FrameRate >= RenderLoop::kMinFrameRate &&
+         FrameRate <= RenderLoop::kMaxFrameRate && "Invalid frame rate!");
+  return new RenderLoopImpl(Manager, FrameRate);
+}
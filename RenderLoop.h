@@ -0,0 +1,53 @@
+// -*- C++ -*-
+
+#ifndef RENDERLOOP_H
+#define RENDERLOOP_H
+
+#include <stdint.h>
+
+class LightManager;
+
+/// \brief A thread rendering the light manager's frames at a fixed rate,
+/// independently of beats, so time based actions and fades keep running
+/// through silence.
+///
+/// Frames are due on a fixed schedule of absolute deadlines (a periodic timerfd
+/// on Linux), so the render time never accumulates as drift. If a frame
+/// overruns, the deadlines it missed are skipped rather than rendered back to
+/// back.
+class RenderLoop {
+protected:
+  RenderLoop();
+
+public:
+  /// \brief Stop rendering; the destructor waits for the thread to exit.
+  virtual ~RenderLoop();
+
+  enum {
+    kMinFrameRate = 40,
+    kMaxFrameRate = 200
+  };
+
+  struct FrameStats {
+    /// The number of frames rendered, and of deadlines skipped because the
+    /// loop fell behind.
+    uint64_t NumFrames, NumMissedFrames;
+    /// How late the loop woke for each frame deadline, in seconds.
+    double MeanJitter, MaxJitter;
+    /// The number of frames woken more than a tenth of a period late.
+    uint64_t NumLateFrames;
+    /// The time taken to render each frame, in seconds.
+    double MeanRenderTime, MaxRenderTime;
+  };
+
+  /// \brief The rate frames are rendered at, in frames per second.
+  virtual double GetFrameRate() const = 0;
+
+  virtual FrameStats GetFrameStats() const = 0;
+};
+
+/// \brief Start rendering the frames of \arg Manager at \arg FrameRate frames
+/// per second (between kMinFrameRate and kMaxFrameRate).
+RenderLoop *CreateRenderLoop(LightManager &Manager, double FrameRate);
+
+#endif // RENDERLOOP_H
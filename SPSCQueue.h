@@ -0,0 +1,99 @@
+// -*- C++ -*-
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+
+/// \brief A fixed capacity, wait-free, single-producer/single-consumer queue.
+///
+/// Slots are written and read in place: the producer fills the slot returned
+/// by BeginWrite() and publishes it with CommitWrite(), the consumer uses
+/// BeginRead() and CommitRead() likewise. Neither side ever blocks, allocates
+/// or takes a lock, so the producer may be a real-time thread.
+template<typename T>
+class SPSCQueue {
+  // Keep the producer and consumer indices on separate cache lines. This is
+  // done with padding rather than alignas, since queues live on the heap.
+  struct Index {
+    std::atomic<unsigned> Value;
+    char Padding[64 - sizeof(std::atomic<unsigned>)];
+  };
+
+  T *Slots;
+  unsigned Mask;
+
+  Index Head; ///< The next slot to read, owned by the consumer.
+  Index Tail; ///< The next slot to write, owned by the producer.
+
+  SPSCQueue(const SPSCQueue &); // DO NOT IMPLEMENT
+  void operator=(const SPSCQueue &); // DO NOT IMPLEMENT
+
+public:
+  /// \brief Create a queue holding at least \arg Capacity items.
+  explicit SPSCQueue(unsigned Capacity) {
+    unsigned Size = 1;
+    while (Size < Capacity)
+      Size <<= 1;
+    Slots = new T[Size];
+    Mask = Size - 1;
+    Head.Value.store(0, std::memory_order_relaxed);
+    Tail.Value.store(0, std::memory_order_relaxed);
+  }
+  ~SPSCQueue() {
+    delete[] Slots;
+  }
+
+  unsigned GetCapacity() const { return Mask + 1; }
+
+  /// \brief Return the number of items currently queued. This is exact when
+  /// called from either endpoint, and approximate from anywhere else.
+  unsigned GetSize() const {
+    return Tail.Value.load(std::memory_order_acquire) -
+      Head.Value.load(std::memory_order_acquire);
+  }
+
+  /// \brief Return the next free slot, or null if the queue is full.
+  T *BeginWrite() {
+    unsigned Pos = Tail.Value.load(std::memory_order_relaxed);
+    if (Pos - Head.Value.load(std::memory_order_acquire) > Mask)
+      return 0;
+    return &Slots[Pos & Mask];
+  }
+  void CommitWrite() {
+    Tail.Value.store(Tail.Value.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+  }
+
+  /// \brief Return the oldest queued slot, or null if the queue is empty.
+  T *BeginRead() {
+    unsigned H = Head.Value.load(std::memory_order_relaxed);
+    if (H == Tail.Value.load(std::memory_order_acquire))
+      return 0;
+    return &Slots[H & Mask];
+  }
+  void CommitRead() {
+    Head.Value.store(Head.Value.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_release);
+  }
+
+  bool Push(const T &Item) {
+    T *Slot = BeginWrite();
+    if (!Slot)
+      return false;
+    *Slot = Item;
+    CommitWrite();
+    return true;
+  }
+
+  bool Pop(T &Item) {
+    T *Slot = BeginRead();
+    if (!Slot)
+      return false;
+    Item = *Slot;
+    CommitRead();
+    return true;
+  }
+};
+
+#endif // SPSCQUEUE_H
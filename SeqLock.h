@@ -0,0 +1,68 @@
+// -*- C++ -*-
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <type_traits>
+
+/// \brief A value published by one writer and read by any number of readers,
+/// none of which ever block or take a lock.
+///
+/// The writer bumps a sequence number around each update, and readers retry
+/// if it changed (or was odd) while they copied. The value is kept in atomic
+/// words rather than as a plain T, so a torn read is merely discarded rather
+/// than being a data race.
+template<typename T>
+class SeqLock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SeqLock values are copied as raw words");
+
+  enum { kNumWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+  std::atomic<unsigned> Sequence;
+  std::atomic<uint64_t> Words[kNumWords];
+
+  SeqLock(const SeqLock &); // DO NOT IMPLEMENT
+  void operator=(const SeqLock &); // DO NOT IMPLEMENT
+
+public:
+  explicit SeqLock(const T &Value = T()) : Sequence(0) {
+    Store(Value);
+  }
+
+  /// \brief Publish \arg Value. This must only be called from one thread at a
+  /// time.
+  void Store(const T &Value) {
+    uint64_t Buffer[kNumWords] = {};
+    memcpy(Buffer, &Value, sizeof(T));
+
+    unsigned Start = Sequence.load(std::memory_order_relaxed);
+    Sequence.store(Start + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned i = 0; i != kNumWords; ++i)
+      Words[i].store(Buffer[i], std::memory_order_relaxed);
+    Sequence.store(Start + 2, std::memory_order_release);
+  }
+
+  /// \brief Read the last published value into \arg Result.
+  void Load(T &Result) const {
+    uint64_t Buffer[kNumWords];
+    for (;;) {
+      unsigned Start = Sequence.load(std::memory_order_acquire);
+      if (Start & 1)
+        continue;
+      for (unsigned i = 0; i != kNumWords; ++i)
+        Buffer[i] = Words[i].load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (Sequence.load(std::memory_order_relaxed) == Start)
+        break;
+    }
+    memcpy(&Result, Buffer, sizeof(T));
+  }
+};
+
+#endif // SEQLOCK_H
@@ -1,32 +1,64 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
+#include <string.h>
 
+#ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
 #include <GLUT/glut.h>
+#else
+#include <GL/glut.h>
+#endif
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "LightManager.h"
 #include "SimLightController.h"
 #include "Util.h"
 
 namespace {
+
+/// How often the display checks for changes, in milliseconds. This also caps
+/// the redraw rate.
+const unsigned kRefreshInterval = 10;
+
+/// How long the beat monitor takes to dim after a beat, in seconds.
+const double kBeatMonitorDimTime = .05;
+
+/// The range of the number of segments the lights are drawn with, depending
+/// on their size.
+const unsigned kMinCircleSegments = 8, kMaxCircleSegments = 32;
+
+enum {
+  kOverlay_Time,
+  kOverlay_FPS,
+  kOverlay_BPM,
+  kOverlay_Program,
+  kOverlay_Strobe,
+  kNumOverlayLines
+};
+
 class GLUTSimLightController : public SimLightController {
   static GLUTSimLightController *the_controller;
 
-  static void idle_callback() {
-    the_controller->idle();
+  static void timer_callback(int) {
+    the_controller->timer();
   }
   static void draw_callback() {
     the_controller->draw();
   }
+  static void reshape_callback(int w, int h) {
+    the_controller->reshape(w, h);
+  }
   static void keypress_callback(unsigned char key, int x, int y) {
     the_controller->keypress(key, x, y);
   }
 
-  void idle();
-  void draw();  
+  void init_gl();
+  void timer();
+  void draw();
+  void reshape(int w, int h);
   void keypress(unsigned char key, int x, int y) {
     if (key == 'q' || key == 'Q' || key == 27) {
       exit(0);
@@ -39,40 +71,72 @@ class GLUTSimLightController : public SimLightController {
     }
   }
 
-  bool lights_enabled[4];
-  double last_beat_time;
-  unsigned num_frames;
+  void build_lights(const std::vector<LightInfo> &setup);
+  void get_state(LightManagerSnapshot &state) const;
+  void draw_overlay_line(unsigned line, const char *text);
 
   LightManager *light_manager;
 
+  /// The state as last drawn, whether the beat monitor was lit, and the
+  /// second the overlay was drawn in.
+  LightManagerSnapshot drawn_state;
+  bool drawn_beat_monitor;
+  long drawn_second;
+
+  /// The redraws in the current second, and in the last whole one.
+  unsigned num_redraws, redraws_per_second;
+
+  /// The lights, as triangles packed into one vertex array so they are drawn
+  /// in a single call however many there are. Each light's vertices are only
+  /// recolored when its level changes.
+  struct Vertex {
+    GLfloat x, y;
+    GLubyte color[4];
+  };
+  std::vector<Vertex> vertices;
+  unsigned vertices_per_light;
+  /// The full level color of each light (as RGB), and the level its vertices
+  /// are colored for.
+  std::vector<float> light_colors;
+  std::vector<float> vertex_levels;
+
+  /// The projections for the lights and the overlay, which only change with
+  /// the window size.
+  GLdouble light_projection[16], overlay_projection[16];
+
+  /// The text of each overlay line, and the display list drawing it.
+  std::string overlay_text[kNumOverlayLines];
+  GLuint overlay_lists;
+
 public:
-  GLUTSimLightController() : lights_enabled(), light_manager(0) {
+  GLUTSimLightController() : light_manager(0) {
     int argc = 0;
     char *argv = 0;
 
     the_controller = this;
-    last_beat_time = -1;
-    num_frames = 0;
+    get_state(drawn_state);
+    drawn_beat_monitor = false;
+    drawn_second = -1;
+    num_redraws = redraws_per_second = 0;
 
     glutInit(&argc, &argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowPosition(100, 100);
     glutInitWindowSize(1024, 768);
     glutCreateWindow("SimLightController");
+    init_gl();
 
-    glutIdleFunc(idle_callback);
+    glutTimerFunc(kRefreshInterval, timer_callback, 0);
     glutKeyboardFunc(keypress_callback);
+    glutReshapeFunc(reshape_callback);
     glutDisplayFunc(draw_callback);
   }
 
-  virtual void SetLight(unsigned Index, bool Enable) {
-    lights_enabled[Index] = Enable;
-  }
+  // The display is drawn from the light manager's snapshots, which are safe to
+  // read from the GLUT thread, rather than from the frames.
+  virtual void ApplyFrame(const LightFrame &Frame) {}
 
-  virtual void BeatNotification(unsigned Index, double Time) {
-    // FIXME: It is not reliable to use the time here.
-    last_beat_time = get_elapsed_time_in_seconds();
-  }
+  virtual void BeatNotification(unsigned Index, double Time) {}
 
   virtual void MainLoop() {
     glutMainLoop();
@@ -80,145 +144,246 @@ public:
 
   virtual void RegisterLightManager(LightManager &Manager) {
     light_manager = &Manager;
+    build_lights(Manager.GetSetup());
   }
 };
 }
 
 GLUTSimLightController *GLUTSimLightController::the_controller = 0;
 
-namespace {
-
-void draw_circle_filled(float cx, float cy, float radius,
-                        unsigned N = 32) {
-  float k = 2.*M_PI/N;
+void get_sim_light_color(LightInfo::LightColor Color, float Result[3]) {
+  static const float Colors[][3] = {
+    { .8,  0,  0 }, // red
+    {  0,  0, .8 }, // blue
+    {  0, .8,  0 }, // green
+    { .8, .8,  0 }, // yellow
+    { .9, .9, .9 }, // white
+  };
+  for (unsigned i = 0; i != 3; ++i)
+    Result[i] = Colors[Color][i];
+}
 
-  glBegin(GL_TRIANGLE_FAN);
-  glVertex2f(cx, cy);
-  for (unsigned i = 0; i != N + 1; ++i) {
-    float t = i*k;
-    glVertex2f(cx + cos(t)*radius, cy + sin(t)*radius);
+float get_sim_light_radius(const std::vector<LightInfo> &Setup) {
+  // Lights at the same position just overlap.
+  float Closest = .2f / .45f;
+  for (unsigned i = 0, e = Setup.size(); i != e; ++i) {
+    for (unsigned j = i + 1; j != e; ++j) {
+      float dx = Setup[i].X - Setup[j].X, dy = Setup[i].Y - Setup[j].Y;
+      float Distance = sqrtf(dx * dx + dy * dy);
+      if (Distance > 0 && Distance < Closest)
+        Closest = Distance;
+    }
   }
-  glEnd();
+  return .45f * Closest;
 }
 
-void glutDrawString(float x, float y, char *string) {
-  char c;
+namespace {
 
-  glRasterPos2f(x, y);
-  while ((c = *string++)) glutBitmapCharacter(GLUT_BITMAP_HELVETICA_10, c);
+/// Check whether \arg a and \arg b would be drawn the same, ignoring the time.
+bool same_state(const LightManagerSnapshot &a, const LightManagerSnapshot &b) {
+  if (a.LastBeatTime != b.LastBeatTime || a.RecentBPM != b.RecentBPM ||
+      a.ProgramId != b.ProgramId || a.StrobeEnabled != b.StrobeEnabled ||
+      a.NumLights != b.NumLights)
+    return false;
+  for (unsigned i = 0; i != a.NumLights; ++i)
+    if (a.Levels[i] != b.Levels[i])
+      return false;
+  return true;
 }
 
 }
 
-void GLUTSimLightController::idle() {
-  usleep(2000);
-  glutPostRedisplay();
+void GLUTSimLightController::get_state(LightManagerSnapshot &state) const {
+  if (light_manager) {
+    light_manager->GetSnapshot(state);
+  } else {
+    memset(&state, 0, sizeof(state));
+    state.LastBeatTime = -1;
+  }
 }
 
-void GLUTSimLightController::draw() {
-  int w = glutGet(GLUT_WINDOW_WIDTH);
-  int h = glutGet(GLUT_WINDOW_HEIGHT);
+void GLUTSimLightController::init_gl() {
+  // Everything but the projections is fixed, so set it up once.
   float light_position[4] = {0.0, 0.0, -1.0, 0.0};
+  glLightfv(GL_LIGHT0, GL_POSITION, light_position);
+  glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, 1);
+
+  // The view is flat, so later drawing just covers earlier.
+  glClearColor(0, 0, 0, 1);
+  glEnable(GL_POINT_SMOOTH);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glEnable(GL_LIGHT0);
+  glEnable(GL_NORMALIZE);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
 
+  overlay_lists = glGenLists(kNumOverlayLines);
+}
+
+void GLUTSimLightController::build_lights(
+    const std::vector<LightInfo> &setup) {
+  float radius = get_sim_light_radius(setup);
+  unsigned segments = std::max(kMinCircleSegments,
+                               std::min(kMaxCircleSegments,
+                                        unsigned(radius * 160)));
+  unsigned num_lights = std::min(unsigned(setup.size()),
+                                 unsigned(LightFrame::kMaxLights));
+
+  vertices_per_light = 3 * segments;
+  vertices.resize(num_lights * vertices_per_light);
+  light_colors.resize(3 * num_lights);
+  vertex_levels.assign(num_lights, 0);
+
+  // Start with the lights off.
+  float k = 2.*M_PI/segments;
+  for (unsigned i = 0; i != num_lights; ++i) {
+    get_sim_light_color(setup[i].Color, &light_colors[3*i]);
+
+    Vertex *v = &vertices[i * vertices_per_light];
+    for (unsigned j = 0; j != segments; ++j, v += 3) {
+      v[0].x = setup[i].X;
+      v[0].y = setup[i].Y;
+      v[1].x = setup[i].X + cos(j*k)*radius;
+      v[1].y = setup[i].Y + sin(j*k)*radius;
+      v[2].x = setup[i].X + cos((j + 1)*k)*radius;
+      v[2].y = setup[i].Y + sin((j + 1)*k)*radius;
+      for (unsigned c = 0; c != 3; ++c) {
+        memset(v[c].color, 0, 3);
+        v[c].color[3] = 255;
+      }
+    }
+  }
+}
+
+void GLUTSimLightController::timer() {
+  glutTimerFunc(kRefreshInterval, timer_callback, 0);
+
+  // Redraw when anything shown has changed, the beat monitor is dimming, or
+  // the clock reaches a new second.
+  LightManagerSnapshot state;
+  get_state(state);
+  if (drawn_beat_monitor || !same_state(state, drawn_state) ||
+      (long) get_elapsed_time_in_seconds() != drawn_second)
+    glutPostRedisplay();
+}
+
+void GLUTSimLightController::reshape(int w, int h) {
+  if (h < 1)
+    h = 1;
   glViewport(0, 0, w, h);
 
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
   gluPerspective(35, (double) w/h, 0.1, 100.0);
+  glGetDoublev(GL_PROJECTION_MATRIX, light_projection);
 
-  glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
+  glOrtho(0, w, 0, h, -1, 1);
+  glGetDoublev(GL_PROJECTION_MATRIX, overlay_projection);
+}
 
-  glClearColor(0, 0, 0, 1);
-  glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-
-  glLightfv(GL_LIGHT0, GL_POSITION, light_position);
+/// Draw \arg text as overlay line \arg line, recompiling the line's display
+/// list only when the text changes.
+void GLUTSimLightController::draw_overlay_line(unsigned line,
+                                               const char *text) {
+  const int textHeight = 15;
+  GLuint list = overlay_lists + line;
 
-  glTranslatef(0, 0, -3);
+  if (overlay_text[line] != text) {
+    overlay_text[line] = text;
+    glNewList(list, GL_COMPILE);
+    glColor3f(1, 1, 1);
+    glRasterPos2f(10, 10 + textHeight*line);
+    for (const char *c = text; *c; ++c)
+      glutBitmapCharacter(GLUT_BITMAP_HELVETICA_10, *c);
+    glEndList();
+  }
 
-  glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, 1);
+  glCallList(list);
+}
 
-  glEnable(GL_DEPTH_TEST);
-  glEnable(GL_POINT_SMOOTH);
+void GLUTSimLightController::draw() {
+  glMatrixMode(GL_PROJECTION);
+  glLoadMatrixd(light_projection);
 
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
 
-  glEnable(GL_LIGHT0);
-  glEnable(GL_NORMALIZE);
+  glClear(GL_COLOR_BUFFER_BIT);
 
-  struct Light {
-    float radius;
-    float color[3];
-    float position[2];
-  } lights[4] = {
-    { .2, {  0, 0,.8 }, { -.5, -.5 } },
-    { .2, { .8, 0, 0 }, {  .5, -.5 } },
-    { .2, {  0,.8, 0 }, {  .5,  .5 } },
-    { .2, { .9,.9,.9 }, { -.5,  .5 } },
-  };
-  for (unsigned i = 0; i != 4; ++i) {
-    Light &l = lights[i];
+  glTranslatef(0, 0, -3);
 
-    if (lights_enabled[i]) {
-      glColor3fv(l.color);
-      draw_circle_filled(l.position[0], l.position[1], l.radius);
-    }
+  LightManagerSnapshot &state = drawn_state;
+  get_state(state);
+
+  // Recolor the lights which changed, and draw them all at once.
+  unsigned num_lights = std::min(unsigned(vertex_levels.size()),
+                                 state.NumLights);
+  for (unsigned i = 0; i != num_lights; ++i) {
+    float level = state.Levels[i];
+    if (level == vertex_levels[i])
+      continue;
+    vertex_levels[i] = level;
+
+    GLubyte color[3];
+    for (unsigned c = 0; c != 3; ++c)
+      color[c] = (GLubyte) (light_colors[3*i + c] * level * 255 + .5f);
+    Vertex *v = &vertices[i * vertices_per_light];
+    for (unsigned j = 0; j != vertices_per_light; ++j)
+      memcpy(v[j].color, color, 3);
+  }
+  if (!vertices.empty()) {
+    glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].x);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), vertices[0].color);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glDrawArrays(GL_TRIANGLES, 0, vertices.size());
+    glDisableClientState(GL_COLOR_ARRAY);
   }
 
   // Draw the beat monitor.
-  const double beat_monitor_dim_time = .05;
   double elapsed = get_elapsed_time_in_seconds();
-  if (elapsed - last_beat_time <= beat_monitor_dim_time) {
-    double v = 1 - (elapsed - last_beat_time) / beat_monitor_dim_time;
+  drawn_beat_monitor = state.LastBeatTime >= 0 &&
+    elapsed - state.LastBeatTime <= kBeatMonitorDimTime;
+  if (drawn_beat_monitor) {
+    double v = 1 - (elapsed - state.LastBeatTime) / kBeatMonitorDimTime;
     glColor3f(v, v, v);
     glRectf(-.9, -.9, -.7, -.8);
   }
 
-  // Draw the 2D overlays.
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  // Count the redraws, for the FPS.
+  long second = (long) elapsed;
+  if (second != drawn_second) {
+    redraws_per_second = second == drawn_second + 1 ? num_redraws : 0;
+    num_redraws = 0;
+    drawn_second = second;
+  }
+  ++num_redraws;
 
+  // Draw the 2D overlays.
   glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0, w, 0, h, -1, 1);
+  glLoadMatrixd(overlay_projection);
 
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
-  const int textHeight = 15;
   char buffer[256];
-  int y = 0;
-  sprintf(buffer, "Time: %.4fs\n", elapsed);
-  glColor3f(1, 1, 1);
-  glutDrawString(10, 10 + textHeight*y++, buffer);
-
-  if (true) {
-    num_frames++;
-    double fps = num_frames / elapsed;
-    sprintf(buffer, "FPS: %.4fs\n", fps);
-    glColor3f(1, 1, 1);
-    glutDrawString(10, 10 + textHeight*y++, buffer);
-  }
+  sprintf(buffer, "Time: %lds", second);
+  draw_overlay_line(kOverlay_Time, buffer);
 
-  if (light_manager) {
-    double bpm = light_manager->GetRecentBPM();
-    sprintf(buffer, "BPM: %.4fs\n", bpm);
-    glColor3f(1, 1, 1);
-    glutDrawString(10, 10 + textHeight*y++, buffer);
-  }
+  sprintf(buffer, "FPS: %u", redraws_per_second);
+  draw_overlay_line(kOverlay_FPS, buffer);
 
   if (light_manager) {
-    sprintf(buffer, "Program: %s\n", light_manager->GetProgramName().c_str());
-    glColor3f(1, 1, 1);
-    glutDrawString(10, 10 + textHeight*y++, buffer);
-  }
+    sprintf(buffer, "BPM: %.1f", state.RecentBPM);
+    draw_overlay_line(kOverlay_BPM, buffer);
 
-  if (light_manager) {
-    sprintf(buffer, "Strobe Enabled: %s\n",
-            light_manager->GetStrobeEnabled() ? "yes" : "no");
-    glColor3f(1, 1, 1);
-    glutDrawString(10, 10 + textHeight*y++, buffer);
+    sprintf(buffer, "Program: %s", state.ProgramName);
+    draw_overlay_line(kOverlay_Program, buffer);
+
+    sprintf(buffer, "Strobe Enabled: %s",
+            state.StrobeEnabled ? "yes" : "no");
+    draw_overlay_line(kOverlay_Strobe, buffer);
   }
 
   glFlush();
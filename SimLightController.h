@@ -4,16 +4,45 @@
 #define SIMLIGHTCONTROLLER_H
 
 #include "LightController.h"
+#include "LightInfo.h"
+
+#include <vector>
 
 class LightManager;
 
 class SimLightController : public LightController {
 public:
+  /// \brief Run the display until the user quits, which exits the process.
+  /// Controllers without a window render on a thread of their own, and return
+  /// at once.
   virtual void MainLoop() = 0;
 
   virtual void RegisterLightManager(LightManager &) = 0;
+
+  /// \brief Stop rendering, once no more frames will be applied, and finish
+  /// any output.
+  virtual void Finish() {}
 };
 
+// The simulators draw each light as a disc at its position in the setup (see
+// LightInfo), all with the same radius.
+
+/// \brief Return the color to draw a light of \arg Color in at full level, as
+/// RGB in [0, 1].
+void get_sim_light_color(LightInfo::LightColor Color, float Result[3]);
+
+/// \brief Return the radius to draw the lights of \arg Setup with: as large as
+/// possible up to .2, without neighbouring lights overlapping.
+float get_sim_light_radius(const std::vector<LightInfo> &Setup);
+
+/// \brief Create a simulator showing the lights in a GLUT window.
 SimLightController *CreateSimLightController();
 
+/// \brief Create a simulator which needs no display, rendering the lights into
+/// an in memory image whenever they change. If \arg DumpPath is given the
+/// images are written to it: as a constant frame rate YUV4MPEG2 stream if it
+/// ends in ".y4m", or numbered ("NAME-000001.png") if it ends in ".png".
+/// Returns null on failure.
+SimLightController *CreateHeadlessSimLightController(const char *DumpPath = 0);
+
 #endif // SIMLIGHTCONTROLLER_H
@@ -0,0 +1,303 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "Latency.h"
+#include "MusicMonitor.h"
+#include "SpectralKernels.h"
+
+namespace {
+
+/// \brief A fixed size real FFT, computed as a half size complex FFT.
+class RealFFT {
+public:
+  enum { kSize = 512, kHalfSize = kSize / 2, kNumBins = kHalfSize + 1 };
+
+private:
+  unsigned bit_reverse[kHalfSize];
+  float twiddle_re[kHalfSize / 2], twiddle_im[kHalfSize / 2];
+  float split_re[kHalfSize], split_im[kHalfSize];
+  float z_re[kHalfSize], z_im[kHalfSize];
+
+public:
+  RealFFT() {
+    unsigned bits = 0;
+    while ((1u << bits) != kHalfSize)
+      ++bits;
+    for (unsigned i = 0; i != kHalfSize; ++i) {
+      unsigned r = 0;
+      for (unsigned b = 0; b != bits; ++b)
+        r |= ((i >> b) & 1) << (bits - 1 - b);
+      bit_reverse[i] = r;
+    }
+    for (unsigned i = 0; i != kHalfSize / 2; ++i) {
+      twiddle_re[i] = cos(-2 * M_PI * i / kHalfSize);
+      twiddle_im[i] = sin(-2 * M_PI * i / kHalfSize);
+    }
+    for (unsigned i = 0; i != kHalfSize; ++i) {
+      split_re[i] = cos(-2 * M_PI * i / kSize);
+      split_im[i] = sin(-2 * M_PI * i / kSize);
+    }
+  }
+
+  /// Compute bins 0..kSize/2 (inclusive) of the DFT of \arg input.
+  void Transform(const float *input, float *out_re, float *out_im) {
+    // Pack even samples into the real part, odd into the imaginary part.
+    for (unsigned i = 0; i != kHalfSize; ++i) {
+      unsigned j = bit_reverse[i];
+      z_re[j] = input[2 * i];
+      z_im[j] = input[2 * i + 1];
+    }
+
+    // Iterative radix-2 decimation in time.
+    for (unsigned size = 2; size <= kHalfSize; size <<= 1) {
+      unsigned half = size / 2, stride = kHalfSize / size;
+      for (unsigned start = 0; start != kHalfSize; start += size) {
+        for (unsigned k = 0; k != half; ++k) {
+          float wr = twiddle_re[k * stride], wi = twiddle_im[k * stride];
+          unsigned a = start + k, b = a + half;
+          float tr = z_re[b] * wr - z_im[b] * wi;
+          float ti = z_re[b] * wi + z_im[b] * wr;
+          z_re[b] = z_re[a] - tr;
+          z_im[b] = z_im[a] - ti;
+          z_re[a] += tr;
+          z_im[a] += ti;
+        }
+      }
+    }
+
+    // Untangle the even and odd spectra.
+    for (unsigned k = 0; k != kHalfSize + 1; ++k) {
+      unsigned a = k % kHalfSize, b = (kHalfSize - k) % kHalfSize;
+      float even_re = .5f * (z_re[a] + z_re[b]);
+      float even_im = .5f * (z_im[a] - z_im[b]);
+      float odd_re = .5f * (z_im[a] + z_im[b]);
+      float odd_im = -.5f * (z_re[a] - z_re[b]);
+      float wr = k == kHalfSize ? -1 : split_re[k];
+      float wi = k == kHalfSize ? 0 : split_im[k];
+      out_re[k] = even_re + odd_re * wr - odd_im * wi;
+      out_im[k] = even_im + odd_re * wi + odd_im * wr;
+    }
+  }
+};
+
+/// \brief A real-time peak picker, equivalent to aubio's: the onset function is
+/// smoothed with a zero-phase biquad over a short window, thresholded against
+/// the window median plus a multiple of its mean, and a peak is reported when
+/// the thresholded value has a positive local maximum.
+class PeakPicker {
+  enum { kWindowPre = 1, kWindowPost = 5,
+         kWindowSize = kWindowPre + kWindowPost + 1 };
+
+  float threshold;
+  float keep[kWindowSize];
+  float peek[3];
+
+public:
+  PeakPicker(float threshold_ = .7f)
+    : threshold(threshold_), keep(), peek() {}
+
+  bool Push(float value) {
+    memmove(keep, keep + 1, (kWindowSize - 1) * sizeof(float));
+    keep[kWindowSize - 1] = value;
+
+    // Forward-backward (zero phase) low pass filter.
+    const float b0 = .1600f, b1 = .3200f, b2 = .1600f;
+    const float a1 = -.5949f, a2 = .2348f;
+    float proc[kWindowSize];
+    float x1 = 0, x2 = 0, y1 = 0, y2 = 0;
+    for (unsigned i = 0; i != kWindowSize; ++i) {
+      float y = b0 * keep[i] + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+      x2 = x1; x1 = keep[i]; y2 = y1; y1 = y;
+      proc[i] = y;
+    }
+    x1 = x2 = y1 = y2 = 0;
+    for (unsigned i = kWindowSize; i-- != 0; ) {
+      float x = proc[i];
+      float y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+      x2 = x1; x1 = x; y2 = y1; y1 = y;
+      proc[i] = y;
+    }
+
+    float mean = 0;
+    for (unsigned i = 0; i != kWindowSize; ++i)
+      mean += proc[i];
+    mean /= kWindowSize;
+
+    float sorted[kWindowSize];
+    memcpy(sorted, proc, sizeof(sorted));
+    std::nth_element(sorted, sorted + kWindowSize / 2, sorted + kWindowSize);
+    float median = sorted[kWindowSize / 2];
+
+    peek[0] = peek[1];
+    peek[1] = peek[2];
+    peek[2] = proc[kWindowPost] - median - mean * threshold;
+
+    return peek[1] > peek[0] && peek[1] > peek[2] && peek[1] > 0;
+  }
+};
+
+class SpectralFluxMusicMonitor : public MusicMonitor {
+  enum { kHopSize = 256, kNumBins = RealFFT::kNumBins, kMaxBands = 3 };
+
+  /// A frequency band with its own onset detector. The bands partition the
+  /// spectrum, so computing every band's flux is still one pass over the bins.
+  struct Band {
+    unsigned first_bin, end_bin;
+    MusicMonitorHandler::BeatKind kind;
+    PeakPicker picker;
+  };
+
+  MusicMonitorHandler *handler;
+  const SpectralKernels *kernels;
+
+  RealFFT fft;
+  Band bands[kMaxBands];
+  unsigned num_bands;
+  double sample_rate;
+  float silence_threshold;
+
+  float window[RealFFT::kSize];
+  float frame[RealFFT::kSize];
+  float windowed[RealFFT::kSize];
+  unsigned frame_pos;
+
+  float spectrum_re[kNumBins], spectrum_im[kNumBins];
+  float magnitude[kNumBins];
+  float log_magnitude[2][kNumBins];
+  unsigned current;
+
+public:
+  SpectralFluxMusicMonitor(MusicMonitorHandler *handler_,
+                           const SpectralKernels *kernels_,
+                           unsigned num_bands_)
+    : handler(handler_), kernels(kernels_),
+      num_bands(num_bands_ == 1 ? 1 : kMaxBands), sample_rate(44100),
+      silence_threshold(-70.0f), frame(), frame_pos(RealFFT::kSize - kHopSize),
+      log_magnitude(), current(0)
+  {
+    // Hann window.
+    for (unsigned i = 0; i != RealFFT::kSize; ++i)
+      window[i] = .5 - .5 * cos(2 * M_PI * i / RealFFT::kSize);
+
+    ComputeBands();
+  }
+
+  virtual ~SpectralFluxMusicMonitor() {
+    delete handler;
+  }
+
+  virtual void SetSampleRate(double sample_rate_) {
+    sample_rate = sample_rate_;
+    ComputeBands();
+  }
+
+  virtual void HandleBlock(const float *left, const float *right,
+                           unsigned frames, double start_time) {
+    for (unsigned i = 0; i != frames; ) {
+      // Downmix as much of the block as fits in the current hop.
+      unsigned n = std::min(frames - i, RealFFT::kSize - frame_pos);
+      float *dst = frame + frame_pos;
+      for (unsigned j = 0; j != n; ++j)
+        dst[j] = (left[i + j] + right[i + j]) * .5f;
+      frame_pos += n;
+      i += n;
+
+      if (frame_pos == RealFFT::kSize) {
+        // Beats are stamped with the stream time of the end of the hop.
+        ProcessHop(start_time + i / sample_rate);
+
+        // Slide the analysis frame along by one hop.
+        memmove(frame, frame + kHopSize,
+                (RealFFT::kSize - kHopSize) * sizeof(float));
+        frame_pos = RealFFT::kSize - kHopSize;
+      }
+    }
+  }
+
+private:
+  void ComputeBands() {
+    // A single band covers everything and reports low beats, like the aubio
+    // monitor. Otherwise split into kicks, everything in between, and hats.
+    if (num_bands == 1) {
+      bands[0].first_bin = 0;
+      bands[0].end_bin = kNumBins;
+      bands[0].kind = MusicMonitorHandler::kBeatLow;
+      return;
+    }
+
+    double bin_width = sample_rate / RealFFT::kSize;
+    unsigned low_end = std::max(2u, (unsigned) (200 / bin_width + .5));
+    unsigned high_start = std::max(low_end + 1,
+                                   (unsigned) (4000 / bin_width + .5));
+    high_start = std::min(high_start, (unsigned) kNumBins - 1);
+
+    bands[0].first_bin = 0;
+    bands[0].end_bin = low_end;
+    bands[0].kind = MusicMonitorHandler::kBeatLow;
+    bands[1].first_bin = low_end;
+    bands[1].end_bin = high_start;
+    bands[1].kind = MusicMonitorHandler::kBeatMid;
+    bands[2].first_bin = high_start;
+    bands[2].end_bin = kNumBins;
+    bands[2].kind = MusicMonitorHandler::kBeatHi;
+  }
+
+  bool IsSilent() const {
+    const float *hop = frame + RealFFT::kSize - kHopSize;
+    float energy = 0;
+    for (unsigned i = 0; i != kHopSize; ++i)
+      energy += hop[i] * hop[i];
+    return 10 * log10f(energy / kHopSize + 1e-20f) < silence_threshold;
+  }
+
+  void ProcessHop(double frame_time) {
+    for (unsigned i = 0; i != RealFFT::kSize; ++i)
+      windowed[i] = frame[i] * window[i];
+    fft.Transform(windowed, spectrum_re, spectrum_im);
+
+    // The onset function is the half-wave rectified difference of the log
+    // compressed magnitude spectra, which is a cheap stand-in for aubio's
+    // Kullback-Liebler detection function. The spectrum work is shared, only
+    // the flux reduction and peak picking are per band.
+    float *cur = log_magnitude[current], *prev = log_magnitude[current ^ 1];
+    kernels->magnitude(spectrum_re, spectrum_im, magnitude, kNumBins);
+    kernels->log_compress(magnitude, cur, kNumBins, 1.0f);
+    current ^= 1;
+
+    bool is_onset[kMaxBands];
+    bool any_onset = false;
+    for (unsigned i = 0; i != num_bands; ++i) {
+      Band &band = bands[i];
+      float onset = kernels->flux(cur + band.first_bin, prev + band.first_bin,
+                                  band.end_bin - band.first_bin);
+      is_onset[i] = band.picker.Push(onset);
+      any_onset |= is_onset[i];
+    }
+
+    if (!any_onset || IsSilent())
+      return;
+
+    latency_record(kLatencyStage_Detect);
+    for (unsigned i = 0; i != num_bands; ++i)
+      if (is_onset[i])
+        handler->HandleBeat(bands[i].kind, frame_time);
+  }
+};
+
+}
+
+MusicMonitor *CreateSpectralFluxMusicMonitor(MusicMonitorHandler *handler,
+                                             const char *kernels_name,
+                                             unsigned num_bands) {
+  const SpectralKernels *kernels = GetSpectralKernels(kernels_name);
+  if (!kernels) {
+    fprintf(stderr, "unsupported spectral kernels: %s\n", kernels_name);
+    return 0;
+  }
+
+  fprintf(stderr, "using %s spectral kernels\n", kernels->name);
+  return new SpectralFluxMusicMonitor(handler, kernels, num_bands);
+}
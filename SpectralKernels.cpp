@@ -0,0 +1,294 @@
+#include "SpectralKernels.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+// All the log kernels use the same approximation: split x into 2^e * m with m
+// in [1, 2), then log(m) = 2 * atanh(t) with t = (m - 1) / (m + 1) in [0, 1/3),
+// expanded to the t^9 term. The absolute error is below 1e-6, which is plenty
+// for onset detection, and it vectorizes without tables or branches.
+
+namespace {
+
+const float kLn2 = 0.69314718f;
+
+/*
+ * Scalar
+ */
+
+inline float log_approx(float x) {
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  float e = (float) ((int) (bits >> 23) - 127);
+  bits = (bits & 0x007FFFFF) | 0x3F800000;
+  float m;
+  memcpy(&m, &bits, sizeof(m));
+
+  float t = (m - 1) / (m + 1);
+  float t2 = t * t;
+  float p = 1.f/9;
+  p = p * t2 + 1.f/7;
+  p = p * t2 + 1.f/5;
+  p = p * t2 + 1.f/3;
+  p = p * t2 + 1;
+  return e * kLn2 + 2 * t * p;
+}
+
+void scalar_magnitude(const float *re, const float *im, float *mag,
+                      unsigned n) {
+  for (unsigned i = 0; i != n; ++i)
+    mag[i] = sqrtf(re[i] * re[i] + im[i] * im[i]);
+}
+
+void scalar_log_compress(const float *in, float *out, unsigned n,
+                         float lambda) {
+  for (unsigned i = 0; i != n; ++i)
+    out[i] = log_approx(1 + lambda * in[i]);
+}
+
+float scalar_flux(const float *cur, const float *prev, unsigned n) {
+  float sum = 0;
+  for (unsigned i = 0; i != n; ++i) {
+    float d = cur[i] - prev[i];
+    if (d > 0)
+      sum += d;
+  }
+  return sum;
+}
+
+const SpectralKernels scalar_kernels = {
+  "scalar", scalar_magnitude, scalar_log_compress, scalar_flux
+};
+
+/*
+ * SSE2
+ */
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse2")))
+inline __m128 sse2_log(__m128 x) {
+  __m128i bits = _mm_castps_si128(x);
+  __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23),
+                                           _mm_set1_epi32(127)));
+  __m128 m = _mm_castsi128_ps(
+    _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)),
+                 _mm_set1_epi32(0x3F800000)));
+
+  __m128 one = _mm_set1_ps(1);
+  __m128 t = _mm_div_ps(_mm_sub_ps(m, one), _mm_add_ps(m, one));
+  __m128 t2 = _mm_mul_ps(t, t);
+  __m128 p = _mm_set1_ps(1.f/9);
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/7));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/5));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.f/3));
+  p = _mm_add_ps(_mm_mul_ps(p, t2), one);
+  p = _mm_mul_ps(_mm_add_ps(t, t), p);
+  return _mm_add_ps(_mm_mul_ps(e, _mm_set1_ps(kLn2)), p);
+}
+
+__attribute__((target("sse2")))
+void sse2_magnitude(const float *re, const float *im, float *mag, unsigned n) {
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 r = _mm_loadu_ps(re + i), j = _mm_loadu_ps(im + i);
+    _mm_storeu_ps(mag + i, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r, r),
+                                                  _mm_mul_ps(j, j))));
+  }
+  scalar_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void sse2_log_compress(const float *in, float *out, unsigned n,
+                       float lambda) {
+  __m128 one = _mm_set1_ps(1), l = _mm_set1_ps(lambda);
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_ps(out + i, sse2_log(_mm_add_ps(one, _mm_mul_ps(
+                                                 l, _mm_loadu_ps(in + i)))));
+  scalar_log_compress(in + i, out + i, n - i, lambda);
+}
+
+__attribute__((target("sse2")))
+float sse2_flux(const float *cur, const float *prev, unsigned n) {
+  __m128 zero = _mm_setzero_ps(), sum = zero;
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4)
+    sum = _mm_add_ps(sum, _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(cur + i),
+                                                _mm_loadu_ps(prev + i)),
+                                     zero));
+  float lanes[4];
+  _mm_storeu_ps(lanes, sum);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+    scalar_flux(cur + i, prev + i, n - i);
+}
+
+const SpectralKernels sse2_kernels = {
+  "sse2", sse2_magnitude, sse2_log_compress, sse2_flux
+};
+
+/*
+ * AVX2
+ */
+
+__attribute__((target("avx2")))
+inline __m256 avx2_log(__m256 x) {
+  __m256i bits = _mm256_castps_si256(x);
+  __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                                 _mm256_set1_epi32(127)));
+  __m256 m = _mm256_castsi256_ps(
+    _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)),
+                    _mm256_set1_epi32(0x3F800000)));
+
+  __m256 one = _mm256_set1_ps(1);
+  __m256 t = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+  __m256 t2 = _mm256_mul_ps(t, t);
+  __m256 p = _mm256_set1_ps(1.f/9);
+  p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(1.f/7));
+  p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(1.f/5));
+  p = _mm256_add_ps(_mm256_mul_ps(p, t2), _mm256_set1_ps(1.f/3));
+  p = _mm256_add_ps(_mm256_mul_ps(p, t2), one);
+  p = _mm256_mul_ps(_mm256_add_ps(t, t), p);
+  return _mm256_add_ps(_mm256_mul_ps(e, _mm256_set1_ps(kLn2)), p);
+}
+
+__attribute__((target("avx2")))
+void avx2_magnitude(const float *re, const float *im, float *mag, unsigned n) {
+  unsigned i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 r = _mm256_loadu_ps(re + i), j = _mm256_loadu_ps(im + i);
+    _mm256_storeu_ps(mag + i, _mm256_sqrt_ps(
+                       _mm256_add_ps(_mm256_mul_ps(r, r),
+                                     _mm256_mul_ps(j, j))));
+  }
+  sse2_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void avx2_log_compress(const float *in, float *out, unsigned n,
+                       float lambda) {
+  __m256 one = _mm256_set1_ps(1), l = _mm256_set1_ps(lambda);
+  unsigned i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, avx2_log(_mm256_add_ps(one, _mm256_mul_ps(
+                                         l, _mm256_loadu_ps(in + i)))));
+  sse2_log_compress(in + i, out + i, n - i, lambda);
+}
+
+__attribute__((target("avx2")))
+float avx2_flux(const float *cur, const float *prev, unsigned n) {
+  __m256 zero = _mm256_setzero_ps(), sum = zero;
+  unsigned i = 0;
+  for (; i + 8 <= n; i += 8)
+    sum = _mm256_add_ps(sum, _mm256_max_ps(
+                          _mm256_sub_ps(_mm256_loadu_ps(cur + i),
+                                        _mm256_loadu_ps(prev + i)), zero));
+  float lanes[8];
+  _mm256_storeu_ps(lanes, sum);
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+    ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])) +
+    sse2_flux(cur + i, prev + i, n - i);
+}
+
+const SpectralKernels avx2_kernels = {
+  "avx2", avx2_magnitude, avx2_log_compress, avx2_flux
+};
+
+#endif // HAVE_X86_KERNELS
+
+/*
+ * NEON
+ */
+
+#ifdef HAVE_NEON_KERNELS
+
+inline float32x4_t neon_log(float32x4_t x) {
+  uint32x4_t bits = vreinterpretq_u32_f32(x);
+  float32x4_t e = vcvtq_f32_s32(vsubq_s32(
+                                  vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)),
+                                  vdupq_n_s32(127)));
+  float32x4_t m = vreinterpretq_f32_u32(
+    vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x007FFFFF)),
+              vdupq_n_u32(0x3F800000)));
+
+  float32x4_t one = vdupq_n_f32(1);
+  float32x4_t t = vdivq_f32(vsubq_f32(m, one), vaddq_f32(m, one));
+  float32x4_t t2 = vmulq_f32(t, t);
+  float32x4_t p = vdupq_n_f32(1.f/9);
+  p = vmlaq_f32(vdupq_n_f32(1.f/7), p, t2);
+  p = vmlaq_f32(vdupq_n_f32(1.f/5), p, t2);
+  p = vmlaq_f32(vdupq_n_f32(1.f/3), p, t2);
+  p = vmlaq_f32(one, p, t2);
+  p = vmulq_f32(vaddq_f32(t, t), p);
+  return vmlaq_f32(p, e, vdupq_n_f32(kLn2));
+}
+
+void neon_magnitude(const float *re, const float *im, float *mag, unsigned n) {
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t r = vld1q_f32(re + i), j = vld1q_f32(im + i);
+    vst1q_f32(mag + i, vsqrtq_f32(vmlaq_f32(vmulq_f32(r, r), j, j)));
+  }
+  scalar_magnitude(re + i, im + i, mag + i, n - i);
+}
+
+void neon_log_compress(const float *in, float *out, unsigned n,
+                       float lambda) {
+  float32x4_t one = vdupq_n_f32(1), l = vdupq_n_f32(lambda);
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(out + i, neon_log(vmlaq_f32(one, l, vld1q_f32(in + i))));
+  scalar_log_compress(in + i, out + i, n - i, lambda);
+}
+
+float neon_flux(const float *cur, const float *prev, unsigned n) {
+  float32x4_t zero = vdupq_n_f32(0), sum = zero;
+  unsigned i = 0;
+  for (; i + 4 <= n; i += 4)
+    sum = vaddq_f32(sum, vmaxq_f32(vsubq_f32(vld1q_f32(cur + i),
+                                             vld1q_f32(prev + i)), zero));
+  return vaddvq_f32(sum) + scalar_flux(cur + i, prev + i, n - i);
+}
+
+const SpectralKernels neon_kernels = {
+  "neon", neon_magnitude, neon_log_compress, neon_flux
+};
+
+#endif // HAVE_NEON_KERNELS
+
+}
+
+const SpectralKernels *GetSpectralKernels(const char *name) {
+  bool is_auto = strcmp(name, "auto") == 0;
+
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  bool have_avx2 = __builtin_cpu_supports("avx2");
+  bool have_sse2 = __builtin_cpu_supports("sse2");
+  if ((is_auto || strcmp(name, "avx2") == 0) && have_avx2)
+    return &avx2_kernels;
+  if ((is_auto || strcmp(name, "sse2") == 0) && have_sse2)
+    return &sse2_kernels;
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+  if (is_auto || strcmp(name, "neon") == 0)
+    return &neon_kernels;
+#endif
+
+  if (is_auto || strcmp(name, "scalar") == 0)
+    return &scalar_kernels;
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+// -*- C++ -*-
+
+#ifndef SPECTRALKERNELS_H
+#define SPECTRALKERNELS_H
+
+/// \brief The inner loops of spectral onset detection, in one flavor per
+/// instruction set.
+///
+/// All kernels accept any length and any alignment, and compute the same
+/// approximations, so the choice of kernels only affects speed (and rounding
+/// in the last bits of reductions).
+struct SpectralKernels {
+  const char *name;
+
+  /// mag[i] = sqrt(re[i]^2 + im[i]^2)
+  void (*magnitude)(const float *re, const float *im, float *mag, unsigned n);
+
+  /// out[i] = log(1 + lambda * in[i]), for in[i] >= 0.
+  void (*log_compress)(const float *in, float *out, unsigned n, float lambda);
+
+  /// Return sum(max(0, cur[i] - prev[i])).
+  float (*flux)(const float *cur, const float *prev, unsigned n);
+};
+
+/// \brief Return the kernels called \arg name ("scalar", "sse2", "avx2" or
+/// "neon"), or the best ones supported by this CPU for "auto". Returns null if
+/// the requested kernels are unknown or unsupported.
+const SpectralKernels *GetSpectralKernels(const char *name);
+
+#endif // SPECTRALKERNELS_H
@@ -0,0 +1,62 @@
+#include "TempoEstimator.h"
+
+#include <algorithm>
+#include <cmath>
+
+const double TempoEstimator::kMaxInterval = 2.0;
+
+namespace {
+
+/// How far (as a fraction of the median) an interval may be from the median
+/// and still count.
+const double kTolerance = 0.25;
+
+/// The weight of each new interval in the smoothed interval.
+const double kSmoothing = 0.2;
+
+}
+
+void TempoEstimator::Reset() {
+  NumIntervals = 0;
+  Position = 0;
+  LastBeatTime = -1;
+  Interval = 0;
+}
+
+double TempoEstimator::GetMedianInterval() const {
+  double Sorted[kNumIntervals];
+  std::copy(Intervals, Intervals + NumIntervals, Sorted);
+  std::nth_element(Sorted, Sorted + NumIntervals / 2, Sorted + NumIntervals);
+  return Sorted[NumIntervals / 2];
+}
+
+void TempoEstimator::AddBeat(double Time) {
+  double Delta = Time - LastBeatTime;
+  bool First = LastBeatTime < 0;
+  LastBeatTime = Time;
+  if (First || Delta <= 0 || Delta > kMaxInterval)
+    return;
+
+  Intervals[Position] = Delta;
+  Position = (Position + 1) % kNumIntervals;
+  if (NumIntervals < kNumIntervals)
+    ++NumIntervals;
+
+  // Until there are enough intervals for a meaningful median, take them all.
+  if (NumIntervals < kMinIntervals) {
+    Interval = Interval > 0 ? Interval + kSmoothing * (Delta - Interval) :
+      Delta;
+    return;
+  }
+
+  double Median = GetMedianInterval();
+  double Limit = kTolerance * Median;
+
+  // If the tempo has changed the median gets there first, so jump to it
+  // rather than slowly averaging across.
+  if (std::fabs(Interval - Median) > Limit)
+    Interval = Median;
+
+  if (std::fabs(Delta - Median) <= Limit)
+    Interval += kSmoothing * (Delta - Interval);
+}
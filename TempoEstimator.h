@@ -0,0 +1,53 @@
+// -*- C++ -*-
+
+#ifndef TEMPOESTIMATOR_H
+#define TEMPOESTIMATOR_H
+
+/// \brief Estimate the tempo from a stream of beat times, in constant time
+/// per beat.
+///
+/// Each interval between beats is checked against the median of the recent
+/// intervals, and those which agree with it are averaged into an
+/// exponentially weighted estimate. Missed and spurious beats (which double or
+/// split an interval) are rejected, while a real change of tempo takes over
+/// the median, and so the estimate, within a few beats.
+class TempoEstimator {
+public:
+  enum {
+    /// The number of recent intervals the median is taken over.
+    kNumIntervals = 9,
+    /// The number of intervals needed before any are rejected.
+    kMinIntervals = 3
+  };
+
+  /// The longest interval between beats, in seconds. Longer ones are gaps in
+  /// the music rather than a (< 30 BPM) tempo.
+  static const double kMaxInterval;
+
+private:
+  /// The recent intervals, as a ring.
+  double Intervals[kNumIntervals];
+  unsigned NumIntervals, Position;
+  double LastBeatTime;
+  /// The smoothed interval, or 0 if unknown.
+  double Interval;
+
+  double GetMedianInterval() const;
+
+public:
+  TempoEstimator() { Reset(); }
+
+  /// \brief Forget all beats.
+  void Reset();
+
+  /// \brief Add a beat at \arg Time, in seconds. Beats must be added in order.
+  void AddBeat(double Time);
+
+  /// \brief The time of the last beat added, or -1 if there is none.
+  double GetLastBeatTime() const { return LastBeatTime; }
+
+  /// \brief The current tempo, or 0 if it is not known yet.
+  double GetBPM() const { return Interval > 0 ? 60 / Interval : 0; }
+};
+
+#endif // TEMPOESTIMATOR_H
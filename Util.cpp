@@ -1,13 +1,34 @@
-#include <sys/time.h>
+#include "Util.h"
+
+#include "Clock.h"
+
+#include <atomic>
+#include <limits>
+
+namespace {
+
+const int64_t kNoStartTime = std::numeric_limits<int64_t>::min();
+
+std::atomic<int64_t> start_time(kNoStartTime);
+
+}
 
 double get_time_in_seconds() {
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  return (double) t.tv_sec + t.tv_usec * 1.e-6;
+  return get_time_in_ns() * 1e-9;
 }
 
 double get_elapsed_time_in_seconds() {
-  static double start_time = get_time_in_seconds();
+  int64_t now = get_time_in_ns();
+  int64_t start = start_time.load(std::memory_order_relaxed);
+  if (start == kNoStartTime) {
+    // The first caller sets the origin, unless someone else beat us to it.
+    if (start_time.compare_exchange_strong(start, now))
+      start = now;
+  }
+
+  return (now - start) * 1e-9;
+}
 
-  return get_time_in_seconds() - start_time;
+void reset_elapsed_time() {
+  start_time.store(get_time_in_ns());
 }
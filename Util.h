@@ -3,8 +3,14 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+/// \brief Return the current time, in seconds from an arbitrary epoch. See
+/// Clock.h, this is just get_time_in_ns() in seconds.
 double get_time_in_seconds();
 
+/// \brief Return the time since the first call (or the last
+/// reset_elapsed_time()), in seconds.
 double get_elapsed_time_in_seconds();
 
+void reset_elapsed_time();
+
 #endif // UTIL_H
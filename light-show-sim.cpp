@@ -0,0 +1,289 @@
+// Run the light programs against a beat trace in simulated time, to check
+// program selection and strobe limits over a whole set without waiting for it.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "Clock.h"
+#include "LightController.h"
+#include "LightInfo.h"
+#include "LightManager.h"
+#include "LightProgram.h"
+#include "Util.h"
+
+namespace {
+
+struct Beat {
+  MusicMonitorHandler::BeatKind Kind;
+  double Time;
+};
+
+/// \brief A controller recording what the lights did, in simulated time.
+class StatsLightController : public LightController {
+public:
+  struct LightStats {
+    bool Enabled;
+    double LastChangeTime;
+    double EnabledTime;
+    double LongestEnabledTime;
+    unsigned NumSwitches;
+  };
+
+  std::vector<LightStats> Lights;
+
+  StatsLightController(unsigned NumLights) : Lights(NumLights) {
+    for (unsigned i = 0; i != NumLights; ++i) {
+      LightStats &LS = Lights[i];
+      LS.Enabled = false;
+      LS.LastChangeTime = LS.EnabledTime = LS.LongestEnabledTime = 0;
+      LS.NumSwitches = 0;
+    }
+  }
+
+  virtual void BeatNotification(unsigned Index, double Time) {}
+
+  virtual void ApplyFrame(const LightFrame &Frame) {
+    double Now = get_elapsed_time_in_seconds();
+    for (unsigned i = 0, e = Lights.size(); i != e; ++i) {
+      LightStats &LS = Lights[i];
+      if (!Frame.SetsLight(i) || LS.Enabled == Frame.IsEnabled(i))
+        continue;
+
+      Update(LS, Now);
+      LS.Enabled = Frame.IsEnabled(i);
+      ++LS.NumSwitches;
+    }
+  }
+
+  /// Account for the time since the last change of \arg LS.
+  void Update(LightStats &LS, double Now) {
+    if (LS.Enabled) {
+      double OnTime = Now - LS.LastChangeTime;
+      LS.EnabledTime += OnTime;
+      if (OnTime > LS.LongestEnabledTime)
+        LS.LongestEnabledTime = OnTime;
+    }
+    LS.LastChangeTime = Now;
+  }
+};
+
+bool ReadBeatTrace(const char *Path, std::vector<Beat> &Beats) {
+  FILE *fp = std::string(Path) == "-" ? stdin : fopen(Path, "r");
+  if (!fp) {
+    fprintf(stderr, "unable to open: %s\n", Path);
+    return false;
+  }
+
+  // This is the format written by LightDance --log-beats.
+  char Line[256];
+  unsigned LineNumber = 0;
+  while (fgets(Line, sizeof(Line), fp)) {
+    ++LineNumber;
+    int Kind;
+    double Time, CurrentTime;
+    if (sscanf(Line, "BeatKind: %d, Time: %lfs, CurrentTime: %lfs", &Kind,
+               &Time, &CurrentTime) != 3 ||
+        Kind < 0 || Kind >= MusicMonitorHandler::kNumBeatKinds) {
+      fprintf(stderr, "%s:%u: invalid beat\n", Path, LineNumber);
+      continue;
+    }
+
+    Beat B = { MusicMonitorHandler::BeatKind(Kind), Time };
+    Beats.push_back(B);
+  }
+
+  if (fp != stdin)
+    fclose(fp);
+  return true;
+}
+
+void MakeBeatTrace(double BPM, double Duration, std::vector<Beat> &Beats) {
+  for (double Time = 0; Time < Duration; Time += 60 / BPM) {
+    Beat B = { MusicMonitorHandler::kBeatLow, Time };
+    Beats.push_back(B);
+  }
+}
+
+}
+
+int main(int argc, char **argv) {
+  long Seed = 1;
+  double BPM = 120;
+  double FrameRate = 100;
+  double Duration = 4 * 60 * 60;
+  const char *TracePath = 0;
+  std::string ProgramsPath = "programs";
+  const char *SetupPath = 0;
+
+  for (int i = 1; i != argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--seed" || arg == "--bpm" || arg == "--duration" ||
+        arg == "--frame-rate" || arg == "--programs" || arg == "--lights") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      if (arg == "--seed")
+        Seed = atol(argv[i]);
+      else if (arg == "--bpm")
+        BPM = atof(argv[i]);
+      else if (arg == "--frame-rate")
+        FrameRate = atof(argv[i]);
+      else if (arg == "--programs")
+        ProgramsPath = argv[i];
+      else if (arg == "--lights")
+        SetupPath = argv[i];
+      else
+        Duration = atof(argv[i]);
+    } else if (arg[0] == '-' && arg != "-") {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], arg.c_str());
+      return 1;
+    } else if (!TracePath) {
+      TracePath = argv[i];
+    } else {
+      fprintf(stderr, "%s: too many arguments\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (FrameRate <= 0) {
+    fprintf(stderr, "%s: invalid frame rate: %f\n", argv[0], FrameRate);
+    return 1;
+  }
+
+  // Without a trace, simulate a steady beat.
+  std::vector<Beat> Beats;
+  if (TracePath) {
+    if (!ReadBeatTrace(TracePath, Beats))
+      return 1;
+  } else {
+    if (BPM <= 0) {
+      fprintf(stderr, "%s: invalid BPM: %f\n", argv[0], BPM);
+      return 1;
+    }
+    MakeBeatTrace(BPM, Duration, Beats);
+  }
+  if (Beats.empty()) {
+    fprintf(stderr, "%s: no beats to simulate\n", argv[0]);
+    return 1;
+  }
+
+  // Everything which reads the time now sees the simulation.
+  SimulatedClock *Clock = CreateSimulatedClock();
+  set_clock(Clock);
+
+  std::vector<LightProgram *> AllPrograms;
+  if (!LightProgram::LoadAllPrograms(ProgramsPath, AllPrograms))
+    return 1;
+  if (AllPrograms.empty()) {
+    fprintf(stderr, "%s: no light programs in: %s\n", argv[0],
+            ProgramsPath.c_str());
+    return 1;
+  }
+
+  std::vector<LightInfo> LightSetup;
+  if (!SetupPath)
+    LightSetup = LightInfo::GetDefaultSetup();
+  else if (!LightInfo::LoadSetup(SetupPath, LightSetup))
+    return 1;
+
+  // The statistics are kept by light index.
+  unsigned NumIndices = 0;
+  for (unsigned i = 0, e = LightSetup.size(); i != e; ++i)
+    NumIndices = std::max(NumIndices, LightSetup[i].Index + 1);
+  StatsLightController *Stats = new StatsLightController(NumIndices);
+  LightManager *LightManager = CreateLightManager(Stats, LightSetup,
+                                                  AllPrograms, Seed);
+
+  struct ProgramStats {
+    unsigned NumSelections;
+    double Time;
+  };
+  std::map<std::string, ProgramStats> Programs;
+  std::string ProgramName;
+  double ProgramStartTime = 0;
+  LightManagerSnapshot Snapshot;
+  unsigned ProgramId = 0;
+
+  struct timespec RealStart, RealEnd;
+  clock_gettime(CLOCK_MONOTONIC, &RealStart);
+
+  // Interleave the beats with frames at the frame rate, as the render loop
+  // would run them.
+  double StartTime = Beats.front().Time;
+  uint64_t NextFrame = 0;
+  for (unsigned i = 0, e = Beats.size(); i != e;) {
+    double BeatTime = Beats[i].Time - StartTime;
+    double FrameTime = NextFrame / FrameRate;
+    double Now = std::min(BeatTime, FrameTime);
+
+    Clock->SetTime((int64_t) (Now * 1e9));
+    if (FrameTime < BeatTime) {
+      LightManager->RenderFrame();
+      ++NextFrame;
+    } else {
+      LightManager->HandleBeat(Beats[i].Kind, Beats[i].Time);
+      ++i;
+    }
+
+    // The manager doesn't log from the beat path, so report the program
+    // switches here.
+    LightManager->GetSnapshot(Snapshot);
+    if (Snapshot.ProgramId != ProgramId) {
+      ProgramId = Snapshot.ProgramId;
+      fprintf(stderr, "current program: '%s'\n", Snapshot.ProgramName);
+    }
+
+    std::string Name = LightManager->GetProgramName();
+    if (Name != ProgramName) {
+      if (!ProgramName.empty())
+        Programs[ProgramName].Time += Now - ProgramStartTime;
+      ++Programs[Name].NumSelections;
+      ProgramName = Name;
+      ProgramStartTime = Now;
+    }
+  }
+
+  double EndTime = Beats.back().Time - StartTime;
+  Programs[ProgramName].Time += EndTime - ProgramStartTime;
+  for (unsigned i = 0, e = Stats->Lights.size(); i != e; ++i)
+    Stats->Update(Stats->Lights[i], EndTime);
+
+  clock_gettime(CLOCK_MONOTONIC, &RealEnd);
+  double RealTime = (RealEnd.tv_sec - RealStart.tv_sec) +
+    (RealEnd.tv_nsec - RealStart.tv_nsec) * 1e-9;
+
+  printf("simulated %.1fs (%u beats, seed %ld) in %.3fs\n", EndTime,
+         (unsigned) Beats.size(), Seed, RealTime);
+
+  printf("\n%-32s %10s %10s %7s\n", "program", "selections", "time", "share");
+  for (std::map<std::string, ProgramStats>::iterator it = Programs.begin(),
+         ie = Programs.end(); it != ie; ++it)
+    printf("%-32s %10u %9.1fs %6.1f%%\n", it->first.c_str(),
+           it->second.NumSelections, it->second.Time,
+           EndTime > 0 ? 100 * it->second.Time / EndTime : 0.0);
+
+  printf("\n%-8s %8s %6s %10s %12s\n", "light", "kind", "duty", "switches",
+         "longest on");
+  for (unsigned i = 0, e = LightSetup.size(); i != e; ++i) {
+    const StatsLightController::LightStats &LS =
+      Stats->Lights[LightSetup[i].Index];
+    printf("%-8u %8s %5.1f%% %10u %11.1fs\n", LightSetup[i].Index,
+           LightSetup[i].isStrobe() ? "strobe" : "pinspot",
+           EndTime > 0 ? 100 * LS.EnabledTime / EndTime : 0.0,
+           LS.NumSwitches, LS.LongestEnabledTime);
+  }
+
+  delete LightManager;
+  set_clock(0);
+  delete Clock;
+
+  return 0;
+}
@@ -1,4 +1,8 @@
+#include <cctype>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -6,10 +10,18 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "AsyncLightController.h"
 #include "AudioMonitor.h"
+#include "BeatPredictor.h"
+#include "BufferedAudioHandler.h"
+#include "Clock.h"
+#include "Latency.h"
 #include "LightInfo.h"
 #include "LightManager.h"
+#include "LightProgram.h"
 #include "MusicMonitor.h"
+#include "ProgramWatcher.h"
+#include "RenderLoop.h"
 #include "SimLightController.h"
 #include "Util.h"
 
@@ -17,11 +29,15 @@
 
 class LoggingAudioHandler : public AudioMonitorHandler {
 public:
-  virtual void HandleSample(double time, double left, double right) {
-    static int count;
-    if ((++count % 10000) == 0)
+  virtual void HandleBlock(const float *left, const float *right,
+                           unsigned frames, double start_time) {
+    static unsigned count;
+    // Log the first sample of each block which crosses a 10000 sample mark.
+    unsigned next = count + frames;
+    if (next / 10000 != count / 10000)
       fprintf(stderr, "%.2fs, %.2fs: (%.2f, %.2f)\n",
-              get_elapsed_time_in_seconds(), time, left, right);
+              get_elapsed_time_in_seconds(), start_time, left[0], right[0]);
+    count = next;
   }
 };
 
@@ -57,9 +73,54 @@ public:
   }
 };
 
+static void DumpLatencies() {
+  latency_dump(stderr);
+}
+
+/// Parse \arg s as a non-negative decimal number into \arg result, returning
+/// false if it isn't one or doesn't fit.
+static bool parse_unsigned(const char *s, unsigned &result) {
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(s, &end, 10);
+  if (!isdigit((unsigned char) s[0]) || *end || errno || value > UINT_MAX)
+    return false;
+  result = value;
+  return true;
+}
+
 int main(int argc, char **argv) {
   bool SwitchLights = true;
   const char *LogBeats = 0;
+  unsigned AudioBufferFrames = 16384;
+  const char *ALSADevice = "default";
+  unsigned ALSAPeriodFrames = 256;
+  const char *ReplayPath = 0;
+  bool ReplayFast = false;
+  double ReplayRate = 44100;
+  bool UseSim = true;
+  bool HeadlessSim = false;
+  const char *SimDumpPath = 0;
+#ifdef HAVE_AUBIO
+  std::string OnsetDetector = "aubio";
+#else
+  std::string OnsetDetector = "flux";
+#endif
+  const char *SpectralKernels = "auto";
+  unsigned OnsetBands = 3;
+  bool PredictBeats = false;
+  double DetectionLatency = .015;
+  double RelayLatency = .010;
+  bool AsyncOutput = true;
+  const char *ArtNetAddress = 0;
+  unsigned ArtNetFirstUniverse = 0;
+  unsigned ArtNetUniverses = 1;
+  unsigned ArtNetChannelsPerLight = 1;
+  std::string ClockName = "system";
+  double FrameRate = 100;
+  std::string ProgramsPath = "programs";
+  bool ReloadPrograms = true;
+  const char *SetupPath = 0;
 
   for (int i = 1; i != argc; ++i) {
     std::string arg = argv[i];
@@ -74,63 +135,363 @@ int main(int argc, char **argv) {
         return 1;
       }
       LogBeats = argv[i];
+    } else if (arg == "--audio-buffer-frames") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      AudioBufferFrames = atoi(argv[i]);
+    } else if (arg == "--alsa-device") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ALSADevice = argv[i];
+    } else if (arg == "--alsa-period-frames") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ALSAPeriodFrames = atoi(argv[i]);
+    } else if (arg == "--replay") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ReplayPath = argv[i];
+    } else if (arg == "--replay-fast") {
+      ReplayFast = true;
+    } else if (arg == "--replay-rate") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ReplayRate = atof(argv[i]);
+    } else if (arg == "--onset") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      OnsetDetector = argv[i];
+    } else if (arg == "--spectral-kernels") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      SpectralKernels = argv[i];
+    } else if (arg == "--onset-bands") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      // The spectral flux monitor splits into low, mid and high bands, or
+      // uses the full band.
+      if (strcmp(argv[i], "1") != 0 && strcmp(argv[i], "3") != 0) {
+        fprintf(stderr, "%s: invalid argument to: %s: %s (expected 1 or 3)\n",
+                argv[0], arg.c_str(), argv[i]);
+        return 1;
+      }
+      OnsetBands = atoi(argv[i]);
+    } else if (arg == "--predict-beats") {
+      PredictBeats = true;
+    } else if (arg == "--no-predict-beats") {
+      PredictBeats = false;
+    } else if (arg == "--detection-latency") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      DetectionLatency = atof(argv[i]);
+    } else if (arg == "--relay-latency") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      RelayLatency = atof(argv[i]);
+    } else if (arg == "--async-output") {
+      AsyncOutput = true;
+    } else if (arg == "--no-async-output") {
+      AsyncOutput = false;
+    } else if (arg == "--artnet") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ArtNetAddress = argv[i];
+    } else if (arg == "--artnet-first-universe") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      if (!parse_unsigned(argv[i], ArtNetFirstUniverse)) {
+        fprintf(stderr, "%s: invalid argument to: %s: %s\n", argv[0],
+                arg.c_str(), argv[i]);
+        return 1;
+      }
+    } else if (arg == "--artnet-universes") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      if (!parse_unsigned(argv[i], ArtNetUniverses)) {
+        fprintf(stderr, "%s: invalid argument to: %s: %s\n", argv[0],
+                arg.c_str(), argv[i]);
+        return 1;
+      }
+    } else if (arg == "--artnet-channels-per-light") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      if (!parse_unsigned(argv[i], ArtNetChannelsPerLight)) {
+        fprintf(stderr, "%s: invalid argument to: %s: %s\n", argv[0],
+                arg.c_str(), argv[i]);
+        return 1;
+      }
+    } else if (arg == "--clock") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ClockName = argv[i];
+    } else if (arg == "--frame-rate") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      FrameRate = atof(argv[i]);
+    } else if (arg == "--programs") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      ProgramsPath = argv[i];
+    } else if (arg == "--lights") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      SetupPath = argv[i];
+    } else if (arg == "--reload-programs") {
+      ReloadPrograms = true;
+    } else if (arg == "--no-reload-programs") {
+      ReloadPrograms = false;
+    } else if (arg == "--sim") {
+      UseSim = true;
+      HeadlessSim = false;
+    } else if (arg == "--no-sim") {
+      UseSim = false;
+    } else if (arg == "--headless-sim") {
+      UseSim = HeadlessSim = true;
+    } else if (arg == "--sim-dump") {
+      if (++i == argc) {
+        fprintf(stderr, "%s: missing argument to: %s\n", argv[0], arg.c_str());
+        return 1;
+      }
+      // Only the headless simulator can dump its frames.
+      UseSim = HeadlessSim = true;
+      SimDumpPath = argv[i];
     } else {
       fprintf(stderr, "%s: unknown argument: %s\n", argv[0], arg.c_str());
       return 1;
     }
   }
 
-  // Set a random seed.
-  union {
-    double fVal;
-    long long llVal;
-  } Seed = { get_time_in_seconds() };
-  srand48(Seed.llVal);
+  if (FrameRate < RenderLoop::kMinFrameRate ||
+      FrameRate > RenderLoop::kMaxFrameRate) {
+    fprintf(stderr, "%s: frame rate must be %d-%dHz: %g\n", argv[0],
+            RenderLoop::kMinFrameRate, RenderLoop::kMaxFrameRate, FrameRate);
+    return 1;
+  }
+
+  // A later --sim or --no-sim would otherwise drop the dump unnoticed.
+  if (SimDumpPath && !(UseSim && HeadlessSim)) {
+    fprintf(stderr, "%s: --sim-dump needs the headless simulator\n", argv[0]);
+    return 1;
+  }
+
+  // This must happen before any threads are started. The exit dump is done with
+  // atexit() since the simulator exits directly.
+  latency_start_signal_dump();
+  atexit(DumpLatencies);
+
+  // Select the clock before anything takes a timestamp.
+  Clock *TSC = 0;
+  if (ClockName == "tsc") {
+    TSC = CreateTSCClock();
+    if (!TSC)
+      return 1;
+    set_clock(TSC);
+  } else if (ClockName != "system") {
+    fprintf(stderr, "%s: unknown clock: %s\n", argv[0], ClockName.c_str());
+    return 1;
+  }
+
+  // Seed the random choices from the time.
+  uint64_t Seed = get_time_in_ns();
 
-  // We just hard code the light configuration for now.
   std::vector<LightInfo> LightSetup;
-  LightSetup.push_back(LightInfo::Make(LightInfo::kLightKind_Pinspot,
-                                       LightInfo::kLightColor_White,
-                                       /*Index=*/0));
-  LightSetup.push_back(LightInfo::Make(LightInfo::kLightKind_Pinspot,
-                                       LightInfo::kLightColor_Red,
-                                       /*Index=*/1));
-  LightSetup.push_back(LightInfo::Make(LightInfo::kLightKind_Pinspot,
-                                       LightInfo::kLightColor_Green,
-                                       /*Index=*/2));
-  LightSetup.push_back(LightInfo::Make(LightInfo::kLightKind_Strobe,
-                                       LightInfo::kLightColor_White,
-                                       /*Index=*/3));
+  if (!SetupPath)
+    LightSetup = LightInfo::GetDefaultSetup();
+  else if (!LightInfo::LoadSetup(SetupPath, LightSetup))
+    return 1;
+
+  // Load the light programs.
+  std::vector<LightProgram *> Programs;
+  if (!LightProgram::LoadAllPrograms(ProgramsPath, Programs))
+    return 1;
+  if (Programs.empty()) {
+    fprintf(stderr, "%s: no light programs in: %s\n", argv[0],
+            ProgramsPath.c_str());
+    return 1;
+  }
 
   // Create the light controller.
-  SimLightController *SLC = CreateSimLightController();
-  LightController *controller = SLC;
+  SimLightController *SLC = 0;
+  AsyncLightController *ALC = 0;
+  LightController *controller = 0;
+  if (UseSim) {
+    if (HeadlessSim) {
+      SLC = CreateHeadlessSimLightController(SimDumpPath);
+      if (!SLC)
+        return 1;
+    } else {
+      SLC = CreateSimLightController();
+    }
+    controller = SLC;
+  }
+
+  if (SwitchLights) {
+    LightController *Phidget = CreatePhidgetLightController(RelayLatency);
+    // Relay writes are USB round trips, keep them off the beat path.
+    if (AsyncOutput)
+      Phidget = ALC = CreateAsyncLightController(Phidget);
+    controller = controller ? CreateChainedLightController(controller, Phidget)
+      : Phidget;
+  }
+
+  if (ArtNetAddress) {
+    LightController *ArtNet =
+      CreateArtNetLightController(ArtNetAddress, ArtNetFirstUniverse,
+                                  ArtNetUniverses, ArtNetChannelsPerLight);
+    if (!ArtNet)
+      return 1;
+    controller = controller ? CreateChainedLightController(controller, ArtNet)
+      : ArtNet;
+  }
 
-  if (SwitchLights)
-    controller = CreateChainedLightController(SLC,
-                                              CreatePhidgetLightController());
+  if (!controller)
+    controller = CreateNullLightController();
 
   // Create the light manager as our handler.
-  LightManager *LightManager = CreateLightManager(controller, LightSetup);
-  SLC->RegisterLightManager(*LightManager);
+  LightManager *LightManager = CreateLightManager(controller, LightSetup,
+                                                   Programs, Seed);
+  if (SLC)
+    SLC->RegisterLightManager(*LightManager);
+
+  // Run the programs and fades between beats.
+  RenderLoop *RL = CreateRenderLoop(*LightManager, FrameRate);
+
+  // Pick up program changes during the show.
+  ProgramWatcher *PW = 0;
+  if (ReloadPrograms)
+    PW = CreateProgramWatcher(*LightManager, ProgramsPath);
 
   // Form the final music monitor handler.
   MusicMonitorHandler *MMH = LightManager;
+  BeatPredictor *BP = 0;
+  if (PredictBeats)
+    MMH = BP = CreateBeatPredictor(MMH, controller->GetOutputLatency(),
+                                   DetectionLatency);
   if (LogBeats)
     MMH = new LoggingMusicHandler(LogBeats, MMH);
 
-  MusicMonitor *MM = CreateAubioMusicMonitor(MMH);
-  AudioMonitor *AM = CreateOSXAudioMonitor(MM);
+  MusicMonitor *MM = 0;
+  if (OnsetDetector == "flux") {
+    MM = CreateSpectralFluxMusicMonitor(MMH, SpectralKernels, OnsetBands);
+#ifdef HAVE_AUBIO
+  } else if (OnsetDetector == "aubio") {
+    MM = CreateAubioMusicMonitor(MMH);
+#endif
+  } else {
+    fprintf(stderr, "%s: unknown onset detector: %s\n", argv[0],
+            OnsetDetector.c_str());
+    return 1;
+  }
+  if (!MM)
+    return 1;
+
+  AudioMonitor *AM;
+  BufferedAudioHandler *BAH = 0;
+  if (ReplayPath) {
+    // Replay runs on its own thread already, and mustn't drop samples when
+    // running faster than real time, so it feeds the monitor directly.
+    AM = CreateFileAudioMonitor(MM, ReplayPath, !ReplayFast, ReplayRate);
+  } else {
+    // Run the analysis on its own thread, so the audio callback never waits on
+    // beat detection or light switching.
+    BAH = CreateBufferedAudioHandler(MM, AudioBufferFrames);
+#ifdef __APPLE__
+    AM = CreateOSXAudioMonitor(BAH);
+#else
+    AM = CreateALSAAudioMonitor(BAH, ALSADevice, ALSAPeriodFrames);
+#endif
+  }
 
   AM->Start();
 
   //  sleep(2 * 60 * 60);
-  SLC->MainLoop();
+  // The GLUT simulator's loop never returns, while the headless one renders
+  // in the background.
+  if (SLC)
+    SLC->MainLoop();
+  AM->Wait();
 
   AM->Stop();
+  delete PW;
+
+  // Stop rendering too, so the output stats are final.
+  RenderLoop::FrameStats FS = RL->GetFrameStats();
+  delete RL;
+  if (SLC)
+    SLC->Finish();
+
+  if (BAH)
+    fprintf(stderr, "audio buffer: %u/%u frames max fill, %llu overruns\n",
+            BAH->GetMaxFillFrames(), BAH->GetCapacityFrames(),
+            (unsigned long long) BAH->GetOverrunCount());
+
+  if (ALC) {
+    AsyncLightController::OutputStats Stats = ALC->GetOutputStats();
+    fprintf(stderr, "light output: %llu frames (%llu coalesced), %llu writes "
+            "(%llu redundant skipped), max queue depth %u, write latency "
+            "%.2fms mean, %.2fms max\n",
+            (unsigned long long) Stats.NumFrames,
+            (unsigned long long) Stats.NumCoalescedFrames,
+            (unsigned long long) Stats.NumWrites,
+            (unsigned long long) Stats.NumRedundantWrites, Stats.MaxQueueDepth,
+            Stats.MeanWriteLatency * 1e3, Stats.MaxWriteLatency * 1e3);
+  }
+
+  fprintf(stderr, "render loop: %llu frames at %gHz (%llu missed, %llu late), "
+          "jitter %.3fms mean, %.3fms max, render %.3fms mean, %.3fms max\n",
+          (unsigned long long) FS.NumFrames, FrameRate,
+          (unsigned long long) FS.NumMissedFrames,
+          (unsigned long long) FS.NumLateFrames, FS.MeanJitter * 1e3,
+          FS.MaxJitter * 1e3, FS.MeanRenderTime * 1e3,
+          FS.MaxRenderTime * 1e3);
+
+  if (BP) {
+    BeatPredictor::PhaseErrorStats Stats = BP->GetPhaseErrorStats();
+    fprintf(stderr, "beat prediction: %u beats, phase error %.1fms mean, "
+            "%.1fms RMS\n", Stats.Count, Stats.Mean * 1e3, Stats.RMS * 1e3);
+  }
 
   delete AM;
 
+  set_clock(0);
+  delete TSC;
+
   return 0;
 }
 